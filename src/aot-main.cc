@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <elf.h>
+#include <vector>
+#include <deque>
+#include <set>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "dbi/util.hh"
+#include "dbi/decoder.hh"
+#include "dbi/block.hh"
+#include "dbi/trans-cache.hh"
+
+/* Static recovery of block entry points from an ELF file, for use with --trans-cache. Seeds are
+ * the entry point and function symbols; blocks are followed through direct branches, conditional
+ * fallthroughs and call return sites. Indirect targets are left to lazy translation.
+ */
+namespace {
+
+  struct Image {
+    std::vector<char> file;
+    std::vector<const Elf64_Shdr *> text_shdrs; // executable sections
+    uintptr_t base = 0; // vaddr of the segment mapped at file offset 0
+
+    const Elf64_Ehdr& ehdr() const { return *reinterpret_cast<const Elf64_Ehdr *>(file.data()); }
+
+    template <typename T>
+    const T *at(size_t offset, size_t count = 1) const {
+      if (offset > file.size() || count * sizeof(T) > file.size() - offset) {
+	return nullptr;
+      }
+      return reinterpret_cast<const T *>(file.data() + offset);
+    }
+
+    /* file contents at a virtual address in an executable section */
+    const uint8_t *code(uintptr_t vaddr, size_t& avail) const {
+      for (const Elf64_Shdr *shdr : text_shdrs) {
+	if (vaddr >= shdr->sh_addr && vaddr < shdr->sh_addr + shdr->sh_size) {
+	  avail = shdr->sh_addr + shdr->sh_size - vaddr;
+	  return reinterpret_cast<const uint8_t *>(file.data() + shdr->sh_offset +
+						   (vaddr - shdr->sh_addr));
+	}
+      }
+      return nullptr;
+    }
+  };
+
+  bool load_image(const char *path, Image& image) {
+    std::ifstream ifs(path, std::ifstream::binary);
+    image.file.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    const Elf64_Ehdr *ehdr = image.at<Elf64_Ehdr>(0);
+    if (ehdr == nullptr || std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+	ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_machine != EM_X86_64) {
+      return false;
+    }
+
+    const Elf64_Phdr *phdrs = image.at<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+    const Elf64_Shdr *shdrs = image.at<Elf64_Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+    if (phdrs == nullptr || shdrs == nullptr) {
+      return false;
+    }
+    const auto load_it = std::find_if(phdrs, phdrs + ehdr->e_phnum, [] (const Elf64_Phdr& phdr) {
+      return phdr.p_type == PT_LOAD && phdr.p_offset == 0;
+    });
+    if (load_it == phdrs + ehdr->e_phnum) {
+      return false;
+    }
+    image.base = load_it->p_vaddr & ~(dbi::PAGESIZE - 1);
+
+    for (unsigned i = 0; i < ehdr->e_shnum; ++i) {
+      const Elf64_Shdr& shdr = shdrs[i];
+      if (shdr.sh_type == SHT_PROGBITS && (shdr.sh_flags & SHF_ALLOC) &&
+	  (shdr.sh_flags & SHF_EXECINSTR) && image.at<char>(shdr.sh_offset, shdr.sh_size)) {
+	image.text_shdrs.push_back(&shdr);
+      }
+    }
+    return !image.text_shdrs.empty();
+  }
+
+  /* entry point and defined functions in executable sections, from .symtab and .dynsym */
+  void find_seeds(const Image& image, std::vector<uintptr_t>& seeds) {
+    const Elf64_Ehdr& ehdr = image.ehdr();
+    const Elf64_Shdr *shdrs = image.at<Elf64_Shdr>(ehdr.e_shoff, ehdr.e_shnum);
+    seeds.push_back(ehdr.e_entry);
+    for (unsigned i = 0; i < ehdr.e_shnum; ++i) {
+      const Elf64_Shdr& shdr = shdrs[i];
+      if (shdr.sh_type != SHT_SYMTAB && shdr.sh_type != SHT_DYNSYM) {
+	continue;
+      }
+      const size_t nsyms = shdr.sh_size / sizeof(Elf64_Sym);
+      const Elf64_Sym *syms = image.at<Elf64_Sym>(shdr.sh_offset, nsyms);
+      if (syms == nullptr) {
+	continue;
+      }
+      for (size_t j = 0; j < nsyms; ++j) {
+	if (ELF64_ST_TYPE(syms[j].st_info) == STT_FUNC && syms[j].st_shndx != SHN_UNDEF) {
+	  seeds.push_back(syms[j].st_value);
+	}
+      }
+    }
+  }
+
+  /* Follows blocks from the seeds; returns the entry points found, as vaddrs. Only blocks that
+   * decode up to their terminating branch are returned: the tracer translates the cached entry
+   * points eagerly, and one that fails to decode (data in text, a misaligned seed, a block
+   * running off its section) must be left to lazy translation instead.
+   */
+  std::set<uintptr_t> find_blocks(const Image& image, const std::vector<uintptr_t>& seeds) {
+    std::set<uintptr_t> entries;
+    std::set<uintptr_t> visited;
+    std::deque<uintptr_t> worklist;
+    const auto push = [&] (uintptr_t vaddr) {
+      size_t avail;
+      if (image.code(vaddr, avail) != nullptr && visited.insert(vaddr).second) {
+	worklist.push_back(vaddr);
+      }
+    };
+    for (uintptr_t seed : seeds) {
+      push(seed);
+    }
+
+    while (!worklist.empty()) {
+      const uintptr_t entry = worklist.front();
+      worklist.pop_front();
+      uintptr_t vaddr = entry;
+      while (true) {
+	size_t avail;
+	const uint8_t *data = image.code(vaddr, avail);
+	if (data == nullptr) {
+	  break;
+	}
+	const dbi::Instruction inst(reinterpret_cast<uint8_t *>(vaddr), data,
+				    data + std::min<size_t>(avail, dbi::Instruction::max_inst_len));
+	if (!inst) {
+	  break;
+	}
+	const uintptr_t next = vaddr + inst.size();
+	if (!dbi::Block::classify_inst(inst)) {
+	  vaddr = next;
+	  continue;
+	}
+
+	entries.insert(entry);
+
+	switch (inst.xed_iform()) {
+	case XED_IFORM_JMP_RELBRb:
+	case XED_IFORM_JMP_RELBRd:
+	  push(reinterpret_cast<uintptr_t>(inst.branch_dst()));
+	  break;
+	case XED_IFORM_CALL_NEAR_RELBRd:
+	  push(reinterpret_cast<uintptr_t>(inst.branch_dst()));
+	  push(next); // return site
+	  break;
+	default:
+	  switch (inst.xed_iclass()) {
+	  case XED_ICLASS_JMP:
+	  case XED_ICLASS_RET_NEAR:
+	    break;
+	  case XED_ICLASS_CALL_NEAR:
+	    push(next);
+	    break;
+	  default: // conditional
+	    push(reinterpret_cast<uintptr_t>(inst.branch_dst()));
+	    push(next);
+	    break;
+	  }
+	}
+	break;
+      }
+    }
+
+    return entries;
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  const auto usage = [=] (FILE *f) {
+    const char *usage =
+      "usage: %s [-h] [-o <dir>] file...\n"				\
+      "Recover the blocks of ELF files, and add them to a translation cache\n" \
+      "(see --trans-cache), so that they are translated before they first run.\n" \
+      "Options:\n"							\
+      " -h        show help\n"						\
+      " -o <dir>  translation cache directory (default: .)\n"		\
+      " -v        print the number of blocks found in each file\n"	\
+      ""
+      ;
+    fprintf(f, usage, argv[0]);
+  };
+
+  std::string dir = ".";
+  bool verbose = false;
+  const char *optstring = "ho:v";
+  int optchar;
+  while ((optchar = getopt(argc, argv, optstring)) >= 0) {
+    switch (optchar) {
+    case 'h':
+      usage(stdout);
+      return 0;
+
+    case 'o':
+      dir = optarg;
+      break;
+
+    case 'v':
+      verbose = true;
+      break;
+
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(stderr);
+    return 1;
+  }
+
+  dbi::Decoder::Init();
+
+  int status = 0;
+  for (int i = optind; i < argc; ++i) {
+    const char *path = argv[i];
+    const std::string build_id = dbi::TransCache::read_build_id(path);
+    Image image;
+    if (build_id.empty() || !load_image(path, image)) {
+      std::cerr << argv[0] << ": " << path << ": not an x86-64 ELF file with a build-id\n";
+      status = 1;
+      continue;
+    }
+
+    std::vector<uintptr_t> seeds;
+    find_seeds(image, seeds);
+    dbi::TransCache::Offsets offsets;
+    for (uintptr_t vaddr : find_blocks(image, seeds)) {
+      offsets.insert(vaddr - image.base);
+    }
+    if (!dbi::TransCache::merge_file(dir + "/" + build_id, offsets)) {
+      status = 1;
+      continue;
+    }
+    if (verbose) {
+      std::cout << path << ": " << offsets.size() << " blocks\n";
+    }
+  }
+
+  return status;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "dbi/decoder.hh"
+#include "dbi/inst.hh"
+#include "dbi/tracee.hh"
+#include "dbi/tracees.hh"
+#include "dbi/block-pool.hh"
+#include "dbi/bkpt-table.hh"
+
+/* Microbenchmarks of tracer-side hot paths that do not need a tracee. Build without assertions
+ * (-DNDEBUG): several of the measured paths only decode in assertions.
+ */
+namespace {
+
+  volatile uint64_t sink; // keeps results alive
+
+  template <typename Func>
+  void report(const char *name, size_t ops, Func func) {
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << ops << " ops, " << elapsed.count() / ops << " ns/op\n";
+  }
+
+  /* Retargeting and relocating decoded branches (Instruction::patch_relbr), and synthesizing
+   * the branches that terminators emit.
+   */
+  void bench_relbr(size_t iters) {
+    uint8_t *pc = reinterpret_cast<uint8_t *>(0x400000);
+    const std::vector<std::vector<uint8_t>> branches = {
+      {0xe9, 0x10, 0x00, 0x00, 0x00},       // jmp rel32
+      {0x0f, 0x84, 0x10, 0x00, 0x00, 0x00}, // jz rel32
+      {0xe8, 0x10, 0x00, 0x00, 0x00},       // call rel32
+      {0xeb, 0x10},                         // jmp rel8, widened on the first relocation
+    };
+    std::vector<dbi::Instruction> insts;
+    for (const auto& bytes : branches) {
+      insts.emplace_back(pc, bytes.begin(), bytes.end());
+    }
+
+    report("relbr relocate", iters * insts.size(), [&] {
+      for (size_t i = 0; i < iters; ++i) {
+	for (dbi::Instruction& inst : insts) {
+	  inst.relocate(pc + (i & 0xfff0));
+	  sink += inst.data()[inst.size() - 1];
+	}
+      }
+    });
+
+    report("relbr retarget", iters * insts.size(), [&] {
+      for (size_t i = 0; i < iters; ++i) {
+	for (dbi::Instruction& inst : insts) {
+	  inst.retarget(pc + (i & 0xfff0));
+	  sink += inst.data()[inst.size() - 1];
+	}
+      }
+    });
+
+    report("relbr synthesize", iters * 2, [&] {
+      for (size_t i = 0; i < iters; ++i) {
+	const auto jmp = dbi::Instruction::jmp_relbrd(pc, pc + (i & 0xfff0));
+	const auto jcc = dbi::Instruction::jcc_relbrd(pc, XED_ICLASS_JZ, pc + (i & 0xfff0));
+	sink += jmp.data()[jmp.size() - 1] + jcc.data()[jcc.size() - 1];
+      }
+    });
+  }
+
+  /* Breakpoint dispatch (BkptTable::find), which resolves the block pool offset of the trapping
+   * address, for breakpoints spread over several pool segments. Handlers registered without a
+   * closure are compared with closures, and both with the unordered_map of closures that the
+   * table replaced. Needs a stopped tracee to map the pool into.
+   */
+  void bench_bkpt(size_t iters) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+      raise(SIGSTOP);
+      _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+      std::perror("waitpid");
+      std::abort();
+    }
+
+    {
+      dbi::Tracees tracees;
+      tracees.emplace_back(dbi::Tracee {pid, "bench", true}, dbi::TraceeInfo {false});
+      dbi::Tracee& tracee = tracees.front().tracee;
+
+      constexpr size_t segment_size = 0x10000;
+      constexpr size_t nsegments = 8;
+      constexpr size_t nbkpts = 0x1000;
+      dbi::BlockPool block_pool(tracees, segment_size, nsegments);
+      dbi::BkptTable handler_table(block_pool);
+      dbi::BkptTable closure_table(block_pool);
+      std::unordered_map<uint8_t *, dbi::BkptCallback> bkpt_map;
+
+      struct Counter {
+	uint64_t hits = 0;
+	void hit(dbi::Tracee&) { ++hits; }
+      } counter;
+
+      std::vector<uint8_t *> bkpts;
+      for (size_t i = 0; i < nbkpts; ++i) {
+	if (i % (nbkpts / nsegments) == 0 && i > 0) {
+	  block_pool.reserve(segment_size); // next segment
+	}
+	uint8_t *bkpt = block_pool.alloc(segment_size / (nbkpts / nsegments));
+	bkpts.push_back(bkpt);
+	handler_table.insert(bkpt, dbi::BkptHandler::member<Counter, &Counter::hit>(&counter));
+	const dbi::BkptCallback closure = [&counter] (dbi::Tracee& tracee, uint8_t *) {
+	  counter.hit(tracee);
+	};
+	closure_table.insert(bkpt, closure);
+	bkpt_map.emplace(bkpt, closure);
+      }
+
+      report("bkpt handler", iters, [&] {
+	for (size_t i = 0; i < iters; ++i) {
+	  uint8_t *bkpt = bkpts[(i * 7) % nbkpts];
+	  (*handler_table.find(bkpt))(tracee, bkpt);
+	}
+      });
+
+      report("bkpt closure", iters, [&] {
+	for (size_t i = 0; i < iters; ++i) {
+	  uint8_t *bkpt = bkpts[(i * 7) % nbkpts];
+	  (*closure_table.find(bkpt))(tracee, bkpt);
+	}
+      });
+
+      report("bkpt map (before)", iters, [&] {
+	for (size_t i = 0; i < iters; ++i) {
+	  uint8_t *bkpt = bkpts[(i * 7) % nbkpts];
+	  bkpt_map.at(bkpt)(tracee, bkpt);
+	}
+      });
+
+      sink += counter.hits;
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+  }
+
+  struct Bench {
+    const char *name;
+    void (*run)(size_t iters);
+  };
+  const Bench benches[] = {
+    {"relbr", bench_relbr},
+    {"bkpt", bench_bkpt},
+  };
+
+}
+
+int main(int argc, char *argv[]) {
+  const auto usage = [=] (FILE *f) {
+    const char *usage =
+      "usage: %s [-h] [-n <iters>] [bench...]\n"			\
+      "Run tracer microbenchmarks (default: all).\n"			\
+      "Options:\n"							\
+      " -h          show help\n"					\
+      " -n <iters>  iterations of each benchmark (default: 1000000)\n"	\
+      ""
+      ;
+    fprintf(f, usage, argv[0]);
+    fprintf(f, "Benchmarks:");
+    for (const Bench& bench : benches) {
+      fprintf(f, " %s", bench.name);
+    }
+    fprintf(f, "\n");
+  };
+
+  size_t iters = 1000000;
+  const char *optstring = "hn:";
+  int optchar;
+  while ((optchar = getopt(argc, argv, optstring)) >= 0) {
+    switch (optchar) {
+    case 'h':
+      usage(stdout);
+      return 0;
+
+    case 'n':
+      {
+	char *end;
+	iters = strtoul(optarg, &end, 0);
+	if (*optarg == '\0' || *end != '\0' || iters == 0) {
+	  usage(stderr);
+	  return 1;
+	}
+      }
+      break;
+
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+
+#ifndef NDEBUG
+  std::cerr << argv[0] << ": warning: built with assertions, which decode on several paths\n";
+#endif
+
+  dbi::Decoder::Init();
+
+  int status = 0;
+  for (const Bench& bench : benches) {
+    bool selected = optind == argc;
+    for (int i = optind; i < argc; ++i) {
+      selected |= std::strcmp(argv[i], bench.name) == 0;
+    }
+    if (selected) {
+      bench.run(iters);
+    }
+  }
+  for (int i = optind; i < argc; ++i) {
+    const bool known = std::any_of(std::begin(benches), std::end(benches), [&] (const Bench& b) {
+      return std::strcmp(argv[i], b.name) == 0;
+    });
+    if (!known) {
+      std::cerr << argv[0] << ": unknown benchmark '" << argv[i] << "'\n";
+      status = 1;
+    }
+  }
+
+  return status;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cassert>
+#include "util.hh"
+
+namespace dbi {
+
+  /* Bump allocator for translation metadata (blocks, terminators), which is only ever freed all
+   * at once when the code cache is flushed. Destructors of objects that need them are recorded
+   * and run by clear(), which keeps the chunks for reuse.
+   */
+  class Arena {
+  public:
+    Arena(size_t chunk_size = 0x40000): chunk_size(chunk_size) {}
+    ~Arena() { clear(); }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template <typename T, typename... Args>
+    T *make(Args&&... args) {
+      T *obj = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      if (!std::is_trivially_destructible<T>()) {
+	dtors.push_back(Dtor {&destroy<T>, obj});
+      }
+      return obj;
+    }
+
+    template <typename T, typename InputIt>
+    T *copy(InputIt begin, InputIt end) {
+      static_assert(std::is_trivially_copyable<T>(), "require trivially copyable type");
+      T *arr = static_cast<T *>(alloc(sizeof(T) * std::distance(begin, end), alignof(T)));
+      std::copy(begin, end, arr);
+      return arr;
+    }
+
+    void *alloc(size_t size, size_t align) {
+      uintptr_t ptr = util::align_up(reinterpret_cast<uintptr_t>(it), align);
+      if (cur == chunks.size() || ptr + size > reinterpret_cast<uintptr_t>(end)) {
+	next_chunk(size + align);
+	ptr = util::align_up(reinterpret_cast<uintptr_t>(it), align);
+      }
+      it = reinterpret_cast<uint8_t *>(ptr + size);
+      used_ += size;
+      return reinterpret_cast<void *>(ptr);
+    }
+
+    void clear() {
+      std::for_each(dtors.rbegin(), dtors.rend(), [] (const Dtor& dtor) { dtor.fn(dtor.obj); });
+      dtors.clear();
+      cur = chunks.size();
+      it = end = nullptr;
+      next = 0;
+      used_ = 0;
+    }
+
+    /* allocation state, for discarding what was made since (e.g. by a failed translation) */
+    struct Mark {
+      size_t cur;
+      size_t next;
+      uint8_t *it;
+      uint8_t *end;
+      size_t used;
+      size_t ndtors;
+    };
+
+    Mark mark() const { return Mark {cur, next, it, end, used_, dtors.size()}; }
+
+    void rewind(const Mark& mark) {
+      assert(mark.ndtors <= dtors.size());
+      std::for_each(dtors.rbegin(), dtors.rend() - mark.ndtors,
+		    [] (const Dtor& dtor) { dtor.fn(dtor.obj); });
+      dtors.resize(mark.ndtors);
+      cur = mark.cur;
+      next = mark.next;
+      it = mark.it;
+      end = mark.end;
+      used_ = mark.used;
+    }
+
+    size_t used() const { return used_; }
+    size_t capacity() const {
+      size_t size = 0;
+      for (const Chunk& chunk : chunks) { size += chunk.size; }
+      return size;
+    }
+
+  private:
+    struct Chunk {
+      std::unique_ptr<uint8_t[]> mem;
+      size_t size;
+    };
+    struct Dtor {
+      void (*fn)(void *);
+      void *obj;
+    };
+
+    size_t chunk_size;
+    std::vector<Chunk> chunks;
+    size_t cur = 0;  // chunk being allocated from; chunks.size() if none
+    size_t next = 0; // next chunk to reuse after a clear()
+    uint8_t *it = nullptr;
+    uint8_t *end = nullptr;
+    size_t used_ = 0;
+    std::vector<Dtor> dtors;
+
+    template <typename T>
+    static void destroy(void *obj) { static_cast<T *>(obj)->~T(); }
+
+    void next_chunk(size_t min_size) {
+      /* reuse chunks kept across clear() first, skipping any that are too small */
+      while (next < chunks.size() && chunks[next].size < min_size) {
+	++next;
+      }
+      if (next == chunks.size()) {
+	const size_t size = std::max(chunk_size, min_size);
+	chunks.push_back(Chunk {std::unique_ptr<uint8_t[]>(new uint8_t[size]), size});
+      }
+      cur = next++;
+      it = chunks[cur].mem.get();
+      end = it + chunks[cur].size;
+    }
+  };
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <cstdint>
+#include <cassert>
+#include "block-pool.hh"
+#include "types.hh"
+
+namespace dbi {
+
+  /* Breakpoint dispatch table indexed by offset into the block pool.
+   * Offsets are grouped into buckets of bucket_size bytes; each bucket holds the 32-bit index
+   * of the first of a short list of compact handler records (function pointer + context), so
+   * dispatch is two array loads, a walk over the few breakpoints of one bucket, and an
+   * indirect call. The index costs a quarter byte per byte of code, where one entry per byte
+   * would cost four.
+   * Callbacks wrapping a BkptHandler are unwrapped; other closures are kept in a deque, which
+   * never moves them, and dispatched through it.
+   */
+  class BkptTable {
+  public:
+    using Handler = BkptHandler;
+    static constexpr unsigned bucket_bits = 4;
+    static constexpr size_t bucket_size = size_t(1) << bucket_bits;
+    
+    BkptTable(const BlockPool& block_pool): block_pool(block_pool) {}
+
+    void insert(uint8_t *addr, const Handler& handler) {
+      size_t off;
+      const bool found = block_pool.offset(addr, off);
+      assert(found); (void) found;
+      assert(find(addr) == nullptr);
+      assert(off == static_cast<uint32_t>(off));
+      const size_t bucket = off >> bucket_bits;
+      if (bucket >= index.size()) {
+	index.resize(std::max(bucket + 1, index.size() * 2));
+      }
+      entries.push_back(Entry {handler, static_cast<uint32_t>(off), index[bucket]});
+      index[bucket] = entries.size(); // 0 ends a list
+    }
+
+    void insert(uint8_t *addr, const BkptCallback& callback) {
+      if (const Handler *handler = callback.target<Handler>()) {
+	insert(addr, *handler);
+	return;
+      }
+      closures.push_back(callback);
+      insert(addr, Handler {call_closure, &closures.back()});
+    }
+
+    /* handler of the breakpoint at addr; nullptr if none is registered there */
+    const Handler *find(uint8_t *addr) const {
+      size_t off;
+      if (!block_pool.offset(addr, off) || (off >> bucket_bits) >= index.size()) {
+	return nullptr;
+      }
+      for (uint32_t i = index[off >> bucket_bits]; i != 0; i = entries[i - 1].next) {
+	if (entries[i - 1].off == off) {
+	  return &entries[i - 1].handler;
+	}
+      }
+      return nullptr;
+    }
+
+    void clear() {
+      index.clear();
+      entries.clear();
+      closures.clear();
+    }
+
+    /* registrations, for unregistering those made since (e.g. by a failed translation) */
+    struct Mark {
+      size_t nentries;
+      size_t nclosures;
+    };
+
+    Mark mark() const { return Mark {entries.size(), closures.size()}; }
+
+    void rewind(const Mark& mark) {
+      assert(mark.nentries <= entries.size() && mark.nclosures <= closures.size());
+      /* later entries head their bucket's list, so unlink them newest first */
+      while (entries.size() > mark.nentries) {
+	const Entry& entry = entries.back();
+	index[entry.off >> bucket_bits] = entry.next;
+	entries.pop_back();
+      }
+      closures.resize(mark.nclosures);
+    }
+
+    size_t size() const { return entries.size(); }
+    
+  private:
+    struct Entry {
+      Handler handler;
+      uint32_t off;  // in the block pool
+      uint32_t next; // index + 1 of the next entry in the same bucket; 0 if none
+    };
+
+    const BlockPool& block_pool;
+    std::vector<uint32_t> index; // per bucket: index + 1 of its newest entry; 0 if none
+    std::vector<Entry> entries;
+    std::deque<BkptCallback> closures;
+
+    static void call_closure(void *ctx, Tracee& tracee, uint8_t *addr) {
+      (*static_cast<const BkptCallback *>(ctx))(tracee, addr);
+    }
+  };
+
+}
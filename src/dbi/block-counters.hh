@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/mman.h>
+#include "usermem.hh"
+#include "tracees.hh"
+
+namespace dbi {
+
+  /* Execution counters of tier-0 blocks in tracee memory (g_conf.tier_threshold). Each counter
+   * starts at the threshold and is decremented in-core on every entry to its block, which traps
+   * into the tracer once when it reaches zero. Counters are handed out until they run out, and
+   * reclaimed all at once on a code cache flush; blocks translated without one are not counted.
+   */
+  class BlockCounters {
+  public:
+    static constexpr size_t ncounters = 0x10000;
+
+    BlockCounters() {}
+    BlockCounters(Tracees& tracees) { open(tracees); }
+
+    bool good() const { return mem.good(); }
+    operator bool() const { return good(); }
+
+    void open(Tracees& tracees) {
+      mem.open_shared(tracees, ncounters * sizeof(int64_t), PROT_READ | PROT_WRITE);
+      used = 0;
+    }
+
+    /* returns nullptr if none are left */
+    int64_t *alloc(int64_t init) {
+      if (used == ncounters) {
+	return nullptr;
+      }
+      int64_t *counter = mem.begin<int64_t>() + used++;
+      __atomic_store_n(mem.local(counter), init, __ATOMIC_RELAXED);
+      return counter;
+    }
+
+    /* the tracees update counters without stopping, so read them through the shared mapping */
+    int64_t value(const int64_t *counter) const {
+      return __atomic_load_n(mem.local(counter), __ATOMIC_RELAXED);
+    }
+
+    /* counters handed out since mark() are taken back by rewind() */
+    size_t mark() const { return used; }
+    void rewind(size_t mark) { used = mark; }
+
+    void reset() { used = 0; }
+
+  private:
+    UserMemory mem;
+    size_t used = 0;
+  };
+
+}
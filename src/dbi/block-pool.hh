@@ -1,47 +1,163 @@
 #pragma once
 
 #include <iostream>
+#include <deque>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
 #include "usermem.hh"
+#include "types.hh"
 
 namespace dbi {
 
   class Tracee;
   class Blob;
 
+  /* Code cache made up of fixed-size segments in tracee memory. Segments are mapped on demand;
+   * reset() rewinds allocation to the first segment so that they can be reused after a flush.
+   * Segments are shared with the tracer, which writes code with write() rather than through
+   * each tracee. Mapping a new segment runs a syscall in every tracee, so stop_all is called
+   * first.
+   * Segments are mapped back to back over an address range reserved up front (PROT_NONE), so
+   * finding the segment of an address, and its dense offset, is a subtraction and a division.
+   */
   class BlockPool {
   public:
-    BlockPool() {}
-    BlockPool(Tracee& tracee, size_t size) { open(tracee, size); }
-
-    bool good() const {
-      assert(mem.good() == allocator.good());
-      return mem.good();
+    BlockPool(): tracees(nullptr) {}
+    BlockPool(Tracees& tracees, size_t segment_size, size_t max_segments,
+	      const StopAll& stop_all = StopAll()) {
+      open(tracees, segment_size, max_segments, stop_all);
     }
+
+    bool good() const { return tracees != nullptr; }
     operator bool() const { return good(); }
 
-    void open(Tracee& tracee, size_t size) {
-      mem.open(tracee, size, PROT_READ | PROT_EXEC);
-      allocator.open(mem.begin<uint8_t>(), mem.end<uint8_t>());
+    void open(Tracees& tracees_, size_t segment_size_, size_t max_segments_,
+	      const StopAll& stop_all_ = StopAll()) {
+      tracees = &tracees_;
+      segment_size = segment_size_;
+      max_segments = max_segments_;
+      stop_all = stop_all_;
+      range.open(tracees_, segment_size * max_segments, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+      base = range.begin<uint8_t>();
+      segments.clear();
+      cur = 0;
+      map_segment();
     }
     
     void close() {
-      mem.close();
+      segments.clear();
       allocator.close();
+      tracees = nullptr;
     }
+
+    /* most code the pool can hold */
+    size_t capacity() const { return segment_size * max_segments; }
     
     uint8_t *peek() const { return allocator.peek(); }
   
     template <typename Size>
     uint8_t *alloc(Size size) { return allocator.alloc(size); }
 
-    // TODO: Remove these?
-    uint8_t *begin() const { return mem.begin<uint8_t>(); }
-    uint8_t *end() const { return mem.end<uint8_t>(); }
+    /* ensure that the next size bytes can be allocated contiguously */
+    void reserve(size_t size) {
+      assert(size <= segment_size);
+      if (allocator.rem() >= size) {
+	return;
+      }
+      if (++cur == segments.size()) {
+	if (stop_all) { stop_all(); }
+	map_segment();
+      } else {
+	allocator.open(segments[cur]);
+      }
+    }
+
+    /* allocation state, for discarding what was allocated since */
+    struct Mark {
+      size_t cur;
+      uint8_t *peek;
+    };
+
+    Mark mark() const { return Mark {cur, peek()}; }
+
+    void rewind(const Mark& mark) {
+      cur = mark.cur;
+      allocator.open(mark.peek, segments[cur].end<uint8_t>());
+    }
+
+    /* rewind to the first segment, discarding all allocations */
+    void reset() {
+      cur = 0;
+      allocator.open(segments[cur]);
+    }
+
+    bool contains(uint8_t *addr) const {
+      return addr >= base && addr < base + segments.size() * segment_size;
+    }
+
+    /* write code to all tracees at once through the tracer's view of the segment */
+    void write(const void *from, size_t count, uint8_t *to) const {
+      const UserMemory& segment = find_segment(to);
+      assert(to + count <= segment.end<uint8_t>());
+      std::memcpy(segment.local(to), from, count);
+      written(to, count);
+    }
+
+    /* tracer's view of addr, for emitting code in place */
+    uint8_t *local(uint8_t *addr) const { return find_segment(addr).local(addr); }
+
+    /* keep tracee caches coherent with code stored through local() */
+    void written(uint8_t *to, size_t count) const {
+      const uint8_t *from = local(to);
+      for (auto& tracee_pair : *tracees) {
+	tracee_pair.tracee.update_memcache(from, count, to);
+      }
+    }
+
+    /* dense offset of addr across all segments, which are contiguous */
+    bool offset(uint8_t *addr, size_t& off) const {
+      if (!contains(addr)) {
+	return false;
+      }
+      off = addr - base;
+      return true;
+    }
+
+    /* space used since the last reset, counting skipped segment tails */
+    size_t used() const {
+      return cur * segment_size + (peek() - segments[cur].begin<uint8_t>());
+    }
   
   private:
-    UserMemory mem;
+    Tracees *tracees;
+    size_t segment_size;
+    size_t max_segments;
+    StopAll stop_all;
+    UserMemory range; // reserved for all segments
+    uint8_t *base;
+    std::deque<UserMemory> segments; // NOTE: UserMemory is not movable
+    size_t cur;
     UserAllocator<uint8_t> allocator;
+
+    const UserMemory& find_segment(uint8_t *addr) const {
+      assert(contains(addr));
+      return segments[(addr - base) / segment_size];
+    }
+
+    void map_segment() {
+      if (segments.size() == max_segments) {
+	std::cerr << "dbi: code cache exhausted (" << capacity() << " bytes)\n";
+	std::abort();
+      }
+      segments.emplace_back();
+      segments.back().open_shared(*tracees, segment_size, PROT_READ | PROT_EXEC,
+				   base + (segments.size() - 1) * segment_size);
+      cur = segments.size() - 1;
+      allocator.open(segments.back());
+    }
   };
 
 }
@@ -12,8 +12,10 @@
 namespace dbi {
 
   std::string DirJccTerminator::last_decision(last_decision_bits, 'x');
+  JccPredictor DirJccTerminator::predictor_;
 
-  Terminator *Terminator::Create(BlockPool& block_pool,
+  Terminator *Terminator::Create(Arena& arena,
+				 BlockPool& block_pool,
 				 PointerPool& ptr_pool,
 				 TmpMem& tmp_mem,
 				 const Instruction& branch,
@@ -22,59 +24,120 @@ namespace dbi {
 				 const ProbeBlock& pb,
 				 const RegisterBkpt& rb,
 				 const ReturnStackBuffer& rsb,
+				 TranslationTable& table,
+				 const EdgeResolver& resolver,
 				 const Block& block) {
     switch (branch.xed_iclass()) {
     case XED_ICLASS_CALL_NEAR:
       switch (branch.xed_iform()) {
       case XED_IFORM_CALL_NEAR_RELBRd:
-	return new CallDirTerminator(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, pb, rb, rsb);
+	return arena.make<CallDirTerminator>(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, pb,
+					     rb, rsb);
       default:
-	return new CallIndTerminator(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, pb, rb, rsb);
+	return arena.make<CallIndTerminator>(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, pb,
+					     rb, rsb, table);
       }
 
     case XED_ICLASS_JMP:
       switch (branch.xed_iform()) {
       case XED_IFORM_JMP_RELBRd:
       case XED_IFORM_JMP_RELBRb:
-	return new DirJmpTerminator(block_pool, branch, tracees, lb);
+	return arena.make<DirJmpTerminator>(block_pool, branch, tracees, lb);
       default:
-	return new JmpIndTerminator<4>(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, rb);
+	return arena.make<JmpIndTerminator>(block_pool, ptr_pool, tmp_mem, branch, tracees, lb, rb,
+					    table);
       }
 
     case XED_ICLASS_RET_NEAR:
-      return new RetTerminator(block_pool, tmp_mem, branch, tracees, lb, rb, rsb);
+      return arena.make<RetTerminator>(block_pool, tmp_mem, branch, tracees, lb, rb, rsb, table);
 
     default: // XED_ICLASS_JCC
-      return new DirJccTerminator(block_pool, branch, tracees, lb, pb, rb, block);
+      return arena.make<DirJccTerminator>(block_pool, tmp_mem, branch, tracees, lb, pb, rb, table,
+					  resolver, block);
     }
   }
 
   Terminator::Terminator(BlockPool& block_pool, size_t size, const Instruction& branch,
 			 Tracees& tracees, const LookupBlock& lb):
-    addr_(block_pool.peek()), size_(size), buf_(size), lb_(lb),
-    orig_branch_addr_(branch.pc())
+    Terminator(block_pool, size, branch.pc(), tracees, lb) {}
+
+  Terminator::Terminator(BlockPool& block_pool, size_t size, uint8_t *orig_branch_addr,
+			 Tracees& tracees, const LookupBlock& lb):
+    block_pool_(block_pool), addr_(block_pool.peek()), local_(block_pool.local(addr_)),
+    size_(size), dirty_begin_(size), lb_(lb), orig_branch_addr_(orig_branch_addr)
   {
     block_pool.alloc(size_);
   }
 
   uint8_t *Terminator::write(uint8_t *addr, const uint8_t *data_in, size_t count) {
     const size_t offset = addr - addr_;
-    auto data_out = buf_.begin() + offset;
-    assert(buf_.begin() <= data_out && data_out + count <= buf_.end());
-    std::copy_n(data_in, count, data_out);
-    dirty_ = true;
+    assert(addr >= addr_ && offset + count <= size_);
+    if (count == 0) {
+      return addr;
+    }
+    /* Other tracees may be executing this code: store the first byte last, so that replacing a
+     * breakpoint never exposes a partially written instruction.
+     */
+    std::copy_n(data_in + 1, count - 1, local_ + offset + 1);
+    __atomic_store_n(local_ + offset, data_in[0], __ATOMIC_RELEASE);
+    dirty_begin_ = std::min<size_t>(dirty_begin_, offset);
+    dirty_end_ = std::max<size_t>(dirty_end_, offset + count);
     return addr + count;
   }
 
-  void Terminator::flush_always(Tracee& tracee) {
-    tracee.write(buf_.data(), buf_.size(), addr());
+  void Terminator::retarget_jmp(uint8_t *jmp_addr, uint8_t *dst) {
+    uint8_t *disp_addr = jmp_addr + 1;
+    const size_t offset = disp_addr - addr_;
+    assert(disp_addr > addr_ && offset + sizeof(int32_t) <= size_);
+    assert(reinterpret_cast<uintptr_t>(disp_addr) % sizeof(int32_t) == 0);
+    const ptrdiff_t disp = dst - (jmp_addr + Instruction::jmp_relbrd_len);
+    assert(disp == static_cast<int32_t>(disp));
+    __atomic_store_n(reinterpret_cast<int32_t *>(local_ + offset), static_cast<int32_t>(disp),
+		     __ATOMIC_RELEASE);
+    dirty_begin_ = std::min<size_t>(dirty_begin_, offset);
+    dirty_end_ = std::max<size_t>(dirty_end_, offset + sizeof(int32_t));
+  }
+
+  uint8_t *Terminator::write_resolve_stub(uint8_t *addr, uint8_t *orig_dst,
+					  const EdgeResolver& resolver, const TmpMem& tmp_mem) {
+    /* xchg rsp, [gs:rel tmp_rsp]
+     * call resolver      ; which restores state and continues at the target, or the int3
+     * int3
+     * StubData
+     */
+    Data::Content bytes = {0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0xe8, 0x00, 0x00, 0x00, 0x00, 0xcc};
+    assert(bytes.size() == EdgeResolver::STUB_SIZE_code);
+    uint8_t *ret_addr = addr + EdgeResolver::STUB_RET;
+    const EdgeResolver::StubData data {orig_dst, this};
+    const uint8_t *data_bytes = reinterpret_cast<const uint8_t *>(&data);
+    bytes.insert(bytes.end(), data_bytes, data_bytes + sizeof(data));
+    write(Data(addr, bytes));
+
+    write(PCRelDisp(addr + 0x00 + 4, addr + 0x08, (uint8_t *) tmp_mem.rsp())); // xchg
+    write(PCRelDisp(addr + 0x08 + 1, ret_addr, resolver.entry()));             // call resolver
+    resolver.count_stub();
+
+    return addr + EdgeResolver::STUB_BKPT;
+  }
+
+  void Terminator::flush() {
+    if (dirty_begin_ < dirty_end_) {
+      block_pool_.written(addr_ + dirty_begin_, dirty_end_ - dirty_begin_);
+      dirty_begin_ = size_;
+      dirty_end_ = 0;
+    }
   }
-  
-  void Terminator::flush(Tracee& tracee) {
-    if (dirty_) {
-      tracee.write(buf_.data(), buf_.size(), addr());
-      dirty_ = false;
+
+  void Terminator::resolve_return_site(Tracee& tracee, PointerPool& ptr_pool, uint8_t *orig_ra,
+				       uint8_t **new_ra_ptr) {
+    uint8_t *new_ra = try_lookup_block(orig_ra);
+    if (new_ra == nullptr) {
+      *g_conf.log << "failed to translate return site " << (void *) orig_ra << "\n";
+      g_conf.abort(tracee);
+      return;
     }
+    ptr_pool.set((uintptr_t *) new_ra_ptr, (uintptr_t) new_ra);
+    tracee.set_pc(new_ra);
   }
 
   DirJmpTerminator::DirJmpTerminator(BlockPool& block_pool, const Instruction& jmp,
@@ -86,59 +149,113 @@ namespace dbi {
     uint8_t *jmp_addr = addr();
     const auto jmp_inst = Instruction::jmp_relbrd(jmp_addr, new_dst_addr);
     write(jmp_inst);
-    flush(tracees);
+    flush();
   }
 
-  DirJccTerminator::DirJccTerminator(BlockPool& block_pool, const Instruction& jcc,
-				     Tracees& tracees, const LookupBlock& lb, const ProbeBlock& pb,
-				     const RegisterBkpt& rb, const Block& block):
+  DirJccTerminator::DirJccTerminator(BlockPool& block_pool, TmpMem& tmp_mem,
+				     const Instruction& jcc, Tracees& tracees,
+				     const LookupBlock& lb, const ProbeBlock& pb,
+				     const RegisterBkpt& rb, TranslationTable& table,
+				     const EdgeResolver& resolver, const Block& block):
     Terminator(block_pool, DIR_JCC_SIZE, jcc, tracees, lb), orig_dst(jcc.branch_dst()),
-    orig_fallthru(jcc.after_pc()), block(block), iclass(jcc.xed_iclass()), iform(jcc.xed_iform()),
+    orig_fallthru(jcc.after_pc()), table(table), block(block), iclass(jcc.xed_iclass()),
+    iform(jcc.xed_iform()),
     dir(jcc.branch_dst() >= jcc.after_pc() ? Direction::FWD : Direction::BACK)
   {
     static const std::unordered_set<int> jcc_iclasses = {XED_ICLASS_JB, XED_ICLASS_JBE, XED_ICLASS_JL, XED_ICLASS_JLE, XED_ICLASS_JNB, XED_ICLASS_JNBE, XED_ICLASS_JNL, XED_ICLASS_JNLE, XED_ICLASS_JNO, XED_ICLASS_JNP, XED_ICLASS_JNS, XED_ICLASS_JNZ, XED_ICLASS_JO, XED_ICLASS_JP, XED_ICLASS_JS, XED_ICLASS_JZ};
     assert(jcc_iclasses.find(jcc.xed_iclass()) != jcc_iclasses.end());
   
-    /* jcc L0
-     * bkpt (padded for JMP_RELBRd)
-     * L0: bkpt
+    /*     jcc L0
+     *     jmp fallthru_stub  (aligned)
+     * L0: jmp jcc_stub       (aligned)
+     *     fallthru_stub
+     *     jcc_stub
+     * Each edge whose target is not translated yet goes through a stub, which resolves it
+     * in-core if the target was translated since (see EdgeResolver), or else breaks.
      */
 
     /* assign addresses */
     uint8_t *jcc_addr = addr();
-    fallthru_addr = jcc_addr + Instruction::jcc_relbrd_len;
-    jcc_bkpt_addr = fallthru_addr + Instruction::jmp_relbrd_len;
-
-    /* check for dst blocks */
-    const Prediction pred = get_prediction();
+    fallthru_addr = align_jmp(jcc_addr + Instruction::jcc_relbrd_len);
+    jcc_jmp_addr = align_jmp(fallthru_addr + Instruction::jmp_relbrd_len);
+    uint8_t *fallthru_stub_addr = this->fallthru_stub_addr();
+    uint8_t *jcc_stub_addr = this->jcc_stub_addr();
+    assert(jcc_stub_addr + EdgeResolver::STUB_SIZE <= addr() + DIR_JCC_SIZE);
+
+    /* check for dst blocks; region translation links both edges itself once the region is
+     * translated, instead of guessing which one to translate now
+     */
+    const Prediction pred = g_conf.region_blocks > 0 ? get_prediction_none() : get_prediction();
     uint8_t *new_dst = pred.jcc ? try_lookup_block(orig_dst) : pb(orig_dst);
     uint8_t *new_fallthru = pred.fallthru ? try_lookup_block(orig_fallthru) : pb(orig_fallthru);
+
+    /* the online predictor learns from the edges left on a stub, whichever way they are taken */
+    if (g_conf.region_blocks == 0 && g_conf.prediction_mode == Config::PredictionMode::ONLINE) {
+      jcc_sampled = new_dst == nullptr;
+      fallthru_sampled = new_fallthru == nullptr;
+      if (jcc_sampled) {
+	predictor_.sample(predictor_key(), JccPredictor::JCC);
+      }
+      if (fallthru_sampled) {
+	predictor_.sample(predictor_key(), JccPredictor::FALLTHRU);
+      }
+    }
   
-    /* create blobs */
-    jcc_inst = jcc;
-    jcc_inst.relocate(jcc_addr);
+    /* write stubs before the jumps to them */
     if (new_dst == nullptr) {
-      jcc_inst.retarget(jcc_bkpt_addr); // TODO: optim
-      rb(jcc_bkpt_addr, [&] (Tracee& tracee, auto addr) { this->handle_bkpt_jcc(tracee); });
-    } else {
-      jcc_inst.retarget(new_dst);
+      uint8_t *bkpt = write_resolve_stub(jcc_stub_addr, orig_dst, resolver, tmp_mem);
+      rb(bkpt, BkptHandler::member<DirJccTerminator, &DirJccTerminator::handle_bkpt_jcc>(this));
+      write(Instruction::jmp_relbrd(jcc_jmp_addr, jcc_stub_addr));
     }
-    Instruction fallthru_inst;
     if (new_fallthru == nullptr) {
-      fallthru_inst = Instruction::int3(fallthru_addr);
-      rb(fallthru_addr, [&] (Tracee& tracee, auto addr) { this->handle_bkpt_fallthru(tracee); });
-    } else {
-      fallthru_inst = Instruction::jmp_relbrd(fallthru_addr, new_fallthru);
+      uint8_t *bkpt = write_resolve_stub(fallthru_stub_addr, orig_fallthru, resolver, tmp_mem);
+      rb(bkpt,
+	 BkptHandler::member<DirJccTerminator, &DirJccTerminator::handle_bkpt_fallthru>(this));
     }
-    const auto jcc_bkpt_inst = Instruction::int3(jcc_bkpt_addr);
-    
-    /* write blobs */
-    write(jcc_inst);
-    write(fallthru_inst);
-    write(jcc_bkpt_inst);
+    write(Instruction::jmp_relbrd(fallthru_addr, new_fallthru ? new_fallthru : fallthru_stub_addr));
+    write(Instruction::jcc_relbrd(jcc_addr, iclass, new_dst ? new_dst : jcc_jmp_addr));
+    jcc_linked = new_dst != nullptr;
+    fallthru_linked = new_fallthru != nullptr;
     
     /* flush */
-    flush(tracees);
+    flush();
+  }
+
+  TraceExitTerminator::TraceExitTerminator(BlockPool& block_pool, TmpMem& tmp_mem,
+					   uint8_t *orig_jcc, uint8_t *orig_dst, Tracees& tracees,
+					   const LookupBlock& lb, const ProbeBlock& pb,
+					   const RegisterBkpt& rb, TranslationTable& table,
+					   const EdgeResolver& resolver):
+    Terminator(block_pool, TRACE_EXIT_SIZE, orig_jcc, tracees, lb), orig_dst(orig_dst),
+    jmp_addr(align_jmp(addr())), table(table)
+  {
+    /*     jmp stub  (aligned)
+     *     stub
+     * Cold edges are left lazy: the trace was laid out because they are rarely taken.
+     */
+    uint8_t *stub_addr = jmp_addr + Instruction::jmp_relbrd_len;
+    assert(stub_addr + EdgeResolver::STUB_SIZE <= addr() + TRACE_EXIT_SIZE);
+
+    uint8_t *new_dst = pb(orig_dst);
+    if (new_dst == nullptr) {
+      uint8_t *bkpt = write_resolve_stub(stub_addr, orig_dst, resolver, tmp_mem);
+      rb(bkpt, BkptHandler::member<TraceExitTerminator, &TraceExitTerminator::handle_bkpt>(this));
+    }
+    write(Instruction::jmp_relbrd(jmp_addr, new_dst ? new_dst : stub_addr));
+    flush();
+  }
+
+  void TraceExitTerminator::resolved(uint8_t *bkpt) {
+    retarget_jmp(jmp_addr, lookup_block(orig_dst));
+    flush();
+  }
+
+  void TraceExitTerminator::handle_bkpt(Tracee& tracee) {
+    uint8_t *new_dst = lookup_block(orig_dst);
+    retarget_jmp(jmp_addr, new_dst);
+    flush();
+    table.edge_miss();
+    tracee.set_pc(new_dst);
   }
 
   DirJccTerminator::Prediction DirJccTerminator::get_prediction_iclass() const {
@@ -163,20 +280,10 @@ namespace dbi {
     }
   }
 
-  DirJccTerminator::Prediction DirJccTerminator::get_prediction_last_iclass() const {
-    switch (last_iclass()) {
-    case XED_ICLASS_XOR: return {false, true};
-    case XED_ICLASS_SUB: return {true, true};
-    case XED_ICLASS_SAR: return {true, false};
-    case XED_ICLASS_ADD: return {false, true};
-    case XED_ICLASS_PUSH:return {false, true};
-    case XED_ICLASS_MOVZX:return {true, false};
-    case XED_ICLASS_DEC: return {true, false};
-    case XED_ICLASS_CMPXCHG: return {true, false};
-    case XED_ICLASS_MOV: return {false, true};
-    case XED_ICLASS_CMP: return {false, true};
-    default: return {false, false};
-    }
+  DirJccTerminator::Prediction DirJccTerminator::get_prediction_online() const {
+    const JccPredictor::Key key = predictor_key();
+    return Prediction {predictor_.predict(key, JccPredictor::JCC),
+		       predictor_.predict(key, JccPredictor::FALLTHRU)};
   }
 
   DirJccTerminator::Prediction DirJccTerminator::get_prediction() const {
@@ -189,8 +296,8 @@ namespace dbi {
       return get_prediction_iform();
     case Config::PredictionMode::DIR:
       return get_prediction_dir();
-    case Config::PredictionMode::LAST_ICLASS:
-      return get_prediction_last_iclass();
+    case Config::PredictionMode::ONLINE:
+      return get_prediction_online();
     default: abort();
     }
   }
@@ -230,7 +337,6 @@ namespace dbi {
 	      << xed_iform_enum_t2str(iform) << " "
 	      << dir_str() << " "
 	      << last_decision << " "
-	      << last_iclass_str() << " "
 	      << std::endl;
   }
 
@@ -256,24 +362,74 @@ namespace dbi {
     *last_decision.rbegin() = c;
   }
 
+  void DirJccTerminator::unlinked_edges(std::vector<uint8_t *>& dsts) const {
+    if (!jcc_linked) {
+      dsts.push_back(orig_dst);
+    }
+    if (!fallthru_linked) {
+      dsts.push_back(orig_fallthru);
+    }
+  }
+
+  void DirJccTerminator::link(const ProbeBlock& pb) {
+    uint8_t *new_dst;
+    if (!jcc_linked && (new_dst = pb(orig_dst)) != nullptr) {
+      retarget_jmp(jcc_jmp_addr, new_dst);
+      jcc_linked = true;
+    }
+    uint8_t *new_fallthru;
+    if (!fallthru_linked && (new_fallthru = pb(orig_fallthru)) != nullptr) {
+      retarget_jmp(fallthru_addr, new_fallthru);
+      fallthru_linked = true;
+    }
+    flush();
+  }
+
+  void DirJccTerminator::resolved(uint8_t *bkpt) {
+    if (!jcc_linked && bkpt == jcc_stub_addr() + EdgeResolver::STUB_BKPT) {
+      retarget_jmp(jcc_jmp_addr, lookup_block(orig_dst));
+      jcc_linked = true;
+      if (jcc_sampled) {
+	predictor_.taken(predictor_key(), JccPredictor::JCC);
+      }
+    } else if (!fallthru_linked && bkpt == fallthru_stub_addr() + EdgeResolver::STUB_BKPT) {
+      retarget_jmp(fallthru_addr, lookup_block(orig_fallthru));
+      fallthru_linked = true;
+      if (fallthru_sampled) {
+	predictor_.taken(predictor_key(), JccPredictor::FALLTHRU);
+      }
+    }
+    flush();
+  }
+
   void DirJccTerminator::handle_bkpt_fallthru(Tracee& tracee) {
-    /* replace fallthru bkpt with jump */
+    /* the target needs translating; then link the edge to it */
     uint8_t *new_fallthru = lookup_block(orig_fallthru);
-    const auto fallthru_inst = Instruction::jmp_relbrd(fallthru_addr, new_fallthru);
-    write(fallthru_inst);
-    flush(tracee);
+    retarget_jmp(fallthru_addr, new_fallthru);
+    fallthru_linked = true;
+    if (fallthru_sampled) {
+      predictor_.taken(predictor_key(), JccPredictor::FALLTHRU);
+    }
+    flush();
+    table.edge_miss();
     tracee.set_pc(new_fallthru);
     log_bkpt("FALLTHRU");
     add_decision('f');
   }
 
   void DirJccTerminator::handle_bkpt_jcc(Tracee& tracee) {
-    /* replace jump instruction */
+    /* Retarget the jump after the jcc rather than the jcc itself: other tracees may be running,
+     * and the jcc's displacement is not aligned.
+     */
     uint8_t *new_dst = lookup_block(orig_dst);
-    jcc_inst.retarget(new_dst);
-    write(jcc_inst);
+    retarget_jmp(jcc_jmp_addr, new_dst);
+    jcc_linked = true;
+    if (jcc_sampled) {
+      predictor_.taken(predictor_key(), JccPredictor::JCC);
+    }
     tracee.set_pc(new_dst);
-    flush(tracee);
+    flush();
+    table.edge_miss();
     log_bkpt("JCC");
     add_decision('j');
   }
@@ -316,41 +472,51 @@ namespace dbi {
 
   RetTerminator::RetTerminator(BlockPool& block_pool, TmpMem& tmp_mem, const Instruction& ret,
 			       Tracees& tracees, const LookupBlock& lb, const RegisterBkpt& rb,
-			       const ReturnStackBuffer& rsb):
-    Terminator(block_pool, RET_SIZE, ret, tracees, lb)
+			       const ReturnStackBuffer& rsb, TranslationTable& table):
+    Terminator(block_pool, RET_SIZE, ret, tracees, lb), table(table)
   {
     /* write base */
-    static const Data::Content bytes = {0x48, 0x87, 0x04, 0x24, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x9c, 0x51, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x48, 0x3b, 0x25, 0x00, 0x00, 0x00, 0x00, 0x74, 0x0e, 0x59, 0x48, 0x39, 0xc8, 0x59, 0x74, 0x07, 0x48, 0x8d, 0x0d, 0x26, 0x00, 0x00, 0x00, 0x48, 0x89, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x59, 0x9d, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x48, 0x87, 0x04, 0x24, 0x48, 0x8d, 0x64, 0x24, 0x08, 0xff, 0x25, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x64, 0x24, 0xf8, 0xcc};
-
-    static Data data(nullptr, bytes);
-    assert(data.size() == RET_SIZE);
-    data.relocate(addr());
-    write(data);
+    Data::Content bytes = {0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x9c, 0x50, 0x65, 0x48, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x00, 0x65, 0x48, 0x83, 0x05, 0x00, 0x00, 0x00, 0x00, 0x08, 0x51, 0x52, 0x65, 0x8b, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x15, 0x00, 0x00, 0x00, 0x00, 0x65, 0x48, 0x3b, 0x04, 0x0a, 0x75, 0x31, 0x65, 0x48, 0x8b, 0x44, 0x0a, 0x08, 0x83, 0xc1, 0x10, 0x81, 0xe1, 0x00, 0x00, 0x00, 0x00, 0x65, 0x89, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x65, 0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x59, 0x58, 0x9d, 0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x65, 0xff, 0x25, 0x00, 0x00, 0x00, 0x00, 0x83, 0xc1, 0x10, 0x81, 0xe1, 0x00, 0x00, 0x00, 0x00, 0x65, 0x89, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x59};
+    assert(bytes.size() == RET_SIZE_pre);
+    * (uint32_t *) &bytes[0x40] = rsb.mask();
+    * (uint32_t *) &bytes[0x6b] = rsb.mask();
+    write(Data(addr(), bytes));
 
-    /* create block-dependent instructions */
+    /* create block-dependent instructions (from rsb-ret.asm) */
     uint8_t *a = addr();
-    write(PCRelDisp(a + 0x04 + 3, a + 0x0b, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [rel tmp_rsp]
-    write(PCRelDisp(a + 0x0d + 3, a + 0x14, (uint8_t *) rsb.ptr()));       // xchg rsp, [rel rsb_ptr]
-    write(PCRelDisp(a + 0x14 + 3, a + 0x1b, (uint8_t *) rsb.begin()));     // cmp rsp, [rel rsp_begin]
-    write(PCRelDisp(a + 0x2b + 3, a + 0x32, (uint8_t *) tmp_mem.begin())); // mov [rel tmp_0], rcx
-    write(PCRelDisp(a + 0x32 + 3, a + 0x39, (uint8_t *) rsb.ptr()));       // xchg rsp, [rel rsb_ptr]
-    write(PCRelDisp(a + 0x3b + 3, a + 0x42, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [rel tmp_rsp]
-    write(PCRelDisp(a + 0x4b + 2, a + 0x51, (uint8_t *) tmp_mem.begin())); // jmp [rel tmp_0]
+    write(PCRelDisp(a + 0x00 + 4, a + 0x08, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [gs:rel tmp_rsp]
+    write(PCRelDisp(a + 0x0a + 4, a + 0x12, (uint8_t *) tmp_mem.rsp()));   // mov rax, [gs:rel tmp_rsp]
+    write(PCRelDisp(a + 0x15 + 4, a + 0x1e, (uint8_t *) tmp_mem.rsp()));   // add qword [gs:rel tmp_rsp], 8
+    write(PCRelDisp(a + 0x20 + 3, a + 0x27, (uint8_t *) rsb.idx()));       // mov ecx, [gs:rel rsb_idx]
+    write(PCRelDisp(a + 0x27 + 3, a + 0x2e, (uint8_t *) rsb.begin()));     // lea rdx, [rel rsb_base]
+    write(PCRelDisp(a + 0x44 + 3, a + 0x4b, (uint8_t *) rsb.idx()));       // mov [gs:rel rsb_idx], ecx
+    write(PCRelDisp(a + 0x4b + 4, a + 0x53, (uint8_t *) tmp_mem.begin())); // mov [gs:rel tmp_0], rax
+    write(PCRelDisp(a + 0x57 + 4, a + 0x5f, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [gs:rel tmp_rsp]
+    write(PCRelDisp(a + 0x5f + 3, a + 0x66, (uint8_t *) tmp_mem.begin())); // jmp [gs:rel tmp_0]
+    write(PCRelDisp(a + 0x6f + 3, a + 0x76, (uint8_t *) rsb.idx()));       // mov [gs:rel rsb_idx], ecx
+
+    /* RSB mismatch: look up the actual return address in the translation table */
+    uint8_t *bkpt_addr = write_table_probe(a + RET_SIZE_pre, table, tmp_mem, table.ret_hits());
+    assert(bkpt_addr + Instruction::int3_len == a + RET_SIZE);
   
-    flush(tracees);
+    flush();
+
+    rb(bkpt_addr, BkptHandler::member<RetTerminator, &RetTerminator::handle_bkpt_miss>(this));
+  }
+
+  void RetTerminator::handle_bkpt_miss(Tracee& tracee) {
+    table.ret_miss();
 
-    uint8_t *bkpt_addr = a + 0x56;
-    rb(bkpt_addr, [this] (Tracee& tracee, auto addr) {
-      std::cerr << "ret mismatch\n";
-      this->handle_bkpt_singlestep(tracee);
-    });
+    /* push the return address back, since the original ret will be single-stepped */
+    tracee.set_sp(static_cast<uint8_t *>(tracee.get_sp()) - sizeof(uint8_t *));
+    handle_bkpt_singlestep(tracee);
   }
 
   CallTerminator::CallTerminator(BlockPool& block_pool, PointerPool& ptr_pool, TmpMem& tmp_mem,
 				 size_t size, const Instruction& call, Tracees& tracees,
 				 const LookupBlock& lb, const ProbeBlock& pb,
 				 const RegisterBkpt& rb, const ReturnStackBuffer& rsb):
-    Terminator(block_pool, size + CALL_SIZE, call, tracees, lb)
+    Terminator(block_pool, size + CALL_SIZE, call, tracees, lb), ptr_pool(ptr_pool)
   {
     uint8_t *bkpt_addr = subaddr() + size;
 
@@ -359,32 +525,80 @@ namespace dbi {
     uint8_t *new_ra_val;
 
     if ((new_ra_val = try_lookup_block(call.after_pc())) == nullptr) {
+      write_bkpt(bkpt_addr);
       new_ra_val = bkpt_addr;
+      rb(bkpt_addr, BkptHandler::member<CallTerminator, &CallTerminator::handle_bkpt_ret>(this));
     }
   
     uint8_t **orig_ra_ptr = (uint8_t **) ptr_pool.add((uintptr_t) orig_ra_val);
     new_ra_ptr = (uint8_t **) ptr_pool.add((uintptr_t) new_ra_val); // TODO: optimize -- check if TXed
 
-    static const Data::Content bytes = {0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x9c, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x48, 0x3b, 0x25, 0x00, 0x00, 0x00, 0x00, 0x74, 0x0c, 0xff, 0x35, 0x00, 0x00, 0x00, 0x00, 0xff, 0x35, 0x00, 0x00, 0x00, 0x00, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x9d, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00};
-  
-    static Data data(nullptr, bytes);
-    data.relocate(addr());
-    write(data);
-
-    write(PCRelDisp(addr() + 0x00 + 3, addr() + 0x07,
-		    (uint8_t *) tmp_mem.rsp())); // xchg rsp, [rel tmp_rsp]
-    write(PCRelDisp(addr() + 0x08 + 3, addr() + 0x0f,
-		    (uint8_t *) rsb.ptr())); // xchg rsp, [rel rsp_ptr]
-    write(PCRelDisp(addr() + 0x0f + 3, addr() + 0x16,
-		    (uint8_t *) rsb.end())); // cmp rsp, [rel rsb_end]
-    write(PCRelDisp(addr() + 0x18 + 2, addr() + 0x1e,
-		    (uint8_t *) new_ra_ptr)); // push qword [rel new_ra]
-    write(PCRelDisp(addr() + 0x1e + 2, addr() + 0x24,
-		    (uint8_t *) orig_ra_ptr)); // push qword [rel orig_ra]
-    write(PCRelDisp(addr() + 0x24 + 3, addr() + 0x2b,
-		    (uint8_t *) rsb.ptr())); // xchg rsp, [rel rsb_ptr]
-    write(PCRelDisp(addr() + 0x2c + 3, addr() + 0x33,
-		    (uint8_t *) tmp_mem.rsp())); // xchg rsp, [rel tmp_rsp]
+    write(rsb_push(addr(), tmp_mem, rsb, orig_ra_ptr, new_ra_ptr));
+  }
+
+  void CallTerminator::handle_bkpt_ret(Tracee& tracee) {
+    resolve_return_site(tracee, ptr_pool, orig_ra_val, new_ra_ptr);
+  }
+
+  ReturnSiteTerminator::ReturnSiteTerminator(BlockPool& block_pool, PointerPool& ptr_pool,
+					     uint8_t *orig_ra, uint8_t **new_ra_ptr,
+					     Tracees& tracees, const LookupBlock& lb,
+					     const ProbeBlock& pb, const RegisterBkpt& rb):
+    Terminator(block_pool, RETURN_SITE_SIZE, orig_ra, tracees, lb), ptr_pool(ptr_pool),
+    orig_ra(orig_ra), new_ra_ptr(new_ra_ptr)
+  {
+    uint8_t *new_ra = pb(orig_ra);
+    linked = new_ra != nullptr;
+    if (!linked) {
+      write_bkpt(addr());
+      flush();
+      rb(addr(),
+	 BkptHandler::member<ReturnSiteTerminator, &ReturnSiteTerminator::handle_bkpt>(this));
+      new_ra = addr();
+    }
+    ptr_pool.set((uintptr_t *) new_ra_ptr, (uintptr_t) new_ra);
+  }
+
+  void ReturnSiteTerminator::unlinked_edges(std::vector<uint8_t *>& dsts) const {
+    if (!linked) {
+      dsts.push_back(orig_ra);
+    }
+  }
+
+  void ReturnSiteTerminator::link(const ProbeBlock& pb) {
+    if (linked) {
+      return;
+    }
+    /* RSB entries already pushed keep returning to the breakpoint, which stays registered */
+    if (uint8_t *new_ra = pb(orig_ra)) {
+      ptr_pool.set((uintptr_t *) new_ra_ptr, (uintptr_t) new_ra);
+      linked = true;
+    }
+  }
+
+  void ReturnSiteTerminator::handle_bkpt(Tracee& tracee) {
+    resolve_return_site(tracee, ptr_pool, orig_ra, new_ra_ptr);
+    linked = true;
+  }
+
+  Data CallTerminator::rsb_push(uint8_t *pc, const TmpMem& tmp_mem, const ReturnStackBuffer& rsb,
+				uint8_t **orig_ra_ptr, uint8_t **new_ra_ptr) {
+    Data::Content bytes = {0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x9c, 0x50, 0x51, 0x65, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00, 0x83, 0xe8, 0x10, 0x25, 0x00, 0x00, 0x00, 0x00, 0x65, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x48, 0x01, 0xc1, 0xff, 0x35, 0x00, 0x00, 0x00, 0x00, 0x65, 0x8f, 0x01, 0xff, 0x35, 0x00, 0x00, 0x00, 0x00, 0x65, 0x8f, 0x41, 0x08, 0x59, 0x58, 0x9d, 0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00};
+    assert(bytes.size() == CALL_SIZE_PRE);
+
+    const auto disp = [&] (size_t offset, size_t iend, const void *dst) {
+      * (int32_t *) &bytes[offset] = static_cast<const uint8_t *>(dst) - (pc + iend);
+    };
+    * (uint32_t *) &bytes[0x16] = rsb.mask();
+    disp(0x00 + 4, 0x08, tmp_mem.rsp()); // xchg rsp, [gs:rel tmp_rsp]
+    disp(0x0b + 3, 0x12, rsb.idx());     // mov eax, [gs:rel rsb_idx]
+    disp(0x1a + 3, 0x21, rsb.idx());     // mov [gs:rel rsb_idx], eax
+    disp(0x21 + 3, 0x28, rsb.begin());   // lea rcx, [rel rsb_base]
+    disp(0x2b + 2, 0x31, orig_ra_ptr);   // push qword [rel orig_ra]
+    disp(0x34 + 2, 0x3a, new_ra_ptr);    // push qword [rel new_ra]
+    disp(0x41 + 4, 0x49, tmp_mem.rsp()); // xchg rsp, [gs:rel tmp_rsp]
+
+    return Data(pc, bytes);
   }
 
   CallDirTerminator::CallDirTerminator(BlockPool& block_pool,
@@ -413,7 +627,7 @@ namespace dbi {
     /* assertions */
     assert(it - subaddr() == CALL_DIR_SIZE);
 
-    flush(tracees);
+    flush();
   }
 
   CallIndTerminator::CallIndTerminator(BlockPool& block_pool,
@@ -424,177 +638,165 @@ namespace dbi {
 				       const LookupBlock& lb,
 				       const ProbeBlock& pb,
 				       const RegisterBkpt& rb,
-				       const ReturnStackBuffer& rsb):
-    CallTerminator(block_pool, ptr_pool, tmp_mem, CALL_IND_SIZE, call, tracees, lb, pb, rb, rsb)
+				       const ReturnStackBuffer& rsb,
+				       TranslationTable& table):
+    CallTerminator(block_pool, ptr_pool, tmp_mem, call_ind_size(call), call, tracees, lb, pb, rb,
+		   rsb),
+    table(table)
   {
-    uint8_t *bkpt_addr = subaddr();
-    const auto bkpt_inst = Instruction::int3(bkpt_addr);
-    write(bkpt_inst);
-    flush(tracees);
-    rb(bkpt_addr, [&] (Tracee& tracee, auto addr) { this->handle_bkpt_singlestep(tracee); });
-  }
+    uint8_t *it = subaddr();
+
+    if (!can_load_addr(call)) {
+      it = write_bkpt(it);
+      flush();
+      rb(subaddr(), BkptHandler::member<Terminator, &Terminator::handle_bkpt_singlestep>(this));
+      return;
+    }
+
+    /* push [rel orig_ra]
+     * xchg rsp, [rel tmp_rsp]
+     * pushf
+     * push rax
+     * mov rax, <call target>
+     * <table probe>
+     */
+    uint8_t **orig_ra_ptr = (uint8_t **) ptr_pool.add((uintptr_t) call.after_pc());
+    it = write(Instruction::push_mem(it, (uint8_t *) orig_ra_ptr));
+    it = write(Instruction::xchg_rsp_mem(it, (uint8_t *) tmp_mem.rsp())
+	       .prefix(Instruction::thread_prefix));
+    it = write(Instruction::pushf(it));
+    it = write(Instruction::push_reg(it, Instruction::reg_t::RAX));
+    it = load_addr(call, ptr_pool, it);
+
+    uint8_t *bkpt_addr = write_table_probe(it, table, tmp_mem, table.call_hits());
+    rb(bkpt_addr,
+       BkptHandler::member<CallIndTerminator, &CallIndTerminator::handle_bkpt_miss>(this));
+
+    assert(bkpt_addr + Instruction::int3_len == subaddr() + call_ind_size(call));
 
-  template <size_t CACHELEN>
-  uint8_t *JmpIndTerminator<CACHELEN>::match_addr(size_t n, const Instruction& jmp) const {
-    return addr() + JMP_IND_SIZE_base + JMP_IND_SIZE_cmp * CACHELEN
-      + load_addr_size(jmp) + JMP_IND_SIZE_match * n;
+    flush();
   }
 
-  template <size_t CACHELEN>
-  size_t JmpIndTerminator<CACHELEN>::jmp_ind_size(const Instruction& jmp) {
-    return JMP_IND_SIZE_base + CACHELEN * JMP_IND_SIZE_per + load_addr_size(jmp);
+  void CallIndTerminator::handle_bkpt_miss(Tracee& tracee) {
+    table.call_miss();
+
+    /* undo the return address push, since the original call will be single-stepped */
+    tracee.set_sp(static_cast<uint8_t *>(tracee.get_sp()) + sizeof(uint8_t *));
+    handle_bkpt_singlestep(tracee);
   }
 
-  template <size_t CACHELEN>
-  JmpIndTerminator<CACHELEN>::JmpIndTerminator(BlockPool& block_pool, PointerPool& ptr_pool,
-					       TmpMem& tmp_mem, const Instruction& jmp,
-					       Tracees& tracees, const LookupBlock& lb,
-					       const RegisterBkpt& rb):
-    Terminator(block_pool, jmp_ind_size(jmp), jmp, tracees, lb)
+  JmpIndTerminator::JmpIndTerminator(BlockPool& block_pool, PointerPool& ptr_pool,
+				     TmpMem& tmp_mem, const Instruction& jmp,
+				     Tracees& tracees, const LookupBlock& lb,
+				     const RegisterBkpt& rb, TranslationTable& table):
+    Terminator(block_pool, jmp_ind_size(jmp), jmp, tracees, lb), table(table)
   {
-    /* make orig pointers */
-    for (auto& orig_ptr : orig_ptrs) {
-      orig_ptr = (uint8_t **) ptr_pool.add((uintptr_t) nullptr);
-    }
-    std::fill(orig_vals.begin(), orig_vals.end(), nullptr);
-  
     uint8_t *it = addr();
 
-    const auto xchg_pre = Instruction::xchg_rsp_mem(it, (uint8_t *) tmp_mem.rsp());
-    write(xchg_pre);
-    it += xchg_pre.size();
-  
-    const auto pushf = Instruction::pushf(it);
-    it += pushf.size();
-    const auto push_rax = Instruction::from_bytes(it, 0x50);
-    it += push_rax.size();
-
-    write(pushf);
-    write(push_rax);
+    if (!can_load_addr(jmp)) {
+      it = write_bkpt(it);
+      flush();
+      rb(addr(), BkptHandler::member<Terminator, &Terminator::handle_bkpt_singlestep>(this));
+      return;
+    }
 
-    /* get address into RAX */
+    /* xchg rsp, [rel tmp_rsp]
+     * pushf
+     * push rax
+     * mov rax, <jmp target>
+     * <table probe>
+     */
+    it = write(Instruction::xchg_rsp_mem(it, (uint8_t *) tmp_mem.rsp())
+	       .prefix(Instruction::thread_prefix));
+    it = write(Instruction::pushf(it));
+    it = write(Instruction::push_reg(it, Instruction::reg_t::RAX));
     it = load_addr(jmp, ptr_pool, it);
 
-    /* comparisons */
-    for (size_t i = 0; i < CACHELEN; ++i) {
-      const auto cmp = Instruction::cmp_mem64(it, Instruction::reg_t::RAX,
-					      (uint8_t *) orig_ptrs[i]);
-      it += cmp.size();
-      const auto je = Instruction::je_b(it,  match_addr(i, jmp));
-      it += je.size();
-
-      write(cmp);
-      write(je);
-    }
-
-    /* mismatch cleanup */
-    const auto pop_rax = Instruction::from_bytes(it, 0x58);
-    write(pop_rax);
-    it += pop_rax.size();
-    const auto popf = Instruction::popf(it);
-    write(popf);
-    it += popf.size();
-    const auto xchg_post = Instruction::xchg_rsp_mem(it, (uint8_t *) tmp_mem.rsp());
-    write(xchg_post);
-    it += xchg_post.size();
-  
-    /* mismatch breakpoint */
-    const auto mismatch_bkpt = Instruction::int3(it);
-    it += mismatch_bkpt.size();
-    write(mismatch_bkpt);
-    rb(mismatch_bkpt.pc(), [&] (Tracee& tracee, auto addr) { this->handle_bkpt(tracee); });
-
-    /* null breakpoint */
-    const auto null_bkpt = Instruction::int3(it);
-    it += null_bkpt.size();
-    write(null_bkpt);
-    rb(null_bkpt.pc(), [&] (Tracee& tracee, uint8_t *bkpt_addr) {
-      std::cerr << "jumped to NULL" << std::endl;
-      std::cerr << "pc: " << (void *) tracee.get_pc() << std::endl;
-      const auto begin = addr();
-      const auto end = begin + jmp_ind_size(jmp);
-      tracee.disas(std::cerr, begin, end);
-    
-      std::abort();
-    });
-  
-    assert(static_cast<size_t>(it - addr())
-	   == JMP_IND_SIZE_base + JMP_IND_SIZE_cmp * CACHELEN + load_addr_size(jmp));
-  
-    /* matches */
-    for (size_t i = 0; i < CACHELEN; ++i) {
-      const auto pop_rax = Instruction::from_bytes(it, 0x58);
-      write(pop_rax);
-      it += pop_rax.size();
-      const auto popf = Instruction::popf(it);
-      write(popf);
-      it += popf.size();
-      const auto xchg_match = Instruction::xchg_rsp_mem(it, (uint8_t *) tmp_mem.rsp());
-      write(xchg_match);
-      it += xchg_match.size();
-      newjmps[i] = Instruction::jmp_relbrd(it, null_bkpt.pc());
-      write(newjmps[i]);
-      it += newjmps[i].size();
-    }
-
-    flush(tracees);
+    /* miss breakpoint: target hasn't been translated yet */
+    uint8_t *bkpt_addr = write_table_probe(it, table, tmp_mem, table.jmp_hits());
+    rb(bkpt_addr, BkptHandler::member<JmpIndTerminator, &JmpIndTerminator::handle_bkpt>(this));
+
+    assert(bkpt_addr + Instruction::int3_len == addr() + jmp_ind_size(jmp));
+
+    flush();
+  }
+
+  void JmpIndTerminator::handle_bkpt(Tracee& tracee) {
+    table.jmp_miss();
+    handle_bkpt_singlestep(tracee);
+  }
+
+  uint8_t *Terminator::write_table_probe(uint8_t *it, const TranslationTable& table,
+					 const TmpMem& tmp_mem, uint64_t *hits) {
+    /*        push rcx
+     *        push rdx
+     *        imul ecx, eax, hash_mult
+     *        shr ecx, shift
+     *        shl ecx, 4
+     *        lea rdx, [rel table]
+     * .probe cmp rax, [rdx + rcx]
+     *        je .hit
+     *        cmp qword [rdx + rcx], 0
+     *        je .miss
+     *        add ecx, 16
+     *        and ecx, mask
+     *        jmp .probe
+     * .hit   inc qword [rel hits]
+     *        mov rax, [rdx + rcx + 8]
+     *        mov [gs:rel tmp_0], rax
+     *        pop rdx
+     *        pop rcx
+     *        pop rax
+     *        popf
+     *        xchg rsp, [gs:rel tmp_rsp]
+     *        jmp [gs:rel tmp_0]
+     * .miss  pop rdx
+     *        pop rcx
+     *        pop rax
+     *        popf
+     *        xchg rsp, [gs:rel tmp_rsp]
+     *        int3
+     */
+    Data::Content bytes = {0x51, 0x52, 0x69, 0xc8, 0x00, 0x00, 0x00, 0x00, 0xc1, 0xe9, 0x00, 0xc1, 0xe1, 0x04, 0x48, 0x8d, 0x15, 0x00, 0x00, 0x00, 0x00, 0x48, 0x3b, 0x04, 0x0a, 0x74, 0x12, 0x48, 0x83, 0x3c, 0x0a, 0x00, 0x74, 0x32, 0x83, 0xc1, 0x10, 0x81, 0xe1, 0x00, 0x00, 0x00, 0x00, 0xeb, 0xe8, 0x48, 0xff, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x44, 0x0a, 0x08, 0x65, 0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x59, 0x58, 0x9d, 0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x65, 0xff, 0x25, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x59, 0x58, 0x9d, 0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0xcc};
+    assert(bytes.size() == TABLE_PROBE_SIZE);
+    * (uint32_t *) &bytes[0x04] = TranslationTable::hash_mult;
+    bytes[0x0a] = table.shift();
+    * (uint32_t *) &bytes[0x27] = table.mask();
+    if (hits == nullptr) {
+      std::copy(TranslationTable::hits_nop.begin(), TranslationTable::hits_nop.end(), &bytes[0x2d]);
+    }
+    write(Data(it, bytes));
 
-    /* assertions */
-    assert(jmp_ind_size(jmp) == static_cast<size_t>(it - addr()));
-  }
+    write(PCRelDisp(it + 0x0e + 3, it + 0x15, (uint8_t *) table.begin()));   // lea rdx, [rel table]
+    if (hits != nullptr) {
+      write(PCRelDisp(it + 0x2d + 3, it + 0x34, (uint8_t *) hits));          // inc qword [rel hits]
+    }
+    write(PCRelDisp(it + 0x39 + 4, it + 0x41, (uint8_t *) tmp_mem.begin())); // mov [gs:rel tmp_0], rax
+    write(PCRelDisp(it + 0x45 + 4, it + 0x4d, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [gs:rel tmp_rsp]
+    write(PCRelDisp(it + 0x4d + 3, it + 0x54, (uint8_t *) tmp_mem.begin())); // jmp [gs:rel tmp_0]
+    write(PCRelDisp(it + 0x58 + 4, it + 0x60, (uint8_t *) tmp_mem.rsp()));   // xchg rsp, [gs:rel tmp_rsp]
 
-  template <size_t CACHELEN>
-  void JmpIndTerminator<CACHELEN>::handle_bkpt(Tracee& tracee) {
-    uint8_t *orig_pc;
-    uint8_t *new_pc;
-    Terminator::handle_bkpt_singlestep(tracee, orig_pc, new_pc);
-
-    /* Check if cache was already updated -- shouldn't be necessary for correctness? */
-    const auto it = std::find(orig_vals.begin(), orig_vals.end(), orig_pc);
-    if (it == orig_vals.end()) {
-      
-      /* Update cache: shift origs & newjmps down, add new pair at front.
-       */
-      const auto i = eviction_index;
-      orig_vals[i] = orig_pc;
-      tracee.write(&orig_vals[i], sizeof(orig_vals[i]), (uint8_t *) orig_ptrs[i]);
-      newjmps[i].retarget(new_pc);
-      write(newjmps[i]);
-      flush(tracee);
-      eviction_index = (eviction_index + 1) % CACHELEN;
+    return it + 0x60;
+  }
 
+  bool Terminator::can_load_addr(const Instruction& branch) {
+    /* RSP-relative operands would be evaluated on the tmp stack */
+    if (branch.xed_nmemops() > 0) {
+      return branch.xed_base_reg() != XED_REG_RSP && branch.xed_index_reg() != XED_REG_RSP;
     } else {
-      
-      const auto i = it - orig_vals.begin();
-      tracee.write(&orig_vals[i], sizeof(orig_vals[i]), (uint8_t *) orig_ptrs[i]);
-      write(newjmps[i]);
-      flush(tracee);
-
-    }
-
-    // DEBUG
-#if 0
-    *g_conf.log << "[" << tracee.pid() << "] ss INCACHE ";
-    *g_conf.log << "orig_pc = " << (void *) orig_pc << ", new_pc = " << (void *) new_pc;
-    for (auto i = 0UL; i < CACHELEN; ++i) {
-      *g_conf.log << ", *(" << (void *) orig_ptrs[i] << ") = " << (void *) orig_vals[i] << " -> "
-		  << (void *) newjmps[i].branch_dst() << ", ";
+      return branch.xed_reg0() != XED_REG_RSP;
     }
-    *g_conf.log << "\n";
-#endif
   }
 
-  template <size_t CACHELEN>
-  uint8_t *JmpIndTerminator<CACHELEN>::load_addr(const Instruction& jmp, PointerPool& ptr_pool,
-						 uint8_t *addr) {
-    assert(jmp.xed_iclass() == XED_ICLASS_JMP);
+  uint8_t *Terminator::load_addr(const Instruction& jmp, PointerPool& ptr_pool, uint8_t *addr) {
+    assert(jmp.xed_iclass() == XED_ICLASS_JMP || jmp.xed_iclass() == XED_ICLASS_CALL_NEAR);
   
-    if (jmp.xed_iform() == XED_IFORM_JMP_MEMv && jmp.xed_base_reg() == XED_REG_RIP) {
+    if (jmp.xed_nmemops() > 0 && jmp.xed_base_reg() == XED_REG_RIP) {
       uint8_t *dst = jmp.mem_dst();
       uint8_t **ptr = (uint8_t **) ptr_pool.add((uintptr_t) dst);
       const auto inst1 = Instruction::mov_mem64(addr, Instruction::reg_t::RAX, (uint8_t *) ptr);
       addr += inst1.size();
-      const auto inst2 = Instruction::from_bytes(addr, 0x48, 0x8b, 0x00);
+      const auto inst2 = Code::from_bytes(addr, XED_ICLASS_MOV, 0x48, 0x8b, 0x00);
       addr += inst2.size();
 
       write(inst1);
@@ -646,19 +848,18 @@ namespace dbi {
     *newdata_it++ = newmodrm;
 
     /* copy remaining bytes */
-    std::copy(data_it, data_end, newdata_it);
+    newdata_it = std::copy(data_it, data_end, newdata_it);
 
     /* create instruction */
-    const auto inst = Instruction::from_data(addr, newdata);
+    const Code inst(addr, newdata.data(), newdata_it - newdata.begin(), XED_ICLASS_MOV);
     write(inst);
 
     assert(inst.size() == load_addr_size(jmp));
     return addr + inst.size();
   }
 
-  template <size_t CACHELEN>
-  size_t JmpIndTerminator<CACHELEN>::load_addr_size(const Instruction& jmp) {
-    if (jmp.xed_iform() == XED_IFORM_JMP_MEMv && jmp.xed_base_reg() == XED_REG_RIP) {
+  size_t Terminator::load_addr_size(const Instruction& jmp) {
+    if (jmp.xed_nmemops() > 0 && jmp.xed_base_reg() == XED_REG_RIP) {
       return 10;
     } else {
       /* skip non-REX prefixes */
@@ -6,26 +6,33 @@ namespace dbi {
 }
 
 #include <memory>
-#include <list>
+#include <vector>
 #include <type_traits>
 #include "inst.hh"
 #include "block-pool.hh"
 #include "ptr-pool.hh"
 #include "rsb.hh"
 #include "tmp-mem.hh"
+#include "trans-table.hh"
+#include "edge-resolver.hh"
+#include "jcc-predictor.hh"
+#include "arena.hh"
 #include "types.hh"
 
 namespace dbi {
 
+  /* Terminators are allocated in the patcher's arena and freed with it on a code cache flush.
+   * Emitted code is not kept here: write() stores straight into the tracer's view of the code
+   * cache.
+   */
   class Terminator {
   public:
-    using InstVec = std::list<std::unique_ptr<Blob>>;
-    using InstIt = InstVec::iterator;
-  
-    static Terminator *Create(BlockPool& block_pool, PointerPool& ptr_pool, TmpMem& tmp_mem,
+    static Terminator *Create(Arena& arena, BlockPool& block_pool, PointerPool& ptr_pool,
+			      TmpMem& tmp_mem,
 			      const Instruction& branch, Tracees& tracees, const LookupBlock& lb,
 			      const ProbeBlock& pb, const RegisterBkpt& rb,
-			      const ReturnStackBuffer& rsb, const Block& block);
+			      const ReturnStackBuffer& rsb, TranslationTable& table,
+			      const EdgeResolver& resolver, const Block& block);
 
     // handle breakpoint by single-stepping    
     void handle_bkpt_singlestep(Tracee& tracee); 
@@ -33,9 +40,22 @@ namespace dbi {
     // also return original PC after single-stepping
     void handle_bkpt_singlestep(Tracee& tracee, uint8_t *& orig_pc, uint8_t *& new_pc); 
 
+    /* For region translation (g_conf.region_blocks): original targets of direct edges that still
+     * go through a resolve stub, and linking those edges once their targets are translated.
+     */
+    virtual void unlinked_edges(std::vector<uint8_t *>& dsts) const {}
+    virtual void link(const ProbeBlock& pb) {}
+
+    /* The edge whose resolve stub breaks at bkpt was resolved in-core (see EdgeResolver::drain);
+     * its target is translated, so link the edge to it for good.
+     */
+    virtual void resolved(uint8_t *bkpt) {}
+
   protected:
     Terminator(BlockPool& block_pool, size_t size, const Instruction& branch,
 	       Tracees& tracees, const LookupBlock& lb);
+    Terminator(BlockPool& block_pool, size_t size, uint8_t *orig_branch_addr,
+	       Tracees& tracees, const LookupBlock& lb);
 
     uint8_t *write(uint8_t *addr, const uint8_t *data, size_t count);
     uint8_t *write(const Blob& blob) {
@@ -46,15 +66,30 @@ namespace dbi {
     }
     uint8_t *write_bkpt(uint8_t *addr) { return write(addr, 0xcc); }
 
-    void flush(Tracee& tracee);
-    void flush(Tracees& tracees) {
-      if (dirty_) {
-	std::for_each(tracees.begin(), tracees.end(), [&] (auto& tracee_pair) {
-	  this->flush_always(tracee_pair.tracee);
-	});
-	dirty_ = false;
-      }
+    /* Retarget a jump (JMP_RELBRd) that tracees may be executing. Its displacement must be
+     * 4-byte aligned, so that it is replaced with a single store.
+     */
+    void retarget_jmp(uint8_t *jmp_addr, uint8_t *dst);
+    static uint8_t *align_jmp(uint8_t *jmp_addr) {
+      return reinterpret_cast<uint8_t *>(util::align_up(reinterpret_cast<uintptr_t>(jmp_addr) + 1,
+							sizeof(int32_t)) - 1);
     }
+    static constexpr size_t align_jmp_pad = sizeof(int32_t) - 1;
+
+    /* Stub that resolves an edge to the original address orig_dst through the EdgeResolver.
+     * Returns the address of the breakpoint taken on a miss, which identifies the edge in
+     * resolved().
+     */
+    uint8_t *write_resolve_stub(uint8_t *addr, uint8_t *orig_dst, const EdgeResolver& resolver,
+				const TmpMem& tmp_mem);
+
+    void flush(); // makes what was written visible in the tracees' memory caches
+
+    /* Breakpoint taken by a return to a return site that was left untranslated: translate it,
+     * point the RSB slot new_ra_ptr at it for later calls and resume the tracee there.
+     */
+    void resolve_return_site(Tracee& tracee, PointerPool& ptr_pool, uint8_t *orig_ra,
+			     uint8_t **new_ra_ptr);
 
     template <typename... Args>
     uint8_t *try_lookup_block(Args&&... args) { return lb_(args...); }
@@ -82,14 +117,36 @@ namespace dbi {
     static uint8_t *assign_addresses(const std::array<uint8_t, N>& lens,
 				     std::array<uint8_t *, N>& addrs, uint8_t *addr);
 
+    /* Probe the translation table for the original target in RAX, assuming the tmp stack is
+     * active with flags and RAX pushed. Counts and jumps to the translated target on a hit.
+     * On a miss, restores state and falls through to a breakpoint, whose address is returned.
+     */
+    uint8_t *write_table_probe(uint8_t *addr, const TranslationTable& table, const TmpMem& tmp_mem,
+			       uint64_t *hits);
+    static constexpr size_t TABLE_PROBE_SIZE = 0x61;
+    static constexpr size_t TABLE_PROBE_SIZE_pre =
+      Instruction::thread_prefix_len + Instruction::xchg_rsp_mem_len + Instruction::pushf_len +
+      Instruction::push_reg_len;
+    static size_t table_probe_size(const Instruction& branch) {
+      return TABLE_PROBE_SIZE_pre + load_addr_size(branch) + TABLE_PROBE_SIZE;
+    }
+
+    /* Whether the target of an indirect branch can be loaded on the tmp stack. */
+    static bool can_load_addr(const Instruction& branch);
+
+    /* Load the target of an indirect branch into RAX. */
+    uint8_t *load_addr(const Instruction& branch, PointerPool& ptr_pool, uint8_t *addr);
+    static size_t load_addr_size(const Instruction& branch);
+
   
   private:
-    using Buf = std::vector<uint8_t>;
+    const BlockPool& block_pool_;
     uint8_t *addr_;
-    size_t size_;
-    Buf buf_;
-    bool dirty_ = false; // whether buf is dirty
-    const LookupBlock lb_;
+    uint8_t *local_; // tracer's view of addr_
+    uint32_t size_;
+    uint32_t dirty_begin_; // range written since the last flush; empty if begin >= end
+    uint32_t dirty_end_ = 0;
+    const LookupBlock& lb_; // owned by the patcher
     uint8_t *orig_branch_addr_;
 
     template <typename I>  
@@ -99,7 +156,6 @@ namespace dbi {
     }
 
     uint8_t *orig_branch_addr() const { return orig_branch_addr_; }
-    void flush_always(Tracee& tracee);
   };
 
   class DirJmpTerminator: public Terminator {
@@ -112,16 +168,32 @@ namespace dbi {
 
   class DirJccTerminator: public Terminator {
   public:
-    DirJccTerminator(BlockPool& block_pool, const Instruction& jcc, Tracees& tracees,
-		     const LookupBlock& lb, const ProbeBlock& pb, const RegisterBkpt& rb, const Block& block);
+    DirJccTerminator(BlockPool& block_pool, TmpMem& tmp_mem, const Instruction& jcc,
+		     Tracees& tracees, const LookupBlock& lb, const ProbeBlock& pb,
+		     const RegisterBkpt& rb, TranslationTable& table, const EdgeResolver& resolver,
+		     const Block& block);
+
+    void unlinked_edges(std::vector<uint8_t *>& dsts) const override;
+    void link(const ProbeBlock& pb) override;
+    void resolved(uint8_t *bkpt) override;
+
+    static JccPredictor& predictor() { return predictor_; }
+
   private:
     static constexpr size_t DIR_JCC_SIZE =
-      Instruction::jcc_relbrd_len + Instruction::jmp_relbrd_len + Instruction::int3_len;
-    Instruction jcc_inst;
+      Instruction::jcc_relbrd_len + (align_jmp_pad + Instruction::jmp_relbrd_len) * 2 +
+      EdgeResolver::STUB_SIZE * 2;
     uint8_t *orig_dst;
     uint8_t *orig_fallthru;
-    uint8_t *jcc_bkpt_addr;
+    uint8_t *jcc_jmp_addr; // target of the jcc until it is resolved
     uint8_t *fallthru_addr;
+    uint8_t *fallthru_stub_addr() const { return jcc_jmp_addr + Instruction::jmp_relbrd_len; }
+    uint8_t *jcc_stub_addr() const { return fallthru_stub_addr() + EdgeResolver::STUB_SIZE; }
+    bool jcc_linked;
+    bool fallthru_linked;
+    bool jcc_sampled = false; // left on a stub; the online predictor is told when it is taken
+    bool fallthru_sampled = false;
+    TranslationTable& table;
 
     enum class Bias {NONE, JCC, FALLTHRU};
 
@@ -130,6 +202,8 @@ namespace dbi {
     xed_iclass_enum_t iclass;
     xed_iform_enum_t iform;
     enum class Direction {FWD, BACK} dir;
+    static JccPredictor predictor_;
+    JccPredictor::Key predictor_key() const { return {iclass, iform, dir == Direction::BACK}; }
     static constexpr unsigned last_decision_bits = 1;
     static std::string last_decision;
     static void add_decision(char c);
@@ -150,9 +224,7 @@ namespace dbi {
     Prediction get_prediction_iclass() const;
     Prediction get_prediction_iform() const;
     Prediction get_prediction_dir() const;
-    xed_iclass_enum_t last_iclass() const { std::abort(); }
-    const char *last_iclass_str() const { return xed_iclass_enum_t2str(last_iclass()); }
-    Prediction get_prediction_last_iclass(void) const;
+    Prediction get_prediction_online() const;
   
     Bias get_bias(void) const;
 
@@ -162,41 +234,64 @@ namespace dbi {
     Bias get_bias_dir(void) const;
   };
 
-  template <size_t CACHELEN>
+  /* Out-of-line exit of a trace (see Block::Create), for a jcc in the middle of it whose cold
+   * successor is not laid out next: an aligned jump to the cold successor, which goes through
+   * a resolve stub until that is translated.
+   */
+  class TraceExitTerminator: public Terminator {
+  public:
+    TraceExitTerminator(BlockPool& block_pool, TmpMem& tmp_mem, uint8_t *orig_jcc,
+			uint8_t *orig_dst, Tracees& tracees, const LookupBlock& lb,
+			const ProbeBlock& pb, const RegisterBkpt& rb, TranslationTable& table,
+			const EdgeResolver& resolver);
+
+    uint8_t *entry() const { return jmp_addr; } // target of the jcc
+    void resolved(uint8_t *bkpt) override;
+
+    static constexpr size_t TRACE_EXIT_SIZE =
+      align_jmp_pad + Instruction::jmp_relbrd_len + EdgeResolver::STUB_SIZE;
+
+  private:
+    uint8_t *orig_dst;
+    uint8_t *jmp_addr;
+    TranslationTable& table;
+
+    void handle_bkpt(Tracee& tracee);
+  };
+
   class JmpIndTerminator: public Terminator {
   public:
     JmpIndTerminator(BlockPool& block_pool, PointerPool& ptr_pool, TmpMem& tmp_mem,
 		     const Instruction& jmp, Tracees& tracees, const LookupBlock& lb,
-		     const RegisterBkpt& rb);
+		     const RegisterBkpt& rb, TranslationTable& table);
   private:
-    static constexpr size_t JMP_IND_SIZE_pre = 7 + 1 + 1;
-    static constexpr size_t JMP_IND_SIZE_post = 1 + 1 + 7 + 1 + 1;
-    static constexpr size_t JMP_IND_SIZE_base = JMP_IND_SIZE_pre + JMP_IND_SIZE_post;
-    static constexpr size_t JMP_IND_SIZE_cmp = 9;
-    static constexpr size_t JMP_IND_SIZE_match = 7 + 7;
-    static constexpr size_t JMP_IND_SIZE_per = JMP_IND_SIZE_cmp + JMP_IND_SIZE_match;
-    static size_t jmp_ind_size(const Instruction& jmp);
-    uint8_t *load_addr(const Instruction& jmp, PointerPool& ptr_pool, uint8_t *addr);
-    static size_t load_addr_size(const Instruction& jmp);
-    uint8_t *match_addr(size_t n, const Instruction& jmp) const;
-  
-    void handle_bkpt(Tracee& tracee);
+    static constexpr size_t JMP_IND_SIZE_trap = 1;
+    static size_t jmp_ind_size(const Instruction& jmp) {
+      if (can_load_addr(jmp)) {
+	return table_probe_size(jmp);
+      } else {
+	return JMP_IND_SIZE_trap;
+      }
+    }
 
-    template <typename T>
-    using CacheArray = std::array<T, CACHELEN>;
-    CacheArray<uint8_t **> orig_ptrs;
-    CacheArray<uint8_t *> orig_vals;
-    CacheArray<Instruction> newjmps;
-    unsigned eviction_index = 0; // next entry to evict. Always in range [0, CACHELEN).
+    TranslationTable& table;
+
+    void handle_bkpt(Tracee& tracee);
   };
 
   class RetTerminator: public Terminator {
   public:
     RetTerminator(BlockPool& block_pool, TmpMem& tmp_mem, const Instruction& ret, Tracees& tracees,
-		  const LookupBlock& lb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb);
+		  const LookupBlock& lb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb,
+		  TranslationTable& table);
 
   private:
-    static constexpr size_t RET_SIZE = 0x57; // from rsb-ret.asm.
+    static constexpr size_t RET_SIZE_pre = 0x78; // from rsb-ret.asm
+    static constexpr size_t RET_SIZE = RET_SIZE_pre + TABLE_PROBE_SIZE;
+
+    TranslationTable& table;
+
+    void handle_bkpt_miss(Tracee& tracee);
   };
 
   class CallTerminator: public Terminator {
@@ -205,15 +300,46 @@ namespace dbi {
 		   const Instruction& call, Tracees& tracees, const LookupBlock& lb,
 		   const ProbeBlock& pb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb);
 
+    /* RSB push sequence (from rsb-call.asm); also used to inline direct calls into superblocks */
+    static Data rsb_push(uint8_t *pc, const TmpMem& tmp_mem, const ReturnStackBuffer& rsb,
+			 uint8_t **orig_ra_ptr, uint8_t **new_ra_ptr);
+    static constexpr size_t CALL_SIZE_PRE = 0x49;
+
   protected:
     uint8_t *subaddr() const { return Terminator::addr() + CALL_SIZE_PRE; }
   
   private:
-    static constexpr size_t CALL_SIZE_PRE = 0x33; // from rsb-call.asm
     static constexpr size_t CALL_SIZE_POST = 1; // one breakpoint
     static constexpr size_t CALL_SIZE = CALL_SIZE_PRE + CALL_SIZE_POST;
+    PointerPool& ptr_pool;
     uint8_t *orig_ra_val;
     uint8_t **new_ra_ptr;
+
+    void handle_bkpt_ret(Tracee& tracee);
+  };
+
+  /* Return site of a call inlined into a superblock. Like CallTerminator's, it is left lazy
+   * unless already translated: the RSB slot of the call points at a breakpoint here until then.
+   * Allocated once the superblock and its terminator are complete, so not next to the block.
+   */
+  class ReturnSiteTerminator: public Terminator {
+  public:
+    ReturnSiteTerminator(BlockPool& block_pool, PointerPool& ptr_pool, uint8_t *orig_ra,
+			 uint8_t **new_ra_ptr, Tracees& tracees, const LookupBlock& lb,
+			 const ProbeBlock& pb, const RegisterBkpt& rb);
+
+    void unlinked_edges(std::vector<uint8_t *>& dsts) const override;
+    void link(const ProbeBlock& pb) override;
+
+    static constexpr size_t RETURN_SITE_SIZE = Instruction::int3_len;
+
+  private:
+    PointerPool& ptr_pool;
+    uint8_t *orig_ra;
+    uint8_t **new_ra_ptr;
+    bool linked;
+
+    void handle_bkpt(Tracee& tracee);
   };
 
   class CallDirTerminator: public CallTerminator {
@@ -230,10 +356,22 @@ namespace dbi {
   public:
     CallIndTerminator(BlockPool& block_pool, PointerPool& ptr_pool, TmpMem& tmp_mem,
 		      const Instruction& call, Tracees& tracees, const LookupBlock& lb,
-		      const ProbeBlock& pb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb);
+		      const ProbeBlock& pb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb,
+		      TranslationTable& table);
   
   private:
-    static constexpr size_t CALL_IND_SIZE = 1;
+    static constexpr size_t CALL_IND_SIZE_trap = 1;
+    static size_t call_ind_size(const Instruction& call) {
+      if (can_load_addr(call)) {
+	return Instruction::push_mem_len + table_probe_size(call);
+      } else {
+	return CALL_IND_SIZE_trap;
+      }
+    }
+
+    TranslationTable& table;
+
+    void handle_bkpt_miss(Tracee& tracee);
   };
 
   class IndTerminator: public virtual Terminator {
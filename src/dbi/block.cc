@@ -4,117 +4,320 @@
 #include "block.hh"
 #include "block-pool.hh"
 #include "settings.hh"
+#include "config.hh"
 
 namespace dbi {
 
-  bool Block::Create(uint8_t *orig_addr, Tracees& tracees, BlockPool& block_pool,
+  bool Block::Create(uint8_t *orig_addr, Arena& arena, Tracees& tracees, ROMCache& romcache,
+		     BlockPool& block_pool,
 		     PointerPool& ptr_pool, TmpMem& tmp_mem, const LookupBlock& lb,
 		     const ProbeBlock& pb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb,
-		     const InsertBlock& ib, const Transformer& transformer,
-		     const BkptCallback& syscall_pre, const BkptCallback& syscall_post)
+		     TranslationTable& table, const EdgeResolver& resolver, const InsertBlock& ib,
+		     const Transformer& transformer, const SyscallFilter& syscall_filter,
+		     const BkptCallback& syscall_pre, const BkptCallback& syscall_post,
+		     const Tiering& tiering)
   {
-    Block *block = new Block(orig_addr);
+    Block *block = arena.make<Block>(orig_addr);
     uint8_t *it = orig_addr;
+
+    /* Scratch space for instruction locations, copied into the arena once the block is
+     * complete. Nested translations only start after that (from the terminator), so this can
+     * be shared.
+     */
+    static std::vector<InstLoc> inst_locs;
+    inst_locs.clear();
   
+    block_pool.reserve(max_size);
+    uint8_t *reserved = block_pool.peek();
+
+    /* A trace's cold exits go in front of it, out of the way of the hot path, so that its jccs
+     * are emitted with their final targets. Creating them translates nothing.
+     */
+    const bool tracing = tiering.trace != nullptr;
+    std::unordered_map<uint8_t *, uint8_t *> trace_exits; // original jcc -> its exit
+    if (tracing) {
+      for (const auto& step : tiering.trace->steps) {
+	if (step.second.cold != nullptr) {
+	  const auto *exit = arena.make<TraceExitTerminator>(block_pool, tmp_mem, step.first,
+							     step.second.cold, tracees, lb, pb,
+							     rb, table, resolver);
+	  trace_exits.emplace(step.first, exit->entry());
+	}
+      }
+    }
+
+    /* traces are aligned like loop heads; counted blocks start with a jump for redirect(),
+     * whose displacement must be aligned
+     */
+    int64_t *counter = nullptr;
+    if (!tracing && tiering.counters != nullptr) {
+      counter = tiering.counters->alloc(g_conf.tier_threshold);
+    }
+    const uintptr_t peek = reinterpret_cast<uintptr_t>(block_pool.peek());
+    const uintptr_t entry = tracing ? util::align_up(peek, trace_align) :
+      counter ? util::align_up(peek + 1, sizeof(int32_t)) - 1 : peek;
+    if (entry > peek) {
+      block_pool.alloc(entry - peek);
+    }
     block->pool_addr_ = block_pool.peek();
+    block->counter_ = counter;
 
     bool stop = false;
 
-    std::vector<uint8_t> buf;
-    uint8_t *newit = block_pool.peek();
-    const auto append = [&] (const Blob& blob) {
-      assert(newit == blob.pc());
-      const auto data = blob.data();
-      const auto size = blob.size();
-      buf.insert(buf.end(), data, data + size);
-      newit += size;
+    /* superblock state: entry points of followed branch targets and return sites of inlined
+     * calls, which get their terminators once the superblock is complete
+     */
+    struct Entry {
+      uint8_t *orig;
+      uint8_t *pool;
     };
+    std::vector<Entry> entries;
+    std::vector<std::pair<uint8_t *, uintptr_t *>> return_sites;
+    size_t ninsts = 0;
+
+    EmitBuffer buf(block_pool, max_size - (block->pool_addr_ - reserved));
+    if (counter != nullptr) {
+      write_counter(buf, counter, tmp_mem, rb,
+		    [&hot = tiering.hot, orig_addr] (Tracee& tracee, uint8_t *) {
+		      hot(tracee, orig_addr);
+		    });
+    }
+
+    /* trace state: follows the path's branches, emitting jccs to the cold exits */
+    size_t trace_blocks = 1;
+    const auto follow_trace = [&] (const Instruction& branch) -> bool {
+      if (!tracing || trace_blocks >= trace_max_blocks || buf.size() >= trace_max_size) {
+	return false;
+      }
+      const auto step_it = tiering.trace->steps.find(branch.pc());
+      if (step_it == tiering.trace->steps.end()) {
+	return false;
+      }
+      const TracePath::Step& step = step_it->second;
 
-    const auto flush = [&] (void) {
-      assert(buf.size() == static_cast<size_t>(newit - block->pool_addr_));
-      std::for_each(tracees.begin(), tracees.end(), [&] (auto& tracee_pair) {
-	tracee_pair.tracee.write(buf.data(), buf.size(), block->pool_addr_);
-      });
-      block_pool.alloc(buf.size());
+      if (step.cold == nullptr) {
+	if (branch.xed_iclass() != XED_ICLASS_JMP || !inlinable_branch(branch) ||
+	    step.next != branch.branch_dst()) {
+	  return false;
+	}
+      } else {
+	/* lay out the hot successor next; the jcc goes to the exit on the other condition if
+	 * the hot one is its target
+	 */
+	const bool taken = step.next == branch.branch_dst() && step.cold == branch.after_pc();
+	if (!taken && (step.next != branch.after_pc() || step.cold != branch.branch_dst())) {
+	  return false;
+	}
+	const xed_iclass_enum_t iclass =
+	  taken ? Instruction::jcc_invert(branch.xed_iclass()) : branch.xed_iclass();
+	if (iclass == XED_ICLASS_INVALID) {
+	  return false;
+	}
+	buf.append(Instruction::jcc_relbrd(buf.pc(), iclass, trace_exits.at(branch.pc())));
+      }
+
+      ++trace_blocks;
+      it = step.next;
+      return true;
     };
   
-    const Writer writer = [&] (Blob& blob) -> uint8_t * {
-      // TODO: Refactor, esp. return statements.
-    
-      const auto inst = dynamic_cast<Instruction *>(&blob);
+    const auto try_follow = [&] (const Instruction& branch) -> bool {
+      if (tracing || !g_conf.superblock || !inlinable_branch(branch) ||
+	  ninsts >= superblock_max_insts || buf.size() >= superblock_max_size) {
+	return false;
+      }
 
-      if (inst == nullptr) {
-	blob.relocate(newit);
-	append(blob);
-	return newit;
+      /* chain to existing translations rather than duplicating them */
+      uint8_t *dst = branch.branch_dst();
+      if (dst == orig_addr || pb(dst) != nullptr ||
+	  std::any_of(entries.begin(), entries.end(), [&] (const Entry& e) { return e.orig == dst; })) {
+	return false;
       }
 
+      if (branch.xed_iclass() == XED_ICLASS_CALL_NEAR) {
+	/* RSB push
+	 * push [rel orig_ra]
+	 */
+	uint8_t **orig_ra_ptr = (uint8_t **) ptr_pool.add((uintptr_t) branch.after_pc());
+	uintptr_t *new_ra_ptr = ptr_pool.alloc();
+	buf.append(CallTerminator::rsb_push(buf.pc(), tmp_mem, rsb, orig_ra_ptr,
+					    (uint8_t **) new_ra_ptr));
+	buf.append(Instruction::push_mem(buf.pc(), (uint8_t *) orig_ra_ptr));
+	return_sites.emplace_back(branch.after_pc(), new_ra_ptr);
+      }
+
+      entries.push_back(Entry {dst, buf.pc()});
+      it = dst;
+      return true;
+    };
+  
+    /* instructions from the original code; other blobs are appended by the writer itself */
+    const auto write_inst = [&] (Instruction& inst) -> uint8_t * {
+      // TODO: Refactor, esp. return statements.
+
+      ++ninsts;
+
       /* check if branch */
-      stop = classify_inst(*inst);
+      stop = classify_inst(inst);
+      if (stop && (follow_trace(inst) || try_follow(inst))) {
+	stop = false;
+	return buf.pc();
+      }
+      
       if (stop) {
 	/* branch stuff */
-	flush();
+	if (tracing && tiering.trace_blocks != nullptr) {
+	  *tiering.trace_blocks = trace_blocks;
+	}
+	buf.commit();
+	const InstLoc *inst_locs_begin = arena.copy<InstLoc>(inst_locs.begin(), inst_locs.end());
+	block->inst_locs_ = InstLocs {inst_locs_begin, inst_locs_begin + inst_locs.size()};
 	ib(orig_addr, block);
-	block->terminator_ =
-	  std::unique_ptr<Terminator>(Terminator::Create(block_pool, ptr_pool, tmp_mem, *inst,
-							 tracees, lb, pb, rb, rsb, *block));
+	for (const Entry& entry : entries) {
+	  Block *entry_block = arena.make<Block>(entry.orig);
+	  entry_block->pool_addr_ = entry.pool;
+	  ib(entry.orig, entry_block);
+	}
+	block->terminator_ = Terminator::Create(arena, block_pool, ptr_pool, tmp_mem, inst,
+						tracees, lb, pb, rb, rsb, table, resolver, *block);
+
+	/* Return sites are left lazy rather than translated here, which would nest a translation
+	 * per call along a call chain; region translation queues them like other edges.
+	 */
+	if (!return_sites.empty()) {
+	  block_pool.reserve(return_sites.size() * ReturnSiteTerminator::RETURN_SITE_SIZE);
+	  std::vector<Terminator *> terms;
+	  for (const auto& return_site : return_sites) {
+	    terms.push_back(arena.make<ReturnSiteTerminator>(block_pool, ptr_pool,
+							     return_site.first,
+							     (uint8_t **) return_site.second,
+							     tracees, lb, pb, rb));
+	  }
+	  Terminator *const *terms_begin = arena.copy<Terminator *>(terms.begin(), terms.end());
+	  block->return_sites_ = ReturnSites {terms_begin, terms_begin + terms.size()};
+	}
 	return nullptr; // rv shouldn't matter
       }
 
-      const bool is_syscall = (inst->xed_iclass() == XED_ICLASS_SYSCALL);
-    
-      /* if is syscall, add breakpoint for checking maps */
-      if (is_syscall) {
-	auto syscall_pre_bkpt = Instruction::int3(newit);
-	append(syscall_pre_bkpt);
-	rb(syscall_pre_bkpt.pc(), syscall_pre);
+      /* syscalls only trap into the tracer if they have a hook */
+      if (inst.xed_iclass() == XED_ICLASS_SYSCALL) {
+	write_syscall(buf, inst, syscall_filter, rb, syscall_pre, syscall_post);
+	return buf.pc();
       }
 
       /* relocate */
-      if (inst->pc() != newit) {
-	if (inst->xed_nmemops() > 0 && inst->xed_base_reg() == XED_REG_RIP) {
-	  block->transform_riprel_inst(newit, append, *inst, ptr_pool, tmp_mem);
-	  return newit;
+      if (inst.pc() != buf.pc()) {
+	if (inst.xed_nmemops() > 0 && inst.xed_base_reg() == XED_REG_RIP) {
+	  transform_riprel_inst(buf, inst, ptr_pool, tmp_mem);
+	  return buf.pc();
 	}
       
-	inst->relocate(newit);
+	inst.relocate(buf.pc());
       }
     
       /* write instruction */
-      append(*inst);
-
-      if (is_syscall) {
-	auto syscall_post_bkpt = Instruction::int3(newit);
-	append(syscall_post_bkpt);
-	rb(syscall_post_bkpt.pc(), syscall_post);
-      }
+      buf.append(inst);
     
-      return newit;
+      return buf.pc();
     };
+    const Writer writer(buf, write_inst);
 
     Instruction inst;
     // use front tracee for translating; code should be all same.
     Tracee& tracee = tracees.front().tracee; 
     while (!stop) {
-      inst = Instruction(it, tracee);
+      if (PATCHER_USE_ROMCACHE) {
+	inst = Instruction(it, romcache);
+      } else {
+	inst = Instruction(it, tracee);
+      }
 
       if (!inst) {
 	return false;
       }
 
+      inst_locs.push_back(InstLoc {buf.pc(), it});
       it += inst.size(); // update original PC
 
-      transformer(newit, inst, writer);
+      transformer(buf.pc(), inst, writer);
     }
 
     return true;
   }
 
-  template <typename Append>
-  void Block::transform_riprel_inst(uint8_t *& pc, const Append& append, const Instruction& inst,
+  uint8_t *Block::orig_inst_addr(uint8_t *pool_addr) const {
+    const auto it = std::upper_bound(inst_locs_.begin(), inst_locs_.end(), pool_addr,
+				     [] (uint8_t *addr, const InstLoc& loc) {
+				       return addr < loc.pool;
+				     });
+    if (it == inst_locs_.begin()) {
+      return orig_addr_;
+    }
+    return std::prev(it)->orig;
+  }
+
+  const Block::InstLoc *Block::inst_loc(uint8_t *pool_addr) const {
+    const auto it = std::lower_bound(inst_locs_.begin(), inst_locs_.end(), pool_addr,
+				     [] (const InstLoc& loc, uint8_t *addr) {
+				       return loc.pool < addr;
+				     });
+    if (it == inst_locs_.end() || it->pool != pool_addr) {
+      return nullptr;
+    }
+    return it;
+  }
+
+  void Block::redirect(BlockPool& block_pool, uint8_t *dst) const {
+    assert(counter_ != nullptr);
+    uint8_t *disp_addr = pool_addr_ + 1;
+    assert(reinterpret_cast<uintptr_t>(disp_addr) % sizeof(int32_t) == 0);
+    const ptrdiff_t disp = dst - (pool_addr_ + Instruction::jmp_relbrd_len);
+    assert(disp == static_cast<int32_t>(disp));
+    __atomic_store_n(reinterpret_cast<int32_t *>(block_pool.local(disp_addr)),
+		     static_cast<int32_t>(disp), __ATOMIC_RELEASE);
+    block_pool.written(disp_addr, sizeof(int32_t));
+  }
+
+  void Block::write_counter(EmitBuffer& buf, int64_t *counter, TmpMem& tmp_mem,
+			    const RegisterBkpt& rb, const BkptCallback& callback) {
+    /*     jmp .count  ; entry, retargeted by redirect()
+     * .count:
+     *     mov [gs:rel tmp_0], rcx
+     *     mov rcx, [rel counter]
+     *     lea rcx, [rcx - 1]
+     *     mov [rel counter], rcx
+     *     jrcxz .hot
+     *     jmp .done
+     * .hot:
+     *     int3
+     * .done:
+     *     mov rcx, [gs:rel tmp_0]
+     *
+     * Neither lea nor jrcxz touches the flags. The decrement is not atomic: threads may lose
+     * counts, or both trap on the same zero, which the callback has to tolerate.
+     */
+    uint8_t *tmp = reinterpret_cast<uint8_t *>(tmp_mem[0]);
+    uint8_t *ctr = reinterpret_cast<uint8_t *>(counter);
+    const auto rcx = Instruction::reg_t::RCX;
+
+    buf.append(Instruction::jmp_relbrd(buf.pc(), buf.pc() + Instruction::jmp_relbrd_len));
+    buf.append(Instruction::mov_mem64(buf.pc(), tmp, rcx).prefix(Instruction::thread_prefix));
+    buf.append(Instruction::mov_mem64(buf.pc(), rcx, ctr));
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_LEA, 0x48, 0x8d, 0x49, 0xff)); // rcx - 1
+    buf.append(Instruction::mov_mem64(buf.pc(), ctr, rcx));
+    buf.append(Instruction::jrcxz(buf.pc(), buf.pc() + Instruction::jrcxz_len +
+				  Instruction::jmp_b_len));
+    buf.append(Instruction::jmp_b(buf.pc(), buf.pc() + Instruction::jmp_b_len +
+				  Instruction::int3_len));
+    rb(buf.pc(), callback);
+    buf.append(Instruction::int3(buf.pc()));
+    buf.append(Instruction::mov_mem64(buf.pc(), rcx, tmp).prefix(Instruction::thread_prefix));
+  }
+
+  void Block::transform_riprel_inst(EmitBuffer& buf, const Instruction& inst,
 				    PointerPool& ptr_pool, TmpMem& tmp_mem) {
     if (inst.xed_iclass() == XED_ICLASS_PUSH) {
-      transform_riprel_push(pc, append, inst, ptr_pool);
+      transform_riprel_push(buf, inst, ptr_pool);
       return;
     }
 
@@ -150,20 +353,21 @@ namespace dbi {
     std::cerr << "orig inst: " << inst << std::endl;
 #endif
   
-    /* mov [rel tmp_0], rax
+    /* mov [gs:rel tmp_0], rax
      * mov rax, [rel ptr]
      * OP dst, [rax] | OP [rax] | OP [rax], src
-     * mov rax, [rel tmp_0]
+     * mov rax, [gs:rel tmp_0]
      */
 
-    append(Instruction::mov_mem64(pc, (uint8_t *) tmp_mem[0], scrap_reg));
-    append(Instruction::mov_mem64(pc, scrap_reg, ptr_addr));
-    new_inst.relocate(pc); append(new_inst); // OP
-    append(Instruction::mov_mem64(pc, scrap_reg, (uint8_t *) tmp_mem[0]));
+    buf.append(Instruction::mov_mem64(buf.pc(), (uint8_t *) tmp_mem[0], scrap_reg)
+	       .prefix(Instruction::thread_prefix));
+    buf.append(Instruction::mov_mem64(buf.pc(), scrap_reg, ptr_addr));
+    new_inst.relocate(buf.pc()); buf.append(new_inst); // OP
+    buf.append(Instruction::mov_mem64(buf.pc(), scrap_reg, (uint8_t *) tmp_mem[0])
+	       .prefix(Instruction::thread_prefix));
   }
 
-  template <typename Append>
-  void Block::transform_riprel_push(uint8_t *& pc, const Append& append, const Instruction& push,
+  void Block::transform_riprel_push(EmitBuffer& buf, const Instruction& push,
 				    PointerPool& ptr_pool) {
     /* push rax
      * mov rax, [rel ptr]
@@ -174,10 +378,48 @@ namespace dbi {
     uint8_t *mem_dst = push.mem_dst();
     uint8_t *ptr_addr = (uint8_t *) ptr_pool.add((uintptr_t) mem_dst);
   
-    append(Instruction::from_bytes(pc, 0x50)); // push rax
-    append(Instruction::mov_mem64(pc, Instruction::reg_t::RAX, ptr_addr)); // mov rax, [rel ptr]
-    append(Instruction::from_bytes(pc, 0x48, 0x8b, 0x00)); // mov rax, [rax]
-    append(Instruction::from_bytes(pc, 0x48, 0x87, 0x04, 0x24)); // xchg rax, [rsp]
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_PUSH, 0x50)); // push rax
+    buf.append(Instruction::mov_mem64(buf.pc(), Instruction::reg_t::RAX, ptr_addr)); // mov rax, [rel ptr]
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_MOV, 0x48, 0x8b, 0x00)); // mov rax, [rax]
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_XCHG, 0x48, 0x87, 0x04, 0x24)); // xchg rax, [rsp]
+  }
+
+  void Block::write_syscall(EmitBuffer& buf, Instruction& syscall, const SyscallFilter& filter,
+			    const RegisterBkpt& rb, const BkptCallback& pre,
+			    const BkptCallback& post) {
+    /* lea r11, [rel filter]
+     * movzx ecx, ax
+     * movzx ecx, byte [r11 + rcx]
+     * jrcxz .untraced
+     * int3 ; pre
+     * syscall
+     * int3 ; post
+     * jmp .done
+     * .untraced:
+     * syscall
+     * .done:
+     *
+     * The syscall clobbers rcx and r11 anyway, and none of this touches the flags.
+     */
+
+    const size_t traced_len = Instruction::int3_len + syscall.size() + Instruction::int3_len +
+      Instruction::jmp_b_len;
+
+    buf.append(Instruction::lea(buf.pc(), Instruction::xreg_t::R11, filter.begin()));
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_MOVZX, 0x0f, 0xb7, 0xc8)); // movzx ecx, ax
+    buf.append(Code::from_bytes(buf.pc(), XED_ICLASS_MOVZX, 0x41, 0x0f, 0xb6, 0x0c, 0x0b));
+    buf.append(Instruction::jrcxz(buf.pc(), buf.pc() + Instruction::jrcxz_len + traced_len));
+
+    rb(buf.pc(), pre);
+    buf.append(Instruction::int3(buf.pc()));
+    syscall.relocate(buf.pc());
+    buf.append(syscall);
+    rb(buf.pc(), post);
+    buf.append(Instruction::int3(buf.pc()));
+    buf.append(Instruction::jmp_b(buf.pc(), buf.pc() + Instruction::jmp_b_len + syscall.size()));
+
+    syscall.relocate(buf.pc());
+    buf.append(syscall);
   }
 
   // returns true iff branch instruction
@@ -212,6 +454,18 @@ namespace dbi {
     }
   }
 
+  bool Block::inlinable_branch(const Instruction& inst) {
+    switch (inst.xed_iform()) {
+    case XED_IFORM_JMP_RELBRd:
+    case XED_IFORM_JMP_RELBRb:
+    case XED_IFORM_CALL_NEAR_RELBRd:
+      return true;
+
+    default:
+      return false;
+    }
+  }
+
   void Block::jump_to(Tracee& tracee) const {
     tracee.set_pc(pool_addr());
   }
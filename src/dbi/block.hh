@@ -5,7 +5,6 @@ namespace dbi {
 }
 
 #include <vector>
-#include <list>
 #include <cstddef>
 #include <cassert>
 #include <memory>
@@ -20,49 +19,137 @@ extern "C" {
 #include "tracee.hh"
 #include "inst.hh"
 #include "block-term.hh"
+#include "emit.hh"
 #include "ptr-pool.hh"
 #include "tmp-mem.hh"
 #include "romcache.hh"
+#include "syscall-filter.hh"
+#include "block-counters.hh"
+#include "arena.hh"
 #include "types.hh"
 
 namespace dbi {
 
+  /* Hot path through the original code, along which Block::Create lays out a trace: for each
+   * branch to follow, the successor to continue with and, for a jcc, the other successor.
+   */
+  struct TracePath {
+    struct Step {
+      uint8_t *next;
+      uint8_t *cold; // nullptr for a jmp
+    };
+    std::unordered_map<uint8_t *, Step> steps; // by original branch address
+  };
+
+  /* Tiered translation (g_conf.tier_threshold). Tier-0 blocks count their executions in-core
+   * and call hot once the count reaches the threshold; tier-1 blocks are traces along a path.
+   */
+  struct Tiering {
+    BlockCounters *counters; // count the block's executions, unless null or out of counters
+    const BkptCallback& hot; // with the block's original address as the second argument
+    const TracePath *trace;  // translate a trace along this path rather than a tier-0 block
+    size_t *trace_blocks;    // if not null, set to the original blocks the trace laid out
+  };
+
   class Block {
   public:
-    using InstVec = std::list<std::unique_ptr<Instruction>>;
-    using InstIt = InstVec::iterator;
     using Transformer = std::function<void(uint8_t *, Instruction&, const Writer&)>;
 
-    static bool Create(uint8_t *orig_addr, Tracees& tracees, BlockPool& block_pool,
+    static bool Create(uint8_t *orig_addr, Arena& arena, Tracees& tracees, ROMCache& romcache,
+		       BlockPool& block_pool,
 		       PointerPool& ptr_pool, TmpMem& tmp_mem, const LookupBlock& lb,
 		       const ProbeBlock& pb, const RegisterBkpt& rb, const ReturnStackBuffer& rsb,
-		       const InsertBlock& ib, const Transformer& transformer,
-		       const BkptCallback& syscall_pre, const BkptCallback& syscall_post);
+		       TranslationTable& table, const EdgeResolver& resolver, const InsertBlock& ib,
+		       const Transformer& transformer, const SyscallFilter& syscall_filter,
+		       const BkptCallback& syscall_pre, const BkptCallback& syscall_post,
+		       const Tiering& tiering);
     
     uint8_t *orig_addr() const { return orig_addr_; }
     uint8_t *pool_addr() const { return pool_addr_; }
+    Terminator *terminator() const { return terminator_; } // nullptr for superblock entry points
+    const int64_t *counter() const { return counter_; } // nullptr unless counted (tier 0)
+
+    /* Sends later entries to the block at dst instead, e.g. its trace; requires a counter.
+     * Tracees may be entering the block: its entry jump is retargeted with a single store.
+     */
+    void redirect(BlockPool& block_pool, uint8_t *dst) const;
+
+    /* whether the instruction ends a block */
+    static bool classify_inst(const Instruction& inst) {
+      return classify_inst(inst.xed_iclass());
+    }
+    static bool classify_inst(xed_iclass_enum_t iclass);
+
+    /* start of each translated instruction (including its instrumentation) in the code cache,
+     * in ascending order. Empty for superblock entry points, which lie inside their head block.
+     */
+    struct InstLoc {
+      uint8_t *pool;
+      uint8_t *orig;
+    };
+    struct InstLocs {
+      const InstLoc *first;
+      const InstLoc *last;
+      const InstLoc *begin() const { return first; }
+      const InstLoc *end() const { return last; }
+      bool empty() const { return first == last; }
+    };
+    InstLocs inst_locs() const { return inst_locs_; }
+
+    /* terminators of the return sites of calls inlined into a superblock, in call order */
+    struct ReturnSites {
+      Terminator *const *first;
+      Terminator *const *last;
+      Terminator *const *begin() const { return first; }
+      Terminator *const *end() const { return last; }
+    };
+    ReturnSites return_sites() const { return return_sites_; }
+
+    /* original address of the instruction whose translation contains pool_addr */
+    uint8_t *orig_inst_addr(uint8_t *pool_addr) const;
+
+    /* location of the instruction whose translation starts at pool_addr, or nullptr */
+    const InstLoc *inst_loc(uint8_t *pool_addr) const;
 
     void jump_to(Tracee& tracee) const;
 
+    /* upper bound on the contiguous code cache space a block (including its terminator) uses */
+    static constexpr size_t max_size = 0x8000;
+
+    /* trace limits */
+    static constexpr size_t trace_max_blocks = 16;
+    static constexpr size_t trace_max_size = 0x1000;
+
   private:
+    /* superblock limits */
+    static constexpr size_t superblock_max_insts = 256;
+    static constexpr size_t superblock_max_size = 0x1000;
+
+    static constexpr size_t trace_align = 16;
+
+    /* blocks, their terminators and instruction locations all live in the patcher's arena */
     uint8_t *orig_addr_;
     uint8_t *pool_addr_;
-    std::unique_ptr<Terminator> terminator_;
+    Terminator *terminator_ = nullptr;
+    InstLocs inst_locs_ = {nullptr, nullptr};
+    ReturnSites return_sites_ = {nullptr, nullptr};
+    int64_t *counter_ = nullptr;
 
     Block(uint8_t *orig_addr): orig_addr_(orig_addr) {}
+    friend class Arena;
 
-    static bool classify_inst(const Instruction& inst) {
-      return classify_inst(inst.xed_iclass());
-    }
-    static bool classify_inst(xed_iclass_enum_t iclass);
+    // returns true iff branch can be followed when forming a superblock
+    static bool inlinable_branch(const Instruction& inst);
 
-    template <typename Append>
-    static void transform_riprel_inst(uint8_t *& pc, const Append& append, const Instruction& inst,
+    static void transform_riprel_inst(EmitBuffer& buf, const Instruction& inst,
 				      PointerPool& ptr_pool, TmpMem& tmp_mem);
-  
-    template <typename Append>
-    static void transform_riprel_push(uint8_t *& pc, const Append& append, const Instruction& push,
+    static void transform_riprel_push(EmitBuffer& buf, const Instruction& push,
 				      PointerPool& ptr_pool);
+    static void write_counter(EmitBuffer& buf, int64_t *counter, TmpMem& tmp_mem,
+			      const RegisterBkpt& rb, const BkptCallback& callback);
+    static void write_syscall(EmitBuffer& buf, Instruction& syscall, const SyscallFilter& filter,
+			      const RegisterBkpt& rb, const BkptCallback& pre,
+			      const BkptCallback& post);
   };
 
 }
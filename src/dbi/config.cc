@@ -1,5 +1,8 @@
 #include <unordered_map>
 #include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 
 #include "config.hh"
 
@@ -13,7 +16,7 @@ namespace dbi {
        {"iclass", PredictionMode::ICLASS},
        {"iform", PredictionMode::IFORM},
        {"dir", PredictionMode::DIR},
-       {"last_iclass", PredictionMode::LAST_ICLASS},
+       {"online", PredictionMode::ONLINE},
       };
 
     const auto it = map.find(s);
@@ -29,6 +32,63 @@ namespace dbi {
     return set_prediction_mode(s, &Config::prediction_mode);
   }
 
+  /* Parses a decimal count at the start of s into val, and s past it. */
+  static bool parse_count(const char *& s, unsigned long& val) {
+    if (!std::isdigit(static_cast<unsigned char>(*s))) {
+      return false; // strtoul would accept whitespace and signs
+    }
+    char *end;
+    errno = 0;
+    val = std::strtoul(s, &end, 10);
+    s = end;
+    return errno != ERANGE;
+  }
+
+  /* Same for a size in units of 1 << shift bytes, which must fit in a size_t. */
+  static bool parse_size(const char *& s, unsigned shift, size_t& size) {
+    unsigned long val;
+    if (!parse_count(s, val) || val > (SIZE_MAX >> shift)) {
+      return false;
+    }
+    size = static_cast<size_t>(val) << shift;
+    return true;
+  }
+
+  bool Config::set_tier_threshold(const char *s) {
+    unsigned long threshold;
+    if (!parse_count(s, threshold) || *s != '\0') {
+      return false;
+    }
+    tier_threshold = threshold;
+    return true;
+  }
+
+  bool Config::set_code_cache_budget(const char *s) {
+    size_t budget;
+    if (!parse_size(s, 20, budget) || *s != '\0') {
+      return false;
+    }
+    code_cache_budget = budget;
+    return true;
+  }
+
+  bool Config::set_region(const char *s) {
+    size_t blocks;
+    size_t bytes = region_bytes;
+    if (!parse_size(s, 0, blocks)) {
+      return false;
+    }
+    if (*s == ',' && !parse_size(++s, 10, bytes)) {
+      return false;
+    }
+    if (*s != '\0') {
+      return false;
+    }
+    region_blocks = blocks;
+    region_bytes = bytes;
+    return true;
+  }
+
   void Config::abort(Tracee& tracee) {
     log->flush();
     if (gdb) {
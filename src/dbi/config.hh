@@ -8,7 +8,7 @@
 namespace dbi {
   
   struct Config {
-    enum class PredictionMode {NONE, ICLASS, IFORM, DIR, LAST_ICLASS};
+    enum class PredictionMode {NONE, ICLASS, IFORM, DIR, ONLINE};
     
     bool gdb = false;
     bool profile = false;
@@ -16,12 +16,23 @@ namespace dbi {
     bool execution_trace = false;
     bool execution_trace_diff = false;
     bool dump_ss_bkpts = false;
-    PredictionMode prediction_mode;
+    bool superblock = false;
+    size_t code_cache_budget = 0; // bytes; 0 means bounded only by the block pool
+    std::string trans_cache_dir; // persist translated entry points here; empty means don't
+    size_t region_blocks = 0; // blocks to translate per translation stop; 0 means one at a time
+    size_t region_bytes = 0x10000; // code cache bytes to spend per translation stop
+    PredictionMode prediction_mode = PredictionMode::ONLINE;
+    std::string jcc_profile; // online jcc predictor counts, loaded at start and saved at exit
+    unsigned long tier_threshold = 0; // executions before a block is retraced; 0 means never
     bool dump_jcc_info;
     std::ostream *log = &std::clog;
     unsigned verbosity = 0;
+    bool stats = false; // print translation statistics at exit
 
     bool set_prediction_mode(const char *s);
+    bool set_tier_threshold(const char *s); // a decimal count
+    bool set_code_cache_budget(const char *s); // in MiB
+    bool set_region(const char *s); // <blocks>[,<KiB>]
 
     void abort(Tracee& tracee);
 #ifndef NASSERT
@@ -0,0 +1,97 @@
+#include <cassert>
+#include <algorithm>
+#include <cstddef>
+#include <sys/mman.h>
+#include "edge-resolver.hh"
+#include "util.hh"
+
+namespace dbi {
+
+  void EdgeResolver::open(Tracees& tracees, const TranslationTable& table, const TmpMem& tmp_mem) {
+    /* Called by a stub, on the tmp stack.
+     *
+     *        pushf
+     *        push rax
+     *        push rcx
+     *        push rdx
+     *        mov rdx, [rsp + 32]        ; stub return address (its breakpoint)
+     *        mov rax, [rdx + 1]         ; StubData::orig_dst
+     *        imul ecx, eax, hash_mult
+     *        shr ecx, shift
+     *        shl ecx, 4
+     *        lea rdx, [rel table]
+     * .probe cmp rax, [rdx + rcx]
+     *        je .hit
+     *        cmp qword [rdx + rcx], 0
+     *        je .miss
+     *        add ecx, 16
+     *        and ecx, mask
+     *        jmp .probe
+     * .hit   inc qword [rel hits]
+     *        mov rax, [rdx + rcx + 8]
+     *        mov [gs:rel tmp_0], rax
+     *        mov rdx, [rsp + 32]
+     *        mov ecx, edx
+     *        shr ecx, 4
+     *        and ecx, nlinks - 1
+     *        lea rax, [rel slots]
+     *        mov [rax + rcx * 8], rdx   ; queue the stub for linking
+     *        mov byte [rel pending], 1
+     *        jmp .out
+     * .miss  mov rax, [rsp + 32]
+     *        mov [gs:rel tmp_0], rax    ; to the stub's breakpoint
+     * .out   pop rdx
+     *        pop rcx
+     *        pop rax
+     *        popf
+     *        lea rsp, [rsp + 8]
+     *        xchg rsp, [gs:rel tmp_rsp]
+     *        jmp [gs:rel tmp_0]
+     */
+    std::array<uint8_t, 0x95> bytes = {0x9c, 0x50, 0x51, 0x52, 0x48, 0x8b, 0x54, 0x24, 0x20, 0x48, 0x8b, 0x42, 0x01, 0x69, 0xc8, 0x00, 0x00, 0x00, 0x00, 0xc1, 0xe9, 0x00, 0xc1, 0xe1, 0x04, 0x48, 0x8d, 0x15, 0x00, 0x00, 0x00, 0x00, 0x48, 0x3b, 0x04, 0x0a, 0x74, 0x12, 0x48, 0x83, 0x3c, 0x0a, 0x00, 0x74, 0x43, 0x83, 0xc1, 0x10, 0x81, 0xe1, 0x00, 0x00, 0x00, 0x00, 0xeb, 0xe8, 0x48, 0xff, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x44, 0x0a, 0x08, 0x65, 0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x54, 0x24, 0x20, 0x89, 0xd1, 0xc1, 0xe9, 0x04, 0x81, 0xe1, 0x00, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0x89, 0x14, 0xc8, 0xc6, 0x05, 0x00, 0x00, 0x00, 0x00, 0x01, 0xeb, 0x0d, 0x48, 0x8b, 0x44, 0x24, 0x20, 0x65, 0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x59, 0x58, 0x9d, 0x48, 0x8d, 0x64, 0x24, 0x08, 0x65, 0x48, 0x87, 0x25, 0x00, 0x00, 0x00, 0x00, 0x65, 0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+    static_assert(STUB_SIZE_code - STUB_RET == 1 && offsetof(StubData, orig_dst) == 0,
+		  "resolver reads StubData::orig_dst at [ret + 1]");
+    static_assert((nlinks & (nlinks - 1)) == 0, "link queue index is masked");
+
+    mem.open_shared(tracees, PAGESIZE, PROT_READ | PROT_EXEC);
+    link_mem.open_shared(tracees, util::align_up(sizeof(Links), PAGESIZE), PROT_READ | PROT_WRITE);
+    const Links *links = link_mem.begin<Links>();
+    uint8_t *it = entry();
+
+    const auto imm32 = [&] (size_t at, uint32_t imm) {
+      std::copy_n(reinterpret_cast<const uint8_t *>(&imm), sizeof(imm), &bytes[at]);
+    };
+    const auto rel32 = [&] (size_t at, size_t iend, const void *dst) {
+      const ptrdiff_t disp = static_cast<const uint8_t *>(dst) - (it + iend);
+      assert(disp == static_cast<int32_t>(disp));
+      imm32(at, static_cast<int32_t>(disp));
+    };
+    imm32(0x0f, TranslationTable::hash_mult);
+    bytes[0x15] = table.shift();
+    imm32(0x32, table.mask());
+    imm32(0x58, nlinks - 1);
+    rel32(0x19 + 3, 0x20, table.begin());         // lea rdx, [rel table]
+    if (uint64_t *hits = table.edge_hits()) {
+      rel32(0x38 + 3, 0x3f, hits);                // inc qword [rel hits]
+    } else {
+      std::copy(TranslationTable::hits_nop.begin(), TranslationTable::hits_nop.end(), &bytes[0x38]);
+    }
+    rel32(0x44 + 4, 0x4c, tmp_mem.begin());       // mov [gs:rel tmp_0], rax
+    rel32(0x5c + 3, 0x63, links->slots);         // lea rax, [rel slots]
+    rel32(0x67 + 2, 0x6e, &links->pending);      // mov byte [rel pending], 1
+    rel32(0x75 + 4, 0x7d, tmp_mem.begin());       // mov [gs:rel tmp_0], rax
+    rel32(0x86 + 4, 0x8e, tmp_mem.rsp());         // xchg rsp, [gs:rel tmp_rsp]
+    rel32(0x8e + 3, 0x95, tmp_mem.begin());       // jmp [gs:rel tmp_0]
+
+    std::copy(bytes.begin(), bytes.end(), mem.local(it));
+    for (auto& tracee_pair : tracees) {
+      tracee_pair.tracee.update_memcache(mem.local(it), bytes.size(), it);
+    }
+  }
+
+  std::ostream& operator<<(std::ostream& os, const EdgeResolver::Stats& stats) {
+    return os << stats.stubs << " stubs (" << stats.stubs * EdgeResolver::STUB_SIZE
+	      << " bytes), " << stats.links << " edges linked after resolving in-core";
+  }
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+namespace dbi {
+  class EdgeResolver;
+  class Terminator;
+}
+
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <ostream>
+#include "usermem.hh"
+#include "tracees.hh"
+#include "tmp-mem.hh"
+#include "trans-table.hh"
+
+namespace dbi {
+
+  /* In-core resolver for direct branch edges whose target was not translated when the branch
+   * was. Such an edge jumps to a stub of its own (see Terminator::write_resolve_stub), which
+   * calls the shared routine here. The routine looks the original target up in the translation
+   * table; on a hit, it continues at the translation and queues the stub for linking, so the
+   * tracer is only stopped (at the stub's breakpoint) when the target needs translating. The
+   * tracees never write to the code cache: the tracer links queued edges through its own view
+   * of it (see drain()). The routine lives in a mapping of its own, which survives code cache
+   * flushes.
+   */
+  class EdgeResolver {
+  public:
+    EdgeResolver() {}
+    EdgeResolver(Tracees& tracees, const TranslationTable& table, const TmpMem& tmp_mem) {
+      open(tracees, table, tmp_mem);
+    }
+
+    bool good() const { return mem.good(); }
+    operator bool() const { return good(); }
+
+    void open(Tracees& tracees, const TranslationTable& table, const TmpMem& tmp_mem);
+
+    uint8_t *entry() const { return mem.begin<uint8_t>(); }
+    bool contains(const uint8_t *pc) const {
+      return pc >= mem.begin<uint8_t>() && pc < mem.end<uint8_t>();
+    }
+
+    /* Layout of a stub, which must be followed by the edge's data. The resolver finds the data
+     * through the stub's return address, which is the address of its breakpoint.
+     */
+    static constexpr size_t STUB_SIZE_code = 0x0e;
+    static constexpr size_t STUB_RET = 0x0d;
+    static constexpr size_t STUB_BKPT = 0x0d;
+    struct StubData {
+      uint8_t *orig_dst;
+      Terminator *term; // only read by the tracer, which links the edge through it
+    } __attribute__((packed));
+    static constexpr size_t STUB_SIZE = STUB_SIZE_code + sizeof(StubData);
+
+    /* Calls func with the breakpoint address of each stub queued since the last call. The queue
+     * is lossy: a stub whose slot is taken again before it is drained resolves in-core again.
+     */
+    template <typename Func>
+    void drain(Func func) {
+      Links *links = link_mem.local(link_mem.begin<Links>());
+      if (!__atomic_load_n(&links->pending, __ATOMIC_ACQUIRE)) {
+	return;
+      }
+      /* clear first: a stub queued during the scan sets it again */
+      __atomic_store_n(&links->pending, 0, __ATOMIC_SEQ_CST);
+      for (uint8_t *& slot : links->slots) {
+	if (uint8_t *bkpt = __atomic_exchange_n(&slot, nullptr, __ATOMIC_ACQ_REL)) {
+	  ++stats_.links;
+	  func(bkpt);
+	}
+      }
+    }
+
+    /* drop queued stubs, e.g. on a code cache flush; requires all tracees to be stopped */
+    void clear_links() {
+      Links *links = link_mem.local(link_mem.begin<Links>());
+      std::fill(std::begin(links->slots), std::end(links->slots), nullptr);
+      links->pending = 0;
+    }
+
+    /* the code cache space spent on stubs, and how many edges were linked after resolving
+     * in-core; edge hits and misses are counted by the translation table
+     */
+    struct Stats {
+      uint64_t stubs = 0;
+      uint64_t links = 0;
+    };
+    const Stats& stats() const { return stats_; }
+    void count_stub() const { ++stats_.stubs; }
+
+  private:
+    static constexpr size_t nlinks = 0x100;
+    struct Links {
+      uint8_t *slots[nlinks]; // by stub address
+      uint8_t pending;        // set after a slot is written
+    };
+
+    UserMemory mem;
+    UserMemory link_mem; // Links
+    mutable Stats stats_;
+  };
+
+  std::ostream& operator<<(std::ostream& os, const EdgeResolver::Stats& stats);
+
+}
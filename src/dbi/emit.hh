@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include "inst.hh"
+#include "block-pool.hh"
+
+namespace dbi {
+
+  /* Emission buffer for one block. Code is written in place into the tracer's view of space
+   * reserved in the block pool, so building a block allocates nothing; commit() then allocates
+   * what was emitted. The pool segments are shared memfd mappings, so the bytes land in the
+   * tracees' address space as they are written. They are unreachable until a branch is linked to
+   * the block, but the tracees' memcaches only see them once commit() flushes them.
+   */
+  class EmitBuffer {
+  public:
+    EmitBuffer(BlockPool& block_pool, size_t capacity):
+      block_pool(block_pool), begin_(block_pool.peek()), pc_(begin_),
+      local_(block_pool.local(begin_)), capacity(capacity) {}
+
+    uint8_t *begin() const { return begin_; }
+    uint8_t *pc() const { return pc_; }
+    size_t size() const { return pc_ - begin_; }
+
+    /* Statically dispatched on the blob type: Code and Instruction are final, so the data()
+     * and size() calls below are not virtual.
+     */
+    template <typename B>
+    uint8_t *append(const B& blob) {
+      assert(blob.pc() == pc_);
+      return append(blob.data(), blob.size());
+    }
+
+    uint8_t *append(const uint8_t *data, size_t count) {
+      assert(size() + count <= capacity);
+      std::copy_n(data, count, local_ + size());
+      pc_ += count;
+      return pc_;
+    }
+
+    void commit() {
+      block_pool.written(begin_, size());
+      block_pool.alloc(size());
+    }
+
+  private:
+    BlockPool& block_pool;
+    uint8_t *begin_;
+    uint8_t *pc_;
+    uint8_t *local_;
+    size_t capacity;
+  };
+
+  /* Writer handed to transformers. Instructions from the original code are passed to the
+   * block builder through a function pointer and context (no std::function); everything else
+   * (Code, Data, MachineCode) is relocated to the current PC and appended as-is.
+   */
+  class Writer {
+  public:
+    template <typename InstFn>
+    Writer(EmitBuffer& buf, const InstFn& inst_fn):
+      buf(buf), inst_fn(&call_inst_fn<InstFn>), ctx(&inst_fn) {}
+
+    uint8_t *operator()(Instruction& inst) const { return inst_fn(ctx, inst); }
+
+    template <typename B>
+    uint8_t *operator()(B& blob) const {
+      blob.relocate(buf.pc());
+      return buf.append(blob);
+    }
+
+  private:
+    using Fn = uint8_t *(*)(const void *ctx, Instruction& inst);
+    EmitBuffer& buf;
+    Fn inst_fn;
+    const void *ctx;
+
+    template <typename InstFn>
+    static uint8_t *call_inst_fn(const void *ctx, Instruction& inst) {
+      return (*static_cast<const InstFn *>(ctx))(inst);
+    }
+  };
+
+}
@@ -90,13 +90,11 @@ namespace dbi {
     auto get_dst_ptr = [newdst] (uint8_t *dst) {
       return newdst;
     };
-    if (retarget_jmp_relbr8(get_dst_ptr) ||
-	retarget_jmp_relbr32(get_dst_ptr) ||
-	retarget_call_relbr32(get_dst_ptr) ||
-	retarget_mem(get_dst_ptr)
-	) {
-      decode();
-    }
+    (void)
+      (retarget_jmp_relbr8(get_dst_ptr) ||
+       retarget_jmp_relbr32(get_dst_ptr) ||
+       retarget_call_relbr32(get_dst_ptr) ||
+       retarget_mem(get_dst_ptr));
   }
 
   void Instruction::relocate(uint8_t *newpc) {
@@ -137,35 +135,28 @@ namespace dbi {
     const ptrdiff_t relbr = xed_decoded_inst_get_branch_displacement(&xedd());
     uint8_t *new_dst = get_dst_ptr(baseaddr + relbr);
     *offset = new_dst - baseaddr;
-    data(newdata);
+
+    /* the layout of the rel32 form is known, so there is no need to decode it here */
+    std::copy_n(newdata.begin(), newinstlen, data_.begin());
+    size_ = newinstlen;
+    decoded_ = false;
 
     return true;
   }
 
   template <typename Op>
   void Instruction::patch_relbr(Op get_dst_ptr) {
+    /* JMP/Jcc/CALL rel32 all end in their displacement, so patch it in place and leave
+     * decoding to whoever next inspects the instruction.
+     */
     assert(xed_decoded_inst_get_branch_displacement_width_bits(&xedd()) == 32);
-    xed_encoder_operand_t disp;
-    // disp.type = XED_ENCODER_OPERAND_TYPE_BRDISP;
-    uint8_t *baseaddr = pc() + size();
-    int32_t orig_disp = xed_decoded_inst_get_branch_displacement(&xedd());
-    uint8_t *orig_dst_ptr = baseaddr + orig_disp;
-    uint8_t *new_dst_ptr = get_dst_ptr(orig_dst_ptr);
-    int32_t new_disp = new_dst_ptr - baseaddr;
-    disp.u.brdisp = new_disp;
-    disp.width_bits = 32;
-
-    if (!xed_patch_relbr(&xedd_, data_.data(), disp)) {
-      fprintf(stderr, "failed to patch branch\n");
-      abort();
-    }
-
-#ifndef NASSERT
-    decode(); // TODO: This is unecessary -- only makes following assert() work.
-#endif
-    
-    const int32_t found_disp = xed_decoded_inst_get_branch_displacement(&xedd_);
-    assert(found_disp == new_disp); (void) found_disp;
+    int32_t *disp_ptr = reinterpret_cast<int32_t *>(data_.data() + size() - 4);
+    uint8_t *baseaddr = after_pc();
+    uint8_t *new_dst_ptr = get_dst_ptr(baseaddr + *disp_ptr);
+    const ptrdiff_t new_disp = new_dst_ptr - baseaddr;
+    assert(new_disp == static_cast<int32_t>(new_disp));
+    *disp_ptr = new_disp;
+    decoded_ = false;
   }
 
   template <typename Op>
@@ -225,6 +216,7 @@ namespace dbi {
       fprintf(stderr, "failed to patch memory operand\n");
       abort();
     }
+    decoded_ = false;
     return true;
   }
 
@@ -262,6 +254,7 @@ namespace dbi {
       fprintf(stderr, "failed to patch memory operand\n");
       abort();
     }
+    decoded_ = false;
   
     return true;
   }
@@ -277,88 +270,147 @@ namespace dbi {
     size_ = xed_decoded_inst_get_length(&xedd());
   }
 
+  void Instruction::redecode(void) const {
+    Decoder::decode(data_.data(), size_, xedd_);
+    decoded_ = true;
+  }
+
   size_t Instruction::size(void) const {
     assert(size_ != 0);
     return size_;
   }
 
-  Instruction Instruction::jmp_relbrd(uint8_t *pc, uint8_t *dst) {
-    /* calculate instruction length */
-    constexpr unsigned instlen = 5;
-    const int32_t disp = dst - (pc + instlen);
-    DataN<instlen> opcode;
-    opcode[0] = 0xe9;
-    * (int32_t *) &opcode[1] = disp;
-    return from_data(pc, opcode);
+  Code Instruction::jmp_relbrd(uint8_t *pc, uint8_t *dst) {
+    const std::array<uint8_t, jmp_relbrd_len> data {0xe9};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_JMP, 1, 4);
+    code.retarget(dst);
+    return code;
+  }
+
+  Code Instruction::jcc_relbrd(uint8_t *pc, xed_iclass_enum_t iclass, uint8_t *dst) {
+    uint8_t cc;
+    switch (iclass) {
+    case XED_ICLASS_JO:   cc = 0x0; break;
+    case XED_ICLASS_JNO:  cc = 0x1; break;
+    case XED_ICLASS_JB:   cc = 0x2; break;
+    case XED_ICLASS_JNB:  cc = 0x3; break;
+    case XED_ICLASS_JZ:   cc = 0x4; break;
+    case XED_ICLASS_JNZ:  cc = 0x5; break;
+    case XED_ICLASS_JBE:  cc = 0x6; break;
+    case XED_ICLASS_JNBE: cc = 0x7; break;
+    case XED_ICLASS_JS:   cc = 0x8; break;
+    case XED_ICLASS_JNS:  cc = 0x9; break;
+    case XED_ICLASS_JP:   cc = 0xa; break;
+    case XED_ICLASS_JNP:  cc = 0xb; break;
+    case XED_ICLASS_JL:   cc = 0xc; break;
+    case XED_ICLASS_JNL:  cc = 0xd; break;
+    case XED_ICLASS_JLE:  cc = 0xe; break;
+    case XED_ICLASS_JNLE: cc = 0xf; break;
+    default: abort();
+    }
+    const std::array<uint8_t, jcc_relbrd_len> data {0x0f, static_cast<uint8_t>(0x80 | cc)};
+    Code code(pc, data.data(), data.size(), iclass, 2, 4);
+    code.retarget(dst);
+    return code;
+  }
+
+  xed_iclass_enum_t Instruction::jcc_invert(xed_iclass_enum_t iclass) {
+    switch (iclass) {
+    case XED_ICLASS_JO:   return XED_ICLASS_JNO;
+    case XED_ICLASS_JNO:  return XED_ICLASS_JO;
+    case XED_ICLASS_JB:   return XED_ICLASS_JNB;
+    case XED_ICLASS_JNB:  return XED_ICLASS_JB;
+    case XED_ICLASS_JZ:   return XED_ICLASS_JNZ;
+    case XED_ICLASS_JNZ:  return XED_ICLASS_JZ;
+    case XED_ICLASS_JBE:  return XED_ICLASS_JNBE;
+    case XED_ICLASS_JNBE: return XED_ICLASS_JBE;
+    case XED_ICLASS_JS:   return XED_ICLASS_JNS;
+    case XED_ICLASS_JNS:  return XED_ICLASS_JS;
+    case XED_ICLASS_JP:   return XED_ICLASS_JNP;
+    case XED_ICLASS_JNP:  return XED_ICLASS_JP;
+    case XED_ICLASS_JL:   return XED_ICLASS_JNL;
+    case XED_ICLASS_JNL:  return XED_ICLASS_JL;
+    case XED_ICLASS_JLE:  return XED_ICLASS_JNLE;
+    case XED_ICLASS_JNLE: return XED_ICLASS_JLE;
+    default:              return XED_ICLASS_INVALID; // jrcxz, loop, etc.
+    }
   }
 
-  Instruction Instruction::jmp_mem(uint8_t *pc, uint8_t *mem) {
-    constexpr unsigned instlen = 6;
-    const int32_t disp = mem - (pc + instlen);
-    DataN<instlen> opcode;
-    opcode[0] = 0xff;
-    opcode[1] = 0x25;
-    * (int32_t *) &opcode[2] = disp;
-    return from_data(pc, opcode);
+  Code Instruction::jmp_mem(uint8_t *pc, uint8_t *mem) {
+    const std::array<uint8_t, jmp_mem_len> data {0xff, 0x25};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_JMP, 2, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::push_mem(uint8_t *pc, uint8_t *mem) {
-    constexpr unsigned instlen = 6;
-    const int32_t disp = mem - (pc + instlen);
-    DataN<instlen> opcode;
-    opcode[0] = 0xff;
-    opcode[1] = 0x35;
-    * (int32_t *) &opcode[2] = disp;
-    return from_data(pc, opcode);
+  Code Instruction::push_mem(uint8_t *pc, uint8_t *mem) {
+    const std::array<uint8_t, push_mem_len> data {0xff, 0x35};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_PUSH, 2, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::mov_mem64(uint8_t *pc, reg_t reg, uint8_t *mem) {
-    Data data {0x48, 0x8b, 0x05};
+  Code Instruction::mov_mem64(uint8_t *pc, reg_t reg, uint8_t *mem) {
+    std::array<uint8_t, mov_mem64_len> data {0x48, 0x8b, 0x05};
     data[2] |= static_cast<uint8_t>(reg) << 3;
-    *reinterpret_cast<int32_t *>(&data[3]) = mem - (pc + mov_mem64_len);
-    return from_data(pc, data);
+    Code code(pc, data.data(), data.size(), XED_ICLASS_MOV, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::mov_mem64(uint8_t *pc, uint8_t *mem, reg_t reg) {
-    Data data {0x48, 0x89, 0x05};
+  Code Instruction::mov_mem64(uint8_t *pc, uint8_t *mem, reg_t reg) {
+    std::array<uint8_t, mov_mem64_len> data {0x48, 0x89, 0x05};
     data[2] |= static_cast<uint8_t>(reg) << 3;
-    *reinterpret_cast<int32_t *>(&data[3]) = mem - (pc + mov_mem64_len);
-    return from_data(pc, data);
+    Code code(pc, data.data(), data.size(), XED_ICLASS_MOV, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::cmp_mem64(uint8_t *pc, reg_t reg, uint8_t *mem) {
-    Data data {0x48, 0x3b, 0x05};
+  Code Instruction::cmp_mem64(uint8_t *pc, reg_t reg, uint8_t *mem) {
+    std::array<uint8_t, cmp_mem64_len> data {0x48, 0x3b, 0x05};
     data[2] |= static_cast<uint8_t>(reg) << 3;
-    *reinterpret_cast<int32_t *>(&data[3]) = mem - (pc + cmp_mem64_len);
-    return from_data(pc, data);
+    Code code(pc, data.data(), data.size(), XED_ICLASS_CMP, 3, 4);
+    code.retarget(mem);
+    return code;
+  }
+
+  Code Instruction::xchg_rsp_mem(uint8_t *pc, uint8_t *mem) {
+    const std::array<uint8_t, xchg_rsp_mem_len> data {0x48, 0x87, 0x25};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_XCHG, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::xchg_rsp_mem(uint8_t *pc, uint8_t *mem) {
-    Data data {0x48, 0x87, 0x25};
-    * (int32_t *) &data[3] = mem - (pc + xchg_rsp_mem_len);
-    return from_data(pc, data);
+  Code Instruction::lea(uint8_t *pc, reg_t reg, uint8_t *mem) {
+    std::array<uint8_t, lea_len> data {0x48, 0x8d, 0x05};
+    data[2] |= static_cast<uint8_t>(reg) << 3;
+    Code code(pc, data.data(), data.size(), XED_ICLASS_LEA, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::lea(uint8_t *pc, reg_t reg, uint8_t *mem) {
-    Data data {0x48, 0x8d, 0x05};
+  Code Instruction::lea(uint8_t *pc, xreg_t reg, uint8_t *mem) {
+    std::array<uint8_t, lea_len> data {0x4c, 0x8d, 0x05};
     data[2] |= static_cast<uint8_t>(reg) << 3;
-    *reinterpret_cast<int32_t *>(&data[3]) = mem - (pc + lea_len);
-    return from_data(pc, data);
+    Code code(pc, data.data(), data.size(), XED_ICLASS_LEA, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::add_mem64_imm8(uint8_t *pc, uint8_t *mem, int8_t imm) {
-    Data data {0x48, 0x83, 0x05};
-    *reinterpret_cast<int32_t *>(&data[3]) = mem - (pc + add_mem64_imm8_len);
+  Code Instruction::add_mem64_imm8(uint8_t *pc, uint8_t *mem, int8_t imm) {
+    std::array<uint8_t, add_mem64_imm8_len> data {0x48, 0x83, 0x05};
     data[7] = imm;
-    return from_data(pc, data);
+    Code code(pc, data.data(), data.size(), XED_ICLASS_ADD, 3, 4);
+    code.retarget(mem);
+    return code;
   }
 
-  Instruction Instruction::push_reg(uint8_t *pc, reg_t reg) {
-    return from_bytes(pc, static_cast<uint8_t>(0x50 | static_cast<uint8_t>(reg)));
+  Code Instruction::push_reg(uint8_t *pc, reg_t reg) {
+    return Code::from_bytes(pc, XED_ICLASS_PUSH, 0x50 | static_cast<uint8_t>(reg));
   }
 
-  Instruction Instruction::pop_reg(uint8_t *pc, reg_t reg) {
-    return from_bytes(pc, static_cast<uint8_t>(0x58 | static_cast<uint8_t>(reg)));
+  Code Instruction::pop_reg(uint8_t *pc, reg_t reg) {
+    return Code::from_bytes(pc, XED_ICLASS_POP, 0x58 | static_cast<uint8_t>(reg));
   }
 
   void Blob::relocate(uint8_t *newpc) {
@@ -435,16 +487,95 @@ namespace dbi {
     relocate(newpc);
   }
 
-  Instruction Instruction::mov(uint8_t *pc, reg_t dst, reg_t src) {
+  Code Instruction::mov(uint8_t *pc, reg_t dst, reg_t src) {
     uint8_t modrm = 0xc0;
     modrm |= static_cast<uint8_t>(dst) << 3;
     modrm |= static_cast<uint8_t>(src) << 0;
-    return from_bytes(pc, 0x48, 0x89, modrm);
+    return Code::from_bytes(pc, XED_ICLASS_MOV, 0x48, 0x89, modrm);
+  }
+
+  Code Instruction::je_b(uint8_t *pc, uint8_t *dst) {
+    const std::array<uint8_t, je_b_len> data {0x74};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_JZ, 1, 1);
+    code.retarget(dst);
+    return code;
+  }
+
+  Code Instruction::jmp_b(uint8_t *pc, uint8_t *dst) {
+    const std::array<uint8_t, jmp_b_len> data {0xeb};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_JMP, 1, 1);
+    code.retarget(dst);
+    return code;
   }
 
-  Instruction Instruction::je_b(uint8_t *pc, uint8_t *dst) {
-    int8_t diff = dst - (pc + je_b_len);
-    return from_bytes(pc, 0x74, static_cast<uint8_t>(diff));
+  Code Instruction::jrcxz(uint8_t *pc, uint8_t *dst) {
+    const std::array<uint8_t, jrcxz_len> data {0xe3};
+    Code code(pc, data.data(), data.size(), XED_ICLASS_JRCXZ, 1, 1);
+    code.retarget(dst);
+    return code;
+  }
+
+  Code::Code(uint8_t *pc, const uint8_t *data, size_t size, xed_iclass_enum_t iclass,
+	     int rel_at, unsigned rel_len):
+    Blob(pc), size_(size), rel_at_(rel_at), rel_len_(rel_len), iclass_(iclass)
+  {
+    assert(size <= max_len);
+    assert(rel_len == 0 || (rel_at >= 0 && rel_at + rel_len <= size));
+    std::copy_n(data, size, data_.begin());
+  }
+
+  uint8_t *Code::rel_dst() const {
+    assert(has_rel());
+    const uint8_t *ptr = data_.data() + rel_at_;
+    const ptrdiff_t disp = (rel_len_ == 1 ?
+			    *reinterpret_cast<const int8_t *>(ptr) :
+			    *reinterpret_cast<const int32_t *>(ptr));
+    return after_pc() + disp;
+  }
+
+  void Code::rel(ptrdiff_t disp) {
+    uint8_t *ptr = data_.data() + rel_at_;
+    if (rel_len_ == 1) {
+      assert(disp == static_cast<int8_t>(disp));
+      *reinterpret_cast<int8_t *>(ptr) = disp;
+    } else {
+      assert(disp == static_cast<int32_t>(disp));
+      *reinterpret_cast<int32_t *>(ptr) = disp;
+    }
+  }
+
+  void Code::relocate(uint8_t *newpc) {
+    /* keep the absolute target */
+    if (has_rel()) {
+      rel(rel_dst() - (newpc + size()));
+    }
+    Blob::relocate(newpc);
+  }
+
+  void Code::retarget(uint8_t *newdst) {
+    assert(has_rel());
+    rel(newdst - after_pc());
+  }
+
+  Code& Code::prefix(uint8_t byte) {
+    assert(size_ < max_len);
+    uint8_t *dst = has_rel() ? rel_dst() : nullptr;
+    std::copy_backward(data_.begin(), data_.begin() + size_, data_.begin() + size_ + 1);
+    data_[0] = byte;
+    ++size_;
+    if (has_rel()) {
+      ++rel_at_;
+      retarget(dst);
+    }
+    return *this;
+  }
+
+  std::ostream& Code::print(std::ostream& os) const {
+    os << xed_iclass_enum_t2str(iclass_) << std::hex;
+    for (unsigned i = 0; i < size_; ++i) {
+      os << " " << static_cast<unsigned>(data_[i]);
+    }
+    return os << std::dec;
   }
 
   PCRelDisp::PCRelDisp(uint8_t *pc, uint8_t *iend, uint8_t *dst): Data(pc) {
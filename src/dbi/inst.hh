@@ -4,6 +4,7 @@ namespace dbi {
   class Instruction;
   class Blob;
   class Data;
+  class Code;
 }
 
 #include <cstddef>
@@ -98,8 +99,52 @@ namespace dbi {
     PCRelDisp(uint8_t *pc, uint8_t *iend, uint8_t *dst);
   };
 
+  /* Synthesized instruction. Its length, iclass and the location of its PC-relative
+   * displacement (if any) are fixed by the generator, so it is never run through XED.
+   * The displacement is relative to the end of the instruction, as for both branches and
+   * RIP-relative memory operands.
+   */
+  class Code final: public Blob {
+  public:
+    static constexpr unsigned max_len = 15;
+    using Content = std::array<uint8_t, max_len>;
+
+    Code(): Blob(nullptr) {}
+    Code(uint8_t *pc, const uint8_t *data, size_t size, xed_iclass_enum_t iclass,
+	 int rel_at = -1, unsigned rel_len = 0);
+
+    template <typename... Args>
+    static Code from_bytes(uint8_t *pc, xed_iclass_enum_t iclass, Args... args) {
+      const std::array<uint8_t, sizeof...(Args)> bytes {static_cast<uint8_t>(args)...};
+      return Code(pc, bytes.data(), bytes.size(), iclass);
+    }
+
+    virtual void relocate(uint8_t *newpc) override;
+    virtual void retarget(uint8_t *newdst) override; // only for code with a displacement
+    /* prepends a prefix byte, e.g. a segment override, keeping the displacement's target */
+    Code& prefix(uint8_t byte);
+
+    virtual uint8_t *data() override { return data_.data(); }
+    virtual const uint8_t *data() const override { return data_.data(); }
+    virtual size_t size() const override { return size_; }
+    virtual std::ostream& print(std::ostream& os) const override;
 
-  class Instruction: public Blob {
+    xed_iclass_enum_t xed_iclass() const { return iclass_; }
+    bool has_rel() const { return rel_len_ != 0; }
+    uint8_t *rel_dst() const; // target of the PC-relative displacement
+
+  private:
+    Content data_;
+    uint8_t size_ = 0;
+    int8_t rel_at_ = -1;
+    uint8_t rel_len_ = 0; // 0 (none), 1 (rel8) or 4 (rel32/disp32)
+    xed_iclass_enum_t iclass_ = XED_ICLASS_INVALID;
+
+    void rel(ptrdiff_t disp);
+  };
+
+
+  class Instruction final: public Blob {
   public:
     static constexpr unsigned max_inst_len = 16;
     template <size_t N> using DataN = std::array<uint8_t, N>;
@@ -141,7 +186,10 @@ namespace dbi {
 
     void data(const Data& newdata) { data(newdata.data(), newdata.size()); }
   
-    const xed_decoded_inst_t& xedd() const { return xedd_; }
+    const xed_decoded_inst_t& xedd() const {
+      if (!decoded_) { redecode(); }
+      return xedd_;
+    }
     virtual size_t size() const override;
     xed_iform_enum_t xed_iform() const { return xed_decoded_inst_get_iform_enum(&xedd()); }
     xed_iclass_enum_t xed_iclass() const { return xed_decoded_inst_get_iclass(&xedd()); }
@@ -184,40 +232,54 @@ namespace dbi {
       R14 = 0b110, R15 = 0b111};
   
     /*** INSTRUCTION GENERATORS ***/
+    /* These emit Code rather than Instruction, i.e. they don't decode what they generate. */
     /* generates instruction of XED_JMP_RELBRd iform */
-    static Instruction jmp_relbrd(uint8_t *pc, uint8_t *dst);
+    static Code jmp_relbrd(uint8_t *pc, uint8_t *dst);
     static constexpr size_t jmp_relbrd_len = 5;
-    static Instruction jmp_mem(uint8_t *pc, uint8_t *mem);
+    static Code jmp_mem(uint8_t *pc, uint8_t *mem);
     static constexpr size_t jmp_mem_len = 6;
-    static Instruction push_mem(uint8_t *pc, uint8_t *mem);
+    static Code push_mem(uint8_t *pc, uint8_t *mem);
     static constexpr size_t push_mem_len = 6;
-    static Instruction int3(uint8_t *pc) { return from_bytes(pc, 0xcc); }
+    static Code int3(uint8_t *pc) { return Code::from_bytes(pc, XED_ICLASS_INT3, 0xcc); }
     static constexpr size_t int3_len = 1;
+    /* generates the rel32 form of a conditional jump of the given iclass */
+    static Code jcc_relbrd(uint8_t *pc, xed_iclass_enum_t iclass, uint8_t *dst);
     static constexpr size_t jcc_relbrd_len = 6;
-    static Instruction mov_mem64(uint8_t *pc, reg_t reg, uint8_t *mem);
-    static Instruction mov_mem64(uint8_t *pc, uint8_t *mem, reg_t reg);
+    /* iclass of the jcc with the opposite condition; XED_ICLASS_INVALID if there is none */
+    static xed_iclass_enum_t jcc_invert(xed_iclass_enum_t iclass);
+    static Code mov_mem64(uint8_t *pc, reg_t reg, uint8_t *mem);
+    static Code mov_mem64(uint8_t *pc, uint8_t *mem, reg_t reg);
     static constexpr size_t mov_mem64_len = 7;
-    static Instruction cmp_mem64(uint8_t *pc, reg_t reg, uint8_t *mem);
+    static Code cmp_mem64(uint8_t *pc, reg_t reg, uint8_t *mem);
     static constexpr size_t cmp_mem64_len = 7;
-    static Instruction lea(uint8_t *pc, reg_t reg, uint8_t *mem);
+    static Code lea(uint8_t *pc, reg_t reg, uint8_t *mem);
+    static Code lea(uint8_t *pc, xreg_t reg, uint8_t *mem);
     static constexpr size_t lea_len = 7;
-    static Instruction xchg_rsp_mem(uint8_t *pc, uint8_t *mem);
+    static Code xchg_rsp_mem(uint8_t *pc, uint8_t *mem);
     static constexpr size_t xchg_rsp_mem_len = 7;
+    /* segment override (gs) on accesses to per-thread memory; see ThreadMem */
+    static constexpr uint8_t thread_prefix = 0x65;
+    static constexpr size_t thread_prefix_len = 1;
   
-    static Instruction push_reg(uint8_t *pc, reg_t reg);
+    static Code push_reg(uint8_t *pc, reg_t reg);
     static constexpr size_t push_reg_len = 1;
-    static Instruction pop_reg(uint8_t *pc, reg_t reg);
+    static Code pop_reg(uint8_t *pc, reg_t reg);
     static constexpr size_t pop_reg_len = 1;
-    static Instruction add_mem64_imm8(uint8_t *pc, uint8_t *mem, int8_t imm);
+    static Code add_mem64_imm8(uint8_t *pc, uint8_t *mem, int8_t imm);
     static constexpr size_t add_mem64_imm8_len = 8;
-    static Instruction pushf(uint8_t *pc) { return from_bytes(pc, 0x9c); }
+    static Code pushf(uint8_t *pc) { return Code::from_bytes(pc, XED_ICLASS_PUSHFQ, 0x9c); }
     static constexpr size_t pushf_len = 1;
-    static Instruction popf(uint8_t *pc) { return from_bytes(pc, 0x9d); }
+    static Code popf(uint8_t *pc) { return Code::from_bytes(pc, XED_ICLASS_POPFQ, 0x9d); }
     static constexpr size_t popf_len = 1;
-    static Instruction mov(uint8_t *pc, reg_t dst, reg_t src);
-    static Instruction mov(uint8_t *pc, reg_t dst, xreg_t src);
-    static Instruction je_b(uint8_t *pc, uint8_t *dst);
+    static Code mov(uint8_t *pc, reg_t dst, reg_t src);
+    static Code mov(uint8_t *pc, reg_t dst, xreg_t src);
+    static Code je_b(uint8_t *pc, uint8_t *dst);
     static constexpr size_t je_b_len = 2;
+    static Code jmp_b(uint8_t *pc, uint8_t *dst);
+    static constexpr size_t jmp_b_len = 2;
+    /* jump if rcx is zero; reads and writes no flags */
+    static Code jrcxz(uint8_t *pc, uint8_t *dst);
+    static constexpr size_t jrcxz_len = 2;
 
     static reg_t reg_from_xed_reg(xed_reg_enum_t xed_reg);
   
@@ -230,13 +292,14 @@ namespace dbi {
   private:
     bool good_;
     Data data_;
-    xed_decoded_inst_t xedd_;
-    bool decoded_ = false;
+    mutable xed_decoded_inst_t xedd_;
+    mutable bool decoded_ = false; // xedd_ is stale after in-place displacement patches
     size_t size_ = 0;
 
     uint8_t *is_mem_rip(void) const;
   
     void decode(void);
+    void redecode(void) const;
     bool relocate_jmp_relbr8(ptrdiff_t diff);
     bool relocate_jmp_relbr32(ptrdiff_t diff);
     bool relocate_call_relbr32(ptrdiff_t diff);
@@ -256,7 +319,7 @@ namespace dbi {
   std::ostream& operator<<(std::ostream& os, const Blob& blob);
 
   template <unsigned NBYTES, unsigned NRELBRS>
-  class MachineCode: public Blob {
+  class MachineCode final: public Blob {
   public:
     using Content = std::array<uint8_t, NBYTES>;
     struct Relbr {
@@ -0,0 +1,155 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <unistd.h>
+#include "jcc-predictor.hh"
+
+namespace dbi {
+
+  float JccPredictor::estimate(const Key& key, Edge edge) const {
+    const auto from = [] (const Counts& counts) {
+      return static_cast<float>(counts.taken) / counts.samples;
+    };
+
+    const auto iform_it = by_iform.find(key.iform);
+    if (iform_it != by_iform.end() && iform_it->second[edge].samples >= min_samples) {
+      return from(iform_it->second[edge]);
+    }
+    const auto iclass_it = by_iclass.find(key.iclass);
+    if (iclass_it != by_iclass.end() && iclass_it->second[edge].samples >= min_samples) {
+      return from(iclass_it->second[edge]);
+    }
+    const Counts& dir_counts = by_dir[key.back][edge];
+    if (dir_counts.samples >= min_samples) {
+      return from(dir_counts);
+    }
+    return -1.0f;
+  }
+
+  template <typename F>
+  void JccPredictor::for_each_counts(const Key& key, Edge edge, F f) {
+    f(by_iform[key.iform][edge]);
+    f(by_iclass[key.iclass][edge]);
+    f(by_dir[key.back][edge]);
+  }
+
+  bool JccPredictor::predict(const Key& key, Edge edge) {
+    const float p = estimate(key, edge);
+    if (p >= thresh && ++decisions % explore_period != 0) {
+      ++stats_.eager;
+      stats_.avoided += p;
+      return true;
+    }
+    return false;
+  }
+
+  void JccPredictor::sample(const Key& key, Edge edge) {
+    ++stats_.lazy;
+    for_each_counts(key, edge, [] (Counts& counts) {
+      if (++counts.samples > max_samples) {
+	counts.samples /= 2;
+	counts.taken /= 2;
+      }
+    });
+  }
+
+  void JccPredictor::taken(const Key& key, Edge edge) {
+    ++stats_.taken;
+    for_each_counts(key, edge, [] (Counts& counts) {
+      if (counts.taken < counts.samples) {
+	++counts.taken;
+      }
+    });
+  }
+
+  void JccPredictor::clear() {
+    by_iform.clear();
+    by_iclass.clear();
+    by_dir = {};
+  }
+
+  /* One line per key and edge:
+   *   iform <iform> <jcc|fallthru> <samples> <taken>
+   *   iclass <iclass> <jcc|fallthru> <samples> <taken>
+   *   dir <fwd|back> <jcc|fallthru> <samples> <taken>
+   * XED names are used, so that files survive XED updates.
+   */
+  bool JccPredictor::load(const std::string& path) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+      return errno == ENOENT;
+    }
+
+    std::string line;
+    while (std::getline(ifs, line)) {
+      std::istringstream ss(line);
+      std::string level, name, edge_name;
+      Counts counts;
+      if (!(ss >> level >> name >> edge_name >> counts.samples >> counts.taken) ||
+	  (edge_name != "jcc" && edge_name != "fallthru") || counts.taken > counts.samples) {
+	return false;
+      }
+      const Edge edge = edge_name == "jcc" ? JCC : FALLTHRU;
+
+      if (level == "iform") {
+	const xed_iform_enum_t iform = str2xed_iform_enum_t(name.c_str());
+	if (iform == XED_IFORM_INVALID) { return false; }
+	by_iform[iform][edge] = counts;
+      } else if (level == "iclass") {
+	const xed_iclass_enum_t iclass = str2xed_iclass_enum_t(name.c_str());
+	if (iclass == XED_ICLASS_INVALID) { return false; }
+	by_iclass[iclass][edge] = counts;
+      } else if (level == "dir" && (name == "fwd" || name == "back")) {
+	by_dir[name == "back"][edge] = counts;
+      } else {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  bool JccPredictor::save(const std::string& path) const {
+    const std::string tmp_path = path + ".tmp" + std::to_string(::getpid());
+    {
+      std::ofstream ofs(tmp_path, std::ofstream::trunc);
+      const auto put = [&] (const char *level, const char *name, const EdgeCounts& edge_counts) {
+	static const char *edge_names[] = {"jcc", "fallthru"};
+	for (unsigned edge = JCC; edge <= FALLTHRU; ++edge) {
+	  const Counts& counts = edge_counts[edge];
+	  if (counts.samples > 0) {
+	    ofs << level << " " << name << " " << edge_names[edge] << " " << counts.samples << " "
+		<< counts.taken << "\n";
+	  }
+	}
+      };
+      for (const auto& p : by_iform) {
+	put("iform", xed_iform_enum_t2str(static_cast<xed_iform_enum_t>(p.first)), p.second);
+      }
+      for (const auto& p : by_iclass) {
+	put("iclass", xed_iclass_enum_t2str(static_cast<xed_iclass_enum_t>(p.first)), p.second);
+      }
+      put("dir", "fwd", by_dir[false]);
+      put("dir", "back", by_dir[true]);
+      if (!ofs) {
+	std::cerr << "cannot write jcc profile " << tmp_path << "\n";
+	std::remove(tmp_path.c_str());
+	return false;
+      }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) < 0) {
+      std::perror("rename");
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::ostream& operator<<(std::ostream& os, const JccPredictor::Stats& stats) {
+    return os << "eager edges " << stats.eager << ", lazy edges " << stats.lazy
+	      << ", lazy edges taken " << stats.taken << ", stops avoided ~"
+	      << std::lround(stats.avoided);
+  }
+
+}
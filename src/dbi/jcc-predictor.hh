@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <iostream>
+#include <unordered_map>
+extern "C" {
+#include <xed/xed-interface.h>
+}
+
+namespace dbi {
+
+  /* Online replacement for the offline jcc tables (PredictionMode::ONLINE). For each iform,
+   * iclass and branch direction, it counts how often an edge that was left on a stub was later
+   * taken, whether that stopped the tracee or was resolved in-core. An edge is translated
+   * eagerly when the most specific key with enough samples says it is usually taken. Some eager
+   * decisions are turned lazy anyway, so that the estimates keep adapting. Counts can be saved
+   * and loaded, so that later runs start warm.
+   */
+  class JccPredictor {
+  public:
+    enum Edge {JCC, FALLTHRU};
+    struct Key {
+      xed_iclass_enum_t iclass;
+      xed_iform_enum_t iform;
+      bool back;
+    };
+
+    /* Whether to translate the edge now. An edge that is then left on a stub (it may have been
+     * linked to an existing translation instead) is reported to sample(), and the first time it
+     * is taken to taken().
+     */
+    bool predict(const Key& key, Edge edge);
+    void sample(const Key& key, Edge edge);
+    void taken(const Key& key, Edge edge);
+
+    /* A missing file loads nothing. Returns false if the file cannot be read or is malformed,
+     * in which case some counts may have been loaded.
+     */
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+    void clear(); // forgets all counts
+
+    struct Stats {
+      size_t eager = 0;     // edges translated eagerly
+      size_t lazy = 0;      // edges left on a stub
+      size_t taken = 0;     // lazy edges taken
+      double avoided = 0.0; // expected stops on the eager edges, had they been lazy
+    };
+    const Stats& stats() const { return stats_; }
+
+  private:
+    static constexpr float thresh = 0.8f;
+    static constexpr uint32_t min_samples = 16;
+    static constexpr uint32_t max_samples = 1 << 16; // counts are halved beyond this, to adapt
+    static constexpr unsigned explore_period = 8;     // every nth eager decision is made lazy
+
+    struct Counts {
+      uint32_t samples = 0;
+      uint32_t taken = 0;
+    };
+    using EdgeCounts = std::array<Counts, 2>;
+
+    std::unordered_map<int, EdgeCounts> by_iform;
+    std::unordered_map<int, EdgeCounts> by_iclass;
+    std::array<EdgeCounts, 2> by_dir;
+    unsigned decisions = 0;
+    Stats stats_;
+
+    /* stop probability of the edge, or a negative value if no key has enough samples */
+    float estimate(const Key& key, Edge edge) const;
+    template <typename F>
+    void for_each_counts(const Key& key, Edge edge, F f);
+  };
+
+  std::ostream& operator<<(std::ostream& os, const JccPredictor::Stats& stats);
+
+}
@@ -4,6 +4,9 @@
 #include <fstream>
 #include <elf.h>
 #include <cstring>
+#include <string>
+#include <limits>
+#include <sys/syscall.h>
 #include "patch.hh"
 #include "config.hh"
 #include "status.hh"
@@ -12,37 +15,127 @@ namespace dbi {
 
   void Patcher::open(Tracees&& tmp_tracees, const Transformer& transformer_) {
     tracees = std::move(tmp_tracees);
-    block_pool.open(tracee(), block_pool_size);
-    ptr_pool.open(tracees, ptr_pool_size);
-    rsb.open(tracee(), tmp_size);
-    tmp_mem.open(tracee(), tmp_size);
+    open_syscall_stub();
+    block_pool.open(tracees, block_pool_size, block_pool_segments, [this] { stop_all(); });
+    ptr_pool.open(tracees, ptr_pool_size, [this] { stop_all(); });
+    thread_mem.open(tracee(), thread_mem_size);
+    rsb.open(thread_mem, rsb_size);
+    tmp_mem.open(tracee(), thread_mem, tmp_size);
+    trans_table.open(tracees, trans_table_bits, g_conf.stats || g_conf.verbosity > 0);
+    edge_resolver.open(tracees, trans_table, tmp_mem);
+    romcache.open(tracees);
+    syscall_filter.open(tracees);
     transformer = transformer_;
-  }
-  
-  bool Patcher::patch(uint8_t *start_pc) {
-    const auto lb = [&] (uint8_t *addr) -> uint8_t * {
+
+    /* drop cached code for any range whose mapping may have changed */
+    const auto invalidate = [this] (Tracee&, const SyscallArgs& args) {
+      if (args.rv<unsigned long>() >= -4095UL) { // -errno
+	return;
+      }
+      switch (args.no()) {
+      case Syscall::MUNMAP:
+      case Syscall::MPROTECT:
+	romcache.invalidate(args.arg<0, void *>(), pagealign_up(args.arg<1, size_t>()));
+	break;
+
+      case Syscall::MMAP: // also forgets whether the pages were writable or unmapped before
+	romcache.invalidate(args.rv<void *>(), pagealign_up(args.arg<1, size_t>()));
+	break;
+
+      case Syscall::MREMAP:
+	romcache.invalidate(args.arg<0, void *>(), pagealign_up(args.arg<1, size_t>()));
+	romcache.invalidate(args.rv<void *>(), pagealign_up(args.arg<2, size_t>()));
+	break;
+
+      default: break;
+      }
+    };
+    for (Syscall no : {Syscall::MUNMAP, Syscall::MPROTECT, Syscall::MMAP, Syscall::MREMAP}) {
+      syscall_hook(no, nullptr, invalidate);
+    }
+    if (!g_conf.jcc_profile.empty() && !DirJccTerminator::predictor().load(g_conf.jcc_profile)) {
+      *g_conf.log << "ignoring unreadable jcc profile " << g_conf.jcc_profile << "\n";
+      DirJccTerminator::predictor().clear(); // starts cold, as if it were missing
+    }
+
+    if (g_conf.tier_threshold > 0) {
+      block_counters.open(tracees);
+      hot_handler = [this] (Tracee&, uint8_t *head) { handle_hot(head); };
+    }
+
+    if (!g_conf.trans_cache_dir.empty()) {
+      trans_cache.open(g_conf.trans_cache_dir);
+      syscall_hook(Syscall::MMAP, nullptr, [this] (Tracee& tracee, const SyscallArgs& args) {
+	if (args.rv<unsigned long>() < -4095UL && (args.arg<2, int>() & PROT_EXEC)) {
+	  preload_translations(tracee);
+	}
+      });
+    }
+
+    lb = [this] (uint8_t *addr) -> uint8_t * {
       const auto res = lookup_block_patch(addr, true);
       if (res == nullptr) { return nullptr; }
       return res->pool_addr();
     };
+  }
 
-    const auto pb = [&] (uint8_t *addr) -> uint8_t * {
-      const auto it = block_map.find(addr);
-      if (it == block_map.end()) {
-	return nullptr;
-      } else {
-	return it->second->pool_addr();
+  void Patcher::link_resolved_edges() {
+    edge_resolver.drain([this] (uint8_t *bkpt) {
+      EdgeResolver::StubData data;
+      std::memcpy(&data, block_pool.local(bkpt + 1), sizeof(data));
+      data.term->resolved(bkpt);
+    });
+  }
+
+  void Patcher::open_syscall_stub() {
+    /* the only syscalls injected at the PC; the tracees have not started running yet */
+    syscall_stub.open(tracees, PAGESIZE, PROT_READ | PROT_EXEC);
+    const std::array<uint8_t, 3> syscall = {0x0f, 0x05, 0x90};
+    std::unordered_set<pid_t> written;
+    for (auto& tracee_pair : tracees) {
+      if (!tracee_pair.tracee.good()) { continue; }
+      if (written.insert(tracee_pair.tgid()).second) {
+	tracee_pair.tracee.write(syscall, syscall_stub.base<uint8_t>());
       }
-    };
+      tracee_pair.tracee.set_syscall_stub(syscall_stub.base<uint8_t>());
+    }
+  }
+  
+  uint8_t *Patcher::probe_block(uint8_t *addr) const {
+    const auto it = block_map.find(addr);
+    if (it == block_map.end()) {
+      return nullptr;
+    } else {
+      return it->second->pool_addr();
+    }
+  }
+
+  bool Patcher::patch(uint8_t *start_pc, const TracePath *trace, size_t *trace_blocks) {
+    const ProbeBlock pb = [this] (uint8_t *addr) { return probe_block(addr); };
 
     const RegisterBkpt rb = [&] (uint8_t *addr, const BkptCallback& callback) {
-      const auto res = bkpt_map.emplace(addr, callback);
-      assert(res.second); (void) res;
+      bkpt_table.insert(addr, callback);
     };
 
     const InsertBlock ib = [&] (uint8_t *addr, Block *block) {
+      if (trace) {
+	/* replaces the tier-0 block, which handle_hot() redirects once the trace is complete */
+	block_map[addr] = block;
+	pool_map.emplace(block->pool_addr(), block);
+	return;
+      }
       const auto it = block_map.emplace(addr, block);
       assert(it.second); (void) it;
+      trans_table.insert(addr, block->pool_addr());
+      if (trans_cache) {
+	trans_cache.record(addr);
+      }
+      if (region) {
+	region->push_back(block);
+      }
+      if (!block->inst_locs().empty()) {
+	pool_map.emplace(block->pool_addr(), block);
+      }
     };
 
     const Block::Transformer block_transformer =
@@ -50,21 +143,180 @@ namespace dbi {
 	return transformer(addr, inst, TransformerInfo {writer, rb});
       };
 
-    /* create block */
-    return Block::Create(start_pc, tracees, block_pool, ptr_pool, tmp_mem, lb, pb, rb, rsb, ib,
-			 block_transformer,
-			 [this] (auto& tracee, auto addr) { this->pre_syscall_handler(); },
-			 [this] (auto& tracee, auto addr) { this->post_syscall_handler(); }
-			 );
+    /* Create block. One that fails to decode has already taken code cache space, metadata,
+     * breakpoints and maybe a counter (trace exits, the counted entry, syscalls, breakpoints of
+     * the transformer); they are all given back, so that the space can be reused.
+     */
+    const CodeCacheMark mark = mark_code_cache();
+    const bool res =
+      Block::Create(start_pc, arena, tracees, romcache, block_pool, ptr_pool, tmp_mem, lb, pb,
+		    rb, rsb, trans_table, edge_resolver, ib,
+		    block_transformer, syscall_filter,
+		    [this] (auto& tracee, auto addr) { this->pre_syscall_handler(tracee); },
+		    [this] (auto& tracee, auto addr) { this->post_syscall_handler(tracee); },
+		    Tiering {block_counters ? &block_counters : nullptr, hot_handler, trace,
+			     trace_blocks}
+		    );
+    if (!res) {
+      rewind_code_cache(mark);
+    }
+    return res;
+  }
+
+  Patcher::CodeCacheMark Patcher::mark_code_cache() const {
+    return CodeCacheMark {block_pool.mark(), ptr_pool.mark(), arena.mark(), bkpt_table.mark(),
+			  block_counters ? block_counters.mark() : 0};
+  }
+
+  void Patcher::rewind_code_cache(const CodeCacheMark& mark) {
+    bkpt_table.rewind(mark.bkpts);
+    arena.rewind(mark.arena);
+    block_pool.rewind(mark.block_pool);
+    ptr_pool.rewind(mark.ptr_pool);
+    if (block_counters) {
+      block_counters.rewind(mark.counters);
+    }
+  }
+
+  bool Patcher::patch_region(uint8_t *root) {
+    std::vector<Block *> blocks;
+    region = &blocks;
+    const size_t used = code_cache_used();
+    const bool res = patch(root);
+
+    /* blocks reached through jmps and calls are translated along with their source */
+    std::deque<uint8_t *> queue;
+    std::vector<uint8_t *> dsts;
+    size_t next = 0;
+    while (res) {
+      for (; next < blocks.size(); ++next) {
+	dsts.clear();
+	if (const Terminator *term = blocks[next]->terminator()) {
+	  term->unlinked_edges(dsts);
+	}
+	for (const Terminator *return_site : blocks[next]->return_sites()) {
+	  return_site->unlinked_edges(dsts);
+	}
+	queue.insert(queue.end(), dsts.begin(), dsts.end());
+      }
+      if (queue.empty() || blocks.size() >= g_conf.region_blocks ||
+	  code_cache_used() - used >= g_conf.region_bytes || near_budget()) {
+	break;
+      }
+      uint8_t *addr = queue.front();
+      queue.pop_front();
+      if (probe_block(addr) == nullptr) {
+	patch(addr); // may fail (and is undone), e.g. on data; the edge then resolves lazily
+      }
+    }
+
+    region = nullptr;
+    const ProbeBlock pb = [this] (uint8_t *addr) { return probe_block(addr); };
+    for (Block *block : blocks) {
+      if (Terminator *term = block->terminator()) {
+	term->link(pb);
+      }
+      for (Terminator *return_site : block->return_sites()) {
+	return_site->link(pb);
+      }
+    }
+    return res;
+  }
+
+  void Patcher::handle_hot(uint8_t *head) {
+    const auto it = block_map.find(head);
+    if (it == block_map.end() || it->second->counter() == nullptr) {
+      return; // already a trace; another thread hit the same zero
+    }
+    const Block *block = it->second;
+
+    /* the trace may stop short of the path, e.g. at its size limit */
+    TracePath path;
+    trace_path(head, path);
+    size_t trace_blocks = 0;
+    if (!patch(head, &path, &trace_blocks)) {
+      return;
+    }
+    const Block *trace = block_map.at(head);
+    trans_table.insert(head, trace->pool_addr());
+    block->redirect(block_pool, trace->pool_addr());
+
+    ++tier_stats.traces;
+    tier_stats.blocks += trace_blocks;
+    if (g_conf.verbosity > 0) {
+      *g_conf.log << "trace at " << (void *) head << ": " << trace_blocks << " blocks\n";
+    }
+  }
+
+  void Patcher::trace_path(uint8_t *head, TracePath& path) {
+    /* Greedily follows the hotter successor of each block. Stops at indirect branches, calls
+     * and returns, at successors that are already in the trace (its loop back edge, which is
+     * then linked by the last terminator), and at successors that are not hot.
+     */
+    std::unordered_set<uint8_t *> visited = {head};
+    uint8_t *addr = head;
+    while (path.steps.size() + 1 < Block::trace_max_blocks) {
+      Instruction branch;
+      for (uint8_t *it = addr; ; it += branch.size()) {
+	branch = Instruction(it, romcache);
+	if (!branch) {
+	  return;
+	}
+	if (Block::classify_inst(branch)) {
+	  break;
+	}
+      }
+
+      TracePath::Step step;
+      const xed_iform_enum_t iform = branch.xed_iform();
+      if (iform == XED_IFORM_JMP_RELBRd || iform == XED_IFORM_JMP_RELBRb) {
+	step = {branch.branch_dst(), nullptr};
+      } else if (Instruction::jcc_invert(branch.xed_iclass()) != XED_ICLASS_INVALID &&
+		 branch.branch_dst() != branch.after_pc()) {
+	const int64_t taken = executions(branch.branch_dst());
+	const int64_t fallthru = executions(branch.after_pc());
+	if (std::max(taken, fallthru) < static_cast<int64_t>(g_conf.tier_threshold / 4)) {
+	  return;
+	}
+	step = taken > fallthru ? TracePath::Step {branch.branch_dst(), branch.after_pc()} :
+	  TracePath::Step {branch.after_pc(), branch.branch_dst()};
+      } else {
+	return;
+      }
+
+      if (!visited.insert(step.next).second) {
+	return;
+      }
+      path.steps.emplace(branch.pc(), step);
+      addr = step.next;
+    }
+  }
+
+  int64_t Patcher::executions(uint8_t *addr) const {
+    const auto it = block_map.find(addr);
+    if (it == block_map.end() || it->second->counter() == nullptr) {
+      return 0;
+    }
+    return g_conf.tier_threshold - block_counters.value(it->second->counter());
+  }
+
+  std::ostream& operator<<(std::ostream& os, const Patcher::TierStats& stats) {
+    return os << "traces " << stats.traces << ", blocks in traces " << stats.blocks;
   }
 
   void Patcher::handle_bkpt(Tracee& tracee, uint8_t *bkpt_addr) {
-    const BkptCallback& callback = lookup_bkpt(bkpt_addr);
-    callback(tracee, bkpt_addr);
+    const BkptTable::Handler *handler = lookup_bkpt(bkpt_addr);
+    if (handler == nullptr) {
+      /* e.g. an int3 of the guest's that was copied into the code cache */
+      *g_conf.log << "unknown breakpoint at " << (void *) bkpt_addr << "\n";
+      g_conf.abort(tracee);
+      return;
+    }
+    (*handler)(tracee, bkpt_addr);
   }
 
-  const BkptCallback& Patcher::lookup_bkpt(uint8_t *addr) const {
-    return bkpt_map.at(addr);
+  const BkptTable::Handler *Patcher::lookup_bkpt(uint8_t *addr) const {
+    return bkpt_table.find(addr);
   }
 
   Block *Patcher::lookup_block_patch(uint8_t *addr, bool can_fail) {
@@ -76,7 +328,9 @@ namespace dbi {
       if (it != block_map.end()) {
 	break;
       }
-      if (!patch(addr)) {
+      const bool patched = g_conf.region_blocks > 0 && region == nullptr ?
+	patch_region(addr) : patch(addr);
+      if (!patched) {
 	if (can_fail) {
 	  return nullptr;
 	} else {
@@ -90,17 +344,41 @@ namespace dbi {
   }
 
   constexpr bool USE_BKPT = true;
+  constexpr int trace_options = PTRACE_O_EXITKILL | PTRACE_O_TRACEFORK | PTRACE_O_TRACECLONE;
+
+  /* process of a new tracee, from procfs */
+  static pid_t read_tgid(pid_t tid) {
+    std::ifstream ifs("/proc/" + std::to_string(tid) + "/status");
+    std::string key;
+    while (ifs >> key) {
+      if (key == "Tgid:") {
+	pid_t tgid;
+	if (ifs >> tgid) {
+	  return tgid;
+	}
+	break;
+      }
+      ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    std::cerr << "cannot read tgid of " << tid << "\n";
+    std::abort();
+  }
+
+  /* SIGSTOP one tracee; kill(2) would stop every thread of its process */
+  static int stop_thread(const TraceePair& tracee_pair) {
+    return ::syscall(SYS_tgkill, tracee_pair.tgid(), tracee_pair.tracee.pid(), SIGSTOP);
+  }
 
   void Patcher::start() {
     assert(tracees.size() == 1);
     assert(tracee().stopped());
 
-    /* trace children */
-    // TODO: also track clones, vforks, etc.
-    tracee().setoptions(PTRACE_O_EXITKILL | PTRACE_O_TRACEFORK);
+    /* trace children and threads */
+    // TODO: also track vforks, etc.
+    tracee().setoptions(trace_options);
     
     if (USE_BKPT) {
-      
+
       /* get entry point */
       std::ifstream ifs;
       ifs.open(tracee().filename());
@@ -120,6 +398,14 @@ namespace dbi {
       // TODO: if under ASLR, need to translate into runtime address.
 
       entry_addr = reinterpret_cast<uint8_t *>(entry);
+
+      /* the executable and the interpreter are mapped; translate their cached blocks before
+       * anything runs
+       */
+      if (trans_cache) {
+	preload_translations(tracee());
+      }
+
       tracee().read(&old_entry_byte, 1, entry_addr);
       static const uint8_t bkpt = 0xcc;
       tracee().write(&bkpt, 1, entry_addr);
@@ -130,19 +416,20 @@ namespace dbi {
       assert(tracee().get_pc() == entry_addr + 1);
       tracee().write(&old_entry_byte, 1, entry_addr);
       tracee().set_pc(entry_addr);
+      if (trans_cache) {
+	preload_translations(tracee()); // the interpreter has mapped the initial modules by now
+      }
       start_block();
 
     } else {
 
       start_block();
-      
+
     }
     
   }
 
   void Patcher::start_block(uint8_t *root) {
-    const bool patched = patch(root);
-    assert(patched); (void) patched;
     Block& block = *lookup_block_patch(root, false); // cannot fail
     block.jump_to(tracee());
   }
@@ -152,13 +439,167 @@ namespace dbi {
   }
 
   bool Patcher::is_pool_addr(uint8_t *addr) const {
-    return addr >= block_pool.begin() && addr < block_pool.end();
+    return block_pool.contains(addr);
+  }
+
+  size_t Patcher::code_cache_used() const {
+    return block_pool.used() + ptr_pool.used();
+  }
+
+  size_t Patcher::code_cache_budget() const {
+    /* without a budget, still flush well before the block pool's reservation runs out */
+    const size_t limit = block_pool.capacity() / 2;
+    return g_conf.code_cache_budget > 0 ? std::min(g_conf.code_cache_budget, limit) : limit;
+  }
+
+  bool Patcher::over_budget() const {
+    return code_cache_used() > code_cache_budget();
+  }
+
+  bool Patcher::near_budget() const {
+    const size_t budget = code_cache_budget();
+    return code_cache_used() > budget - budget / budget_headroom_div;
+  }
+
+  void Patcher::preload_translations(const Tracee& tracee) {
+    std::vector<uint8_t *> entries;
+    trans_cache.scan(tracee, entries);
+    for (uint8_t *addr : entries) {
+      if (near_budget()) {
+	break; // leave the rest to be translated on demand
+      }
+      if (block_map.find(addr) == block_map.end()) {
+	lookup_block_patch(addr, true);
+      }
+    }
+  }
+
+  bool Patcher::flush_code_cache() {
+    /* Every tracee must be stopped where it can be resumed at a retranslation of the same
+     * original address: at the start of a block, or of an instruction's translation within one
+     * (see flush_resume_addr).
+     * Guest signal handlers never run (signals are not passed on to the tracees), so no signal
+     * frame can hold a code cache address to be rewritten. A stop that is yet to be handled may
+     * be a breakpoint, whose handler would be flushed.
+     */
+    if (!pending_stops.empty()) {
+      return false;
+    }
+
+    std::unordered_map<uint8_t *, uint8_t *> entries;
+    for (const auto& p : block_map) {
+      entries.emplace(p.second->pool_addr(), p.first);
+    }
+
+    struct Resume {
+      Tracee *tracee;
+      uint8_t *orig_addr;
+      user_regs_struct regs; // for a syscall restarted by hand, otherwise orig_rax < 0
+    };
+    std::vector<Resume> resumes;
+    for (auto& tracee_pair : tracees) {
+      Tracee& tracee = tracee_pair.tracee;
+      if (!tracee.good()) {
+	continue;
+      }
+      uint8_t *pc = tracee.get_pc();
+      if (edge_resolver.contains(pc)) {
+	return false; // would return into the flushed code
+      }
+      if (!is_pool_addr(pc)) {
+	continue;
+      }
+      Resume resume {&tracee, nullptr, {}};
+      resume.regs.orig_rax = -1;
+      const auto it = entries.find(pc);
+      if (it != entries.end()) {
+	resume.orig_addr = it->second;
+      } else if ((resume.orig_addr = flush_resume_addr(tracee, pc, resume.regs)) == nullptr) {
+	return false;
+      }
+      resumes.push_back(resume);
+    }
+
+    /* unlink everything that points into the code cache */
+    block_map.clear();
+    pool_map.clear();
+    bkpt_table.clear();
+    arena.clear();
+    trans_table.clear();
+    edge_resolver.clear_links();
+    rsb.clear(tracees);
+    block_pool.reset();
+    ptr_pool.reset();
+    if (block_counters) {
+      block_counters.reset();
+    }
+
+    for (Resume& resume : resumes) {
+      Block& block = *lookup_block_patch(resume.orig_addr, false); // cannot fail
+      if (static_cast<long>(resume.regs.orig_rax) >= 0) {
+	resume.regs.rip = reinterpret_cast<uintptr_t>(block.pool_addr());
+	resume.tracee->set_regs(resume.regs);
+      } else {
+	block.jump_to(*resume.tracee);
+      }
+    }
+
+    ++flushes;
+    if (g_conf.verbosity > 0) {
+      *g_conf.log << "flushed code cache\n";
+    }
+
+    return true;
+  }
+
+  uint8_t *Patcher::flush_resume_addr(Tracee& tracee, uint8_t *pc, user_regs_struct& regs) const {
+    const Block *block = probe_pool_block(pc);
+    if (block == nullptr) {
+      return nullptr;
+    }
+    const Block::InstLoc *loc = block->inst_loc(pc);
+    if (loc == nullptr) {
+      return nullptr; // in the middle of an instruction's translation, e.g. a hooked syscall
+    }
+
+    /* A tracee blocked in a syscall that is not hooked stops just after it, which is the start
+     * of the next instruction's translation. If the stop interrupted the syscall, the kernel
+     * restarts it on resume by moving the PC back over it, which would land before the
+     * retranslation: restart it by hand at the retranslation of the syscall instead, whose
+     * filter check only clobbers what the syscall does.
+     * (-ERESTARTSYS, -ERESTARTNOINTR, -ERESTARTNOHAND and -ERESTART_RESTARTBLOCK from the
+     * kernel's linux/errno.h, which is not exported)
+     */
+    tracee.get_regs(regs);
+    const long rv = static_cast<long>(regs.rax);
+    const bool restart = static_cast<long>(regs.orig_rax) >= 0 &&
+      (rv == -512 || rv == -513 || rv == -514 || rv == -516);
+    if (!restart) {
+      regs.orig_rax = -1;
+      return loc->orig;
+    }
+    if (loc == block->inst_locs().begin()) {
+      return nullptr;
+    }
+    uint8_t *syscall_addr = std::prev(loc)->orig;
+    const Instruction syscall(syscall_addr, tracee);
+    if (!syscall || syscall.xed_iclass() != XED_ICLASS_SYSCALL) {
+      return nullptr;
+    }
+    regs.rax = rv == -516 ? SYS_restart_syscall : regs.orig_rax;
+    return syscall_addr;
   }
 
   void Patcher::sigaction(int signum, const sigaction_t& handler) {
     sighandlers[signum] = handler;
   }
 
+  void Patcher::syscall_hook(Syscall no, const syscall_hook_t& pre, const syscall_hook_t& post) {
+    const auto idx = static_cast<unsigned long>(no);
+    syscall_hooks[idx].push_back(SyscallHook {pre, post});
+    syscall_filter.set(idx);
+  }
+
   void Patcher::signal(int signum, const sighandler_t& handler) {
     sigaction(signum, [handler] (dbi::Tracee& tracee, int signum, auto&&... args) {
       handler(tracee, signum);
@@ -166,108 +607,171 @@ namespace dbi {
   }
 
   void Patcher::run(void) {
+    run_events();
+
+    if (g_conf.stats || g_conf.verbosity > 0) {
+      *g_conf.log << "indirect branch cache: " << trans_table.stats() << "\n";
+      *g_conf.log << "edge resolver: " << edge_resolver.stats() << "\n";
+      *g_conf.log << "code cache: " << code_cache_used() << " bytes used, " << flushes
+		  << " flushes\n";
+      *g_conf.log << "register cache: " << Tracee::stats() << "\n";
+      if (trans_cache) {
+	*g_conf.log << "translation cache: " << trans_cache.stats() << "\n";
+      }
+      if (g_conf.prediction_mode == Config::PredictionMode::ONLINE) {
+	*g_conf.log << "jcc predictor: " << DirJccTerminator::predictor().stats() << "\n";
+      }
+      if (block_counters) {
+	*g_conf.log << "tiering: " << tier_stats << "\n";
+      }
+    }
+
+    if (trans_cache) {
+      trans_cache.save();
+    }
+    if (!g_conf.jcc_profile.empty()) {
+      DirJccTerminator::predictor().save(g_conf.jcc_profile);
+    }
+  }
+
+  void Patcher::run_events() {
     Status status;
 
-    // assert(tracees.size() == 1);
-    
     while (tracees.size() > 0) {
-      /* INVARIANT: All Tracees are stopped. */
-      assert(std::all_of(tracees.begin(), tracees.end(), [] (const auto& tracee_pair) {
-	return tracee_pair.tracee.stopped();
-      }));
-      
-      /* Resume all tracees */
-      if (g_conf.singlestep) {
-	for_each_tracee_pair([] (auto& tracee_pair) {
-	  if (!tracee_pair.info.suspended()) {
-	    tracee_pair.tracee.singlestep();
-	  }
-	});
-      } else {
-	for_each_tracee_pair([] (auto& tracee_pair) {
-	  if (!tracee_pair.info.suspended()) {
-	    tracee_pair.tracee.cont();
-	  }
-	});
+      /* evict translations if the code cache has outgrown its budget; a flush needs every
+       * tracee stopped, and is only retried once a fair amount of code has been translated
+       * since, rather than stopping everything on each new block
+       */
+      if (over_budget() && code_cache_used() >=
+	  failed_flush_used + code_cache_budget() / flush_retry_div) {
+	stop_all();
+	failed_flush_used = flush_code_cache() ? 0 : code_cache_used();
       }
 
-      /* Wait on all tracees */
-      const auto ntracees = tracees.size();
-      std::vector<Status> statuses(ntracees);
-      {
-	auto status_it = statuses.begin();
-	auto tracee_it = tracees.begin();
-	for (; tracee_it != tracees.end(); ++tracee_it, ++status_it) {
-	  if (!tracee_it->info.suspended()) {
-	    tracee_it->tracee.wait(*status_it);
-	  }
-	}
-      }
-      
-      /* Handle stops for all tracees */
-      /* NOTE: This is tricky, since handle_stop() can append to the tracees list and
-       *       exited tracees must be removed from the tracee list.
-       */
-      auto todo = tracees.size();
-      auto tracee_it = tracees.begin();
-      auto status_it = statuses.begin();
-      while (todo > 0) {
-	enum class State {NONE, SUSPENDED, KILLED, EXITED} state;
-	if (!tracee_it->tracee.good()) {
-	  state = State::KILLED;
-	} else if (tracee_it->info.suspended()) {
-	  state = State::SUSPENDED;
-	} else {
-	  const bool exited = handle_stop(*tracee_it, *status_it);
-	  if (tracee_it->tracee.good()) {
-	    if (exited) {
-	      state = State::EXITED;
-	    } else {
-	      state = State::NONE;
-	    }
+      /* Resume stopped tracees */
+      for (auto& tracee_pair : tracees) {
+	Tracee& tracee = tracee_pair.tracee;
+	if (tracee.good() && tracee.stopped() && !tracee_pair.info.suspended() &&
+	    !has_pending_stop(tracee.pid())) {
+	  if (g_conf.singlestep) {
+	    tracee.singlestep();
 	  } else {
-	    state = State::KILLED;
+	    tracee.cont();
 	  }
 	}
+      }
 
-	if (state == State::EXITED || state == State::KILLED) {
-	  const auto pid = tracee_it->tracee.pid();
-	  if (state == State::EXITED) {
-	    *g_conf.log << "[" << pid << "] exit status: "
-			<< status_it->exitstatus() << "\n";
-	  } else {
-#if 0
-	    *g_conf.log << "[" << pid << "] killed\n";
-#endif
-	  }
-	  tracee_it = tracees.erase(tracee_it);
-	  status_it = statuses.erase(status_it); 
-	} else {
-	  ++tracee_it;
-	  ++status_it;
-	}
+      /* Handle the next stop */
+      const pid_t pid = wait_any(status);
+      const auto tracee_it = find_tracee(pid);
+      if (tracee_it == tracees.end()) {
+	/* a forked child can stop before its parent's fork event is seen */
+	early_stops.emplace(pid, status);
+	continue;
+      }
+
+      const auto stray_it = stray_sigstops.find(pid);
+      if (stray_it != stray_sigstops.end() && status.stopped() && status.stopsig() == SIGSTOP) {
+	stray_sigstops.erase(stray_it);
+	continue;
+      }
 
-	--todo;
+      const bool exited = handle_stop(*tracee_it, status);
+      if (exited) {
+	*g_conf.log << "[" << pid << "] exit status: " << status.exitstatus() << "\n";
+	thread_mem.remove_thread(pid);
+	stray_sigstops.erase(pid);
+	tracees.erase(tracee_it);
       }
 
       /* remove killed processes */
       for (auto it = tracees.begin(); it != tracees.end(); ) {
 	if (!it->tracee.good()) {
+	  stray_sigstops.erase(it->tracee.pid());
 	  it = tracees.erase(it);
-#if 0
-	  *g_conf.log << "[" << it->tracee.pid() << "] killed\n";
-#endif
 	} else {
 	  ++it;
 	}
       }
-      
     }
+  }
+
+  void Patcher::stop_all() {
+    for (auto& tracee_pair : tracees) {
+      Tracee& tracee = tracee_pair.tracee;
+      if (!tracee.good() || tracee.stopped()) {
+	continue;
+      }
+
+      if (stop_thread(tracee_pair) < 0) {
+	std::perror("tgkill");
+	std::abort();
+      }
+      Status status;
+      tracee.wait(status);
+
+      /* an exited tracee must not be touched by whatever needed the stop */
+      if (status.exited()) {
+	*g_conf.log << "[" << tracee.pid() << "] exit status: " << status.exitstatus() << "\n";
+	thread_mem.remove_thread(tracee.pid());
+	tracee.close();
+	continue;
+      }
+
+      /* The tracee may have stopped for another reason first. Handle that stop later and
+       * discard the SIGSTOP when it is eventually reported.
+       */
+      if (!status.stopped() || status.stopsig() != SIGSTOP) {
+	pending_stops.emplace_back(tracee.pid(), status);
+	stray_sigstops.insert(tracee.pid());
+      }
+    }
+  }
+
+  pid_t Patcher::wait_any(Status& status) {
+    if (!pending_stops.empty()) {
+      const auto stop = pending_stops.front();
+      pending_stops.pop_front();
+      status = stop.second;
+      return stop.first;
+    }
+
+    const bool running = std::any_of(tracees.begin(), tracees.end(), [] (const auto& tracee_pair) {
+      return tracee_pair.tracee.good() && !tracee_pair.tracee.stopped();
+    });
+    if (!running) {
+      *g_conf.log << "all tracees suspended\n";
+      std::abort();
+    }
+
+    const pid_t pid = ::waitpid(-1, &status.status(), __WALL);
+    if (pid < 0) {
+      std::perror("waitpid");
+      std::abort();
+    }
+
+    const auto tracee_it = find_tracee(pid);
+    if (tracee_it != tracees.end()) {
+      tracee_it->tracee.set_stopped();
+    }
+    return pid;
+  }
 
+  bool Patcher::has_pending_stop(pid_t pid) const {
+    return std::any_of(pending_stops.begin(), pending_stops.end(), [pid] (const auto& stop) {
+      return stop.first == pid;
+    });
+  }
+
+  Tracees::iterator Patcher::find_tracee(pid_t pid) {
+    return std::find_if(tracees.begin(), tracees.end(), [pid] (const TraceePair& tracee_pair) {
+      return tracee_pair.tracee.good() && tracee_pair.tracee.pid() == pid;
+    });
   }
 
   bool Patcher::handle_stop(TraceePair& tracee_pair, Status status) {
     Tracee& tracee = tracee_pair.tracee;
+    link_resolved_edges();
     if (g_conf.execution_trace && !g_conf.singlestep) {
       if (status.stopped()) {
 	print_ss(tracee);
@@ -342,12 +846,30 @@ namespace dbi {
       break;
 
     case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_CLONE:
       {
-	/* get pid of forked process */
+	/* get pid of forked process or new thread */
 	const pid_t newpid = tracee.geteventmsg();
 
-	/* add to tracee list */
-	tracees.emplace_back(Tracee{newpid, tracee.filename(), false}, TraceeInfo{false});
+	/* add to tracee list; its initial stop may already have been reaped */
+	const auto early_it = early_stops.find(newpid);
+	const bool stopped = early_it != early_stops.end();
+	if (stopped) {
+	  early_stops.erase(early_it);
+	}
+
+	/* a clone without CLONE_THREAD starts a new process, like a fork */
+	const pid_t tgid = event == PTRACE_EVENT_CLONE ? read_tgid(newpid) : newpid;
+	const bool thread = tgid != newpid;
+	tracees.emplace_back(Tracee{newpid, tracee.filename(), stopped},
+			     TraceeInfo{false, thread ? tgid : 0});
+	tracees.back().tracee.set_syscall_stub(tracee.syscall_stub()); // copied or shared
+
+	/* a new thread starts with the RSB and scratch memory of its own */
+	if (thread) {
+	  Tracee& new_thread = tracees.back().tracee;
+	  tmp_mem.init(new_thread, thread_mem.add_thread(new_thread, tgid));
+	}
       }
       break;
 
@@ -373,45 +895,59 @@ namespace dbi {
     }
   }
 
-  uint8_t *Patcher::orig_block_addr(uint8_t *addr) const {
-    /* create map from new block addresses to orig block addresses */
-    std::map<uint8_t *, uint8_t *> map;
-    std::transform(block_map.begin(), block_map.end(), std::inserter(map, map.end()),
-		   [] (const auto& p) {
-		     return std::make_pair(p.second->pool_addr(), p.first);
-		   });
-    auto it = map.upper_bound(addr);
-    assert(it != map.begin());
+  const Block& Patcher::lookup_pool_block(uint8_t *addr) const {
+    const Block *block = probe_pool_block(addr);
+    assert(block != nullptr);
+    return *block;
+  }
+
+  const Block *Patcher::probe_pool_block(uint8_t *addr) const {
+    auto it = pool_map.upper_bound(addr);
+    if (it == pool_map.begin()) {
+      return nullptr;
+    }
     --it;
     return it->second;
   }
 
-  void Patcher::pre_syscall_handler() {
-#if 0
-    syscall_args.add_call(tracee());
-#endif
+  uint8_t *Patcher::orig_block_addr(uint8_t *addr) const {
+    return lookup_pool_block(addr).orig_addr();
   }
 
-  void Patcher::post_syscall_handler() {
-#if 0
-    syscall_args.add_ret(tracee());
+  uint8_t *Patcher::orig_inst_addr(uint8_t *addr) const {
+    return lookup_pool_block(addr).orig_inst_addr(addr);
+  }
 
-    switch (syscall_args.no()) {
-    case Syscall::MUNMAP:
-      if (syscall_args.rv<int>() == 0) {
-	cache.invalidate(syscall_args.arg<0, void *>(),
-			 pagealign_up(syscall_args.arg<1, size_t>()));
+  void Patcher::pre_syscall_handler(Tracee& tracee) {
+    SyscallArgs& args = syscall_args[tracee.pid()];
+    args.add_call(tracee);
+
+    /* the in-core filter is inexact (see SyscallFilter), so match the number again here */
+    const auto it = syscall_hooks.find(static_cast<unsigned long>(args.no()));
+    if (it == syscall_hooks.end()) { return; }
+    for (const SyscallHook& hook : it->second) {
+      if (hook.pre) {
+	hook.pre(tracee, args);
+      }
+    }
+  }
+
+  void Patcher::post_syscall_handler(Tracee& tracee) {
+    SyscallArgs& args = syscall_args.at(tracee.pid());
+    args.add_ret(tracee);
+
+    const auto it = syscall_hooks.find(static_cast<unsigned long>(args.no()));
+    if (it == syscall_hooks.end()) { return; }
+    for (const SyscallHook& hook : it->second) {
+      if (hook.post) {
+	hook.post(tracee, args);
       }
-      break;
-    
-    case Syscall::MREMAP: abort();
     }
-#endif
   }
 
   void Patcher::print_ss(Tracee& tracee) const {
     *g_conf.log << "[" << tracee.pid() << "] ss pc = " << static_cast<void *>(tracee.get_pc())
-		<< " " << static_cast<void *>(orig_block_addr(tracee.get_pc())) << ": "
+		<< " " << static_cast<void *>(orig_inst_addr(tracee.get_pc())) << ": "
 		<< Instruction(tracee.get_pc(), tracee)
 #if 0
 		<< " | " << GPRegisters(tracee)
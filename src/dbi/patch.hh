@@ -1,6 +1,9 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <map>
 #include <memory>
 #include <cassert>
 #include <sys/types.h>
@@ -8,11 +11,19 @@
 #include "tracee.hh"
 #include "block.hh"
 #include "block-pool.hh"
+#include "bkpt-table.hh"
 #include "block-term.hh"
 #include "rsb.hh"
+#include "thread-mem.hh"
 #include "tmp-mem.hh"
+#include "trans-table.hh"
+#include "edge-resolver.hh"
+#include "trans-cache.hh"
+#include "block-counters.hh"
 #include "romcache.hh"
+#include "arena.hh"
 #include "syscall-args.hh"
+#include "syscall-filter.hh"
 #include "status.hh"
 #include "types.hh"
 #include "shared-util.hh"
@@ -24,15 +35,15 @@ namespace dbi {
     enum class ExecutionPolicy {SEQUENTIAL, PARALLEL}; // TODO: Use this somewhere
 
     struct TransformerInfo {
-      Writer writer;
-      RegisterBkpt rb;
+      const Writer& writer;
+      const RegisterBkpt& rb;
     };
     using Transformer = std::function<void (uint8_t *, Instruction&, const TransformerInfo&)>;
 
-    Patcher() {}
+    Patcher(): bkpt_table(block_pool) {}
 
     template <typename... Args>
-    Patcher(Args&&... args) { open(std::forward<Args>(args)...); }
+    Patcher(Args&&... args): bkpt_table(block_pool) { open(std::forward<Args>(args)...); }
 
     bool good() const { return !tracees.empty(); }
     operator bool() const { return good(); }
@@ -43,14 +54,25 @@ namespace dbi {
     void signal(int signum, const sighandler_t& handler);
     using sigaction_t = std::function<void (dbi::Tracee&, int, const siginfo_t&)>;
     void sigaction(int signum, const sigaction_t& sigaction);
+
+    /* Runs pre before and post after every syscall with the given number (either may be empty).
+     * Syscalls without a hook run without stopping the tracee.
+     */
+    using syscall_hook_t = std::function<void (dbi::Tracee&, const SyscallArgs&)>;
+    void syscall_hook(Syscall no, const syscall_hook_t& pre, const syscall_hook_t& post);
   
     void start();
     void run();
   
     uint64_t **tmp_rsp() const { return tmp_mem.rsp(); } // TODO: Should these even be allowed?
 
-    /* find the original address of an instruction in a block */
+    /* find the original address of the block containing a code cache address */
     uint8_t *orig_block_addr(uint8_t *addr) const;
+    /* find the original address of the instruction at a code cache address */
+    uint8_t *orig_inst_addr(uint8_t *addr) const;
+
+    /* in-core indirect branch cache statistics */
+    TranslationTable::Stats trans_table_stats() const { return trans_table.stats(); }
 
     const Tracee& tracee() const {
       assert(tracees.size() == 1);
@@ -185,39 +207,125 @@ namespace dbi {
 
   private:
     using BlockMap = std::unordered_map<uint8_t *, Block *>;
-    using BkptMap = std::unordered_map<uint8_t *, BkptCallback>;
+    using PoolMap = std::map<uint8_t *, const Block *>; // pool address -> block
 
-    static constexpr size_t block_pool_size = 0x100000;
-    static constexpr size_t ptr_pool_size = 0x30000;
+    static constexpr size_t block_pool_size = 0x100000; // per segment
+    static constexpr size_t block_pool_segments = 0x200; // address space reserved up front
+    static constexpr size_t ptr_pool_size = 0x30000;    // per segment
     static constexpr size_t rsb_size = 0x1000;
     static constexpr size_t tmp_size = 0x1000;
+    static constexpr size_t thread_mem_size = rsb_size + sizeof(uint32_t) + 0x10 + tmp_size;
+    static constexpr unsigned trans_table_bits = 16;
+    /* Code cache budget hysteresis, in fractions of code_cache_budget(): speculative
+     * translation (regions, preloading) stops this far below the budget, and a flush that failed
+     * is only retried once this much more code has been translated.
+     */
+    static constexpr size_t budget_headroom_div = 8;
+    static constexpr size_t flush_retry_div = 16;
 
     Tracees tracees;
+    UserMemory syscall_stub; // see Tracee::set_syscall_stub()
+    Arena arena; // blocks and terminators; freed all at once on a code cache flush
     BlockMap block_map;
-    BkptMap bkpt_map;
+    PoolMap pool_map;
     BlockPool block_pool;
+    BkptTable bkpt_table;
     PointerPool ptr_pool;
+    ThreadMem thread_mem; // holds the RSB and scratch memory of each guest thread
     ReturnStackBuffer rsb;
     TmpMem tmp_mem;
+    TranslationTable trans_table;
+    EdgeResolver edge_resolver;
+    TransCache trans_cache; // entry points translated in earlier runs (g_conf.trans_cache_dir)
+    BlockCounters block_counters; // executions of tier-0 blocks (g_conf.tier_threshold)
+    ROMCache romcache;
     Transformer transformer;
+    LookupBlock lb; // kept by terminators for lazy linking
     std::unordered_map<int, sigaction_t> sighandlers;
     uint8_t *entry_addr;
     uint8_t old_entry_byte;
 
+    void open_syscall_stub();
+    void link_resolved_edges(); // that the tracees resolved in-core since the last stop
     Block *lookup_block_patch(uint8_t *addr, bool can_fail);
-    const BkptCallback& lookup_bkpt(uint8_t *addr) const;
+    uint8_t *probe_block(uint8_t *addr) const;
+    const Block& lookup_pool_block(uint8_t *addr) const;
+    const Block *probe_pool_block(uint8_t *addr) const; // nullptr if no block precedes addr
+    const BkptTable::Handler *lookup_bkpt(uint8_t *addr) const; // nullptr if unknown
     bool is_pool_addr(uint8_t *addr) const;
 
+    size_t code_cache_used() const;
+    size_t code_cache_budget() const; // g_conf.code_cache_budget, bounded by the block pool
+    bool over_budget() const;
+    bool near_budget() const; // no room left for speculative translation
+    bool flush_code_cache(); // returns false if tracees are not at a safe point
+    uint8_t *flush_resume_addr(Tracee& tracee, uint8_t *pc, user_regs_struct& regs) const;
+    void preload_translations(const Tracee& tracee); // translate cached entry points of new modules
+
+    /* Event loop state. Tracees run independently and each stop is handled as it arrives;
+     * stop_all() brings every running tracee to a stop before the tracer changes anything
+     * they may be executing or mapping, e.g. on a code cache flush.
+     */
+    std::deque<std::pair<pid_t, Status>> pending_stops; // reaped by stop_all(), not yet handled
+    std::unordered_set<pid_t> stray_sigstops; // SIGSTOPs from stop_all() still to be discarded
+    std::unordered_map<pid_t, Status> early_stops; // stops of new tracees not yet added
+    size_t failed_flush_used = 0; // code cache usage at the last failed flush
+    unsigned long flushes = 0;
+
+    void stop_all();
+    pid_t wait_any(Status& status);
+    bool has_pending_stop(pid_t pid) const;
+    Tracees::iterator find_tracee(pid_t pid);
+    void run_events();
+
     void start_block(uint8_t *root);
     void start_block();
 
-    bool patch(uint8_t *root);
+    bool patch(uint8_t *root, const TracePath *trace = nullptr, size_t *trace_blocks = nullptr);
+
+    /* everything a translation allocates or registers, so that a failed one can be undone */
+    struct CodeCacheMark {
+      BlockPool::Mark block_pool;
+      PointerPool::Mark ptr_pool;
+      Arena::Mark arena;
+      BkptTable::Mark bkpts;
+      size_t counters;
+    };
+    CodeCacheMark mark_code_cache() const;
+    void rewind_code_cache(const CodeCacheMark& mark);
+
+    /* Translates root and, breadth-first through direct edges, the region reachable from it,
+     * within g_conf.region_blocks and g_conf.region_bytes; then links the region's edges.
+     */
+    bool patch_region(uint8_t *root);
+    std::vector<Block *> *region = nullptr; // blocks translated by the current region, if any
+
+    /* Tier-up: once a counted block is hot, retranslates it as a trace along the hottest
+     * successors seen so far, and redirects the block to the trace.
+     */
+    BkptCallback hot_handler;
+    void handle_hot(uint8_t *head);
+    void trace_path(uint8_t *head, TracePath& path);
+    int64_t executions(uint8_t *addr) const; // of the tier-0 block at addr; 0 if not counted
+    struct TierStats {
+      size_t traces = 0;
+      size_t blocks = 0; // original blocks laid out in traces
+    };
+    TierStats tier_stats;
+    friend std::ostream& operator<<(std::ostream& os, const TierStats& stats);
+
     void handle_bkpt(Tracee& tracee, uint8_t *bkpt_addr);
     void handle_signal(Tracee& tracee, int signum);
 
-    SyscallArgs syscall_args;
-    void pre_syscall_handler();
-    void post_syscall_handler();
+    struct SyscallHook {
+      syscall_hook_t pre;
+      syscall_hook_t post;
+    };
+    SyscallFilter syscall_filter;
+    std::unordered_map<unsigned long, std::vector<SyscallHook>> syscall_hooks;
+    std::unordered_map<pid_t, SyscallArgs> syscall_args;
+    void pre_syscall_handler(Tracee& tracee);
+    void post_syscall_handler(Tracee& tracee);
 
     bool handle_stop(TraceePair& tracee_pair, Status status); // returns whether exited
     void handle_ptrace_event(TraceePair& tracee_pair, enum __ptrace_eventcodes event);    
@@ -1,41 +1,108 @@
 #pragma once
 
+#include <deque>
+#include <algorithm>
+#include <cassert>
 #include "usermem.hh"
 #include "tracee.hh"
 #include "tracees.hh"
+#include "types.hh"
 
 namespace dbi {
 
+  /* Pool of pointer-sized constants referenced by translated code. Grows by mapping additional
+   * segments (after stopping all tracees); reset() rewinds to the first segment after a code
+   * cache flush.
+   */
   class PointerPool {
   public:
     PointerPool() { mark_bad(); }
-    PointerPool(Tracees& tracees, size_t size) { open(tracees, size); }
+    PointerPool(Tracees& tracees, size_t size, const StopAll& stop_all = StopAll()) {
+      open(tracees, size, stop_all);
+    }
 
     bool good() const { return tracees != nullptr; }
     operator bool() const { return good(); }
 
-    void open(Tracees& tracees_, size_t size) {
+    void open(Tracees& tracees_, size_t size, const StopAll& stop_all_ = StopAll()) {
       tracees = &tracees_;
-      mem.open(tracees->front().tracee, size, PROT_READ);
-      allocator.open(mem.begin<uintptr_t>(), mem.end<uintptr_t>());
+      segment_size = size;
+      stop_all = stop_all_;
+      segments.clear();
+      map_segment();
     }
 
-    uintptr_t *alloc() { return allocator.alloc(1U); }
+    uintptr_t *alloc() {
+      if (allocator.rem() == 0) {
+	if (++cur == segments.size()) {
+	  if (stop_all) { stop_all(); }
+	  map_segment();
+	} else {
+	  allocator.open(segments[cur]);
+	}
+      }
+      return allocator.alloc(1U);
+    }
 
     uintptr_t *add(uintptr_t val) {
       uintptr_t *ptr = alloc();
-      std::for_each(tracees->begin(), tracees->end(), [&] (auto& tracee_pair) {
-	  tracee_pair.tracee.write(&val, sizeof(val), ptr);
-	});
+      set(ptr, val);
       return ptr;
     }
+
+    void set(uintptr_t *ptr, uintptr_t val) {
+      const auto it = std::find_if(segments.begin(), segments.end(),
+				   [ptr] (const UserMemory& segment) {
+				     return ptr >= segment.begin<uintptr_t>() &&
+				       ptr < segment.end<uintptr_t>();
+				   });
+      assert(it != segments.end());
+      *it->local(ptr) = val;
+      for (auto& tracee_pair : *tracees) {
+	tracee_pair.tracee.update_memcache(&val, sizeof(val), ptr);
+      }
+    }
+
+    /* allocation state, for discarding what was allocated since */
+    struct Mark {
+      size_t cur;
+      uintptr_t *peek;
+    };
+
+    Mark mark() const { return Mark {cur, allocator.peek()}; }
+
+    void rewind(const Mark& mark) {
+      cur = mark.cur;
+      allocator.open(mark.peek, segments[cur].end<uintptr_t>());
+    }
+
+    void reset() {
+      cur = 0;
+      allocator.open(segments[cur]);
+    }
+
+    /* space used since the last reset */
+    size_t used() const {
+      return cur * segment_size +
+	(allocator.peek() - segments[cur].begin<uintptr_t>()) * sizeof(uintptr_t);
+    }
   
   private:
     Tracees *tracees;
-    UserMemory mem;
+    size_t segment_size;
+    StopAll stop_all;
+    std::deque<UserMemory> segments; // NOTE: UserMemory is not movable
+    size_t cur;
     UserAllocator<uintptr_t> allocator;
 
     void mark_bad() { tracees = nullptr; }
+
+    void map_segment() {
+      segments.emplace_back();
+      segments.back().open_shared(*tracees, segment_size, PROT_READ);
+      cur = segments.size() - 1;
+      allocator.open(segments.back());
+    }
   };
 
 }
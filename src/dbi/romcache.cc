@@ -1,21 +1,68 @@
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 
 #include "romcache.hh"
 #include "util.hh"
 
 namespace dbi {
 
-#if 0
-  const ROMCache::Page& ROMCache::get_page(const void *pageaddr) {
+  Tracee& ROMCache::tracee() const {
+    // code should be the same in all tracees; read from any live, stopped one
+    const auto tracee_it = std::find_if(tracees->begin(), tracees->end(),
+					[] (const TraceePair& tracee_pair) {
+					  return tracee_pair.tracee.good() &&
+					    tracee_pair.tracee.stopped();
+					});
+    assert(tracee_it != tracees->end());
+    return tracee_it->tracee;
+  }
+
+  bool ROMCache::writable(const void *pageaddr) const {
+    char path[32];
+    sprintf(path, "/proc/%d/maps", tracee().pid());
+    FILE *f;
+    if ((f = fopen(path, "r")) == nullptr) {
+      std::perror("fopen");
+      std::abort();
+    }
+
+    char line[1024];
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(pageaddr);
+    bool res = true; // unmapped: don't cache what may be mapped next
+    while (fgets(line, sizeof(line), f) != nullptr) {
+      uintptr_t begin, end;
+      char perms[5];
+      if (sscanf(line, "%lx-%lx %4s", &begin, &end, perms) != 3) {
+	fprintf(stderr, "ROMCache::writable: bad maps format\n");
+	std::abort();
+      }
+      if (begin <= addr && addr < end) {
+	res = perms[1] == 'w';
+	break;
+      }
+    }
+    fclose(f);
+    return res;
+  }
+
+  const ROMCache::Page *ROMCache::get_page(const void *pageaddr) {
     auto it = page_map.find(pageaddr);
     if (it == page_map.end()) {
+      if (writable_pages.count(pageaddr) != 0) {
+	return nullptr;
+      }
+      if (writable(pageaddr)) {
+	writable_pages.insert(pageaddr);
+	return nullptr;
+      }
       const auto res = page_map.emplace(pageaddr, Page());
       assert(res.second);
       it = res.first;
       Page& newpage = it->second;
-      tracee.read(newpage.begin(), newpage.end(), pageaddr);
+      tracee().read(newpage.begin(), newpage.end(), pageaddr);
     }
-    return it->second;
+    return &it->second;
   }
 
   void ROMCache::read(void *to_, size_t count_, const void *from_) {
@@ -25,9 +72,13 @@ namespace dbi {
   
     while (count > 0) {
       const auto pageaddr = pagealign(from);
-      const auto& page = get_page(pageaddr);
+      const auto *page = get_page(pageaddr);
       const auto cur_count = std::min<size_t>(count, (pageaddr + PAGESIZE) - from);
-      std::copy_n(page.data() + (from - pageaddr), cur_count, to);
+      if (page != nullptr) {
+	std::copy_n(page->data() + (from - pageaddr), cur_count, to);
+      } else {
+	tracee().read(to, cur_count, from);
+      }
       count -= cur_count;
       to += cur_count;
       from += cur_count;
@@ -36,6 +87,5 @@ namespace dbi {
     assert(static_cast<char *>(to_) + count_ == to);
     assert(static_cast<const char *>(from_) + count_ == from);
   }
-#endif
   
 }
@@ -2,36 +2,57 @@
 
 #include <array>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "tracee.hh"
+#include "tracees.hh"
 #include "util.hh" // for PAGESIZE
 
 namespace dbi {
 
-#if 0
+  /* Cache of original code pages, so that block discovery decodes from local memory instead of
+   * reading each instruction from the tracee. Pages stay cached across stops; they must be
+   * invalidated when the tracee unmaps or remaps them (see Patcher::post_syscall_handler).
+   * Pages of writable mappings (e.g. JIT or self-modifying code) are never cached, since the
+   * tracee can change them without a syscall; they are read from the tracee every time.
+   * Whether a page is writable is looked up in /proc/pid/maps once, until it is invalidated.
+   */
   class ROMCache {
   public:
-    ROMCache(Tracee& tracee): tracee(tracee) {}
+    ROMCache(): tracees(nullptr) {}
+    ROMCache(Tracees& tracees) { open(tracees); }
+
+    void open(Tracees& tracees_) { tracees = &tracees_; }
 
     void read(void *to, size_t count, const void *from);
 
-    void invalidate(void *pageaddr) { page_map.erase(pageaddr); }
+    void invalidate(const void *pageaddr) {
+      page_map.erase(pageaddr);
+      writable_pages.erase(pageaddr);
+    }
     void invalidate(void *begin, void *end) {
-      for_each_page(begin, end, [this] (const auto pageaddr) { this->invalidate(pageaddr); });
+      for_each_page(pagealign(begin), pagealign_up(end),
+		    [this] (const auto pageaddr) { this->invalidate(pageaddr); });
     }
     void invalidate(void *begin_, size_t size) {
       const auto begin = static_cast<char *>(begin_);
       invalidate(begin, begin + size);
     }
+    void clear() {
+      page_map.clear();
+      writable_pages.clear();
+    }
 
   private:
     using Page = std::array<char, PAGESIZE>;
     using Map = std::unordered_map<const void *, Page>;
-    Tracee& tracee;
+    Tracees *tracees;
     Map page_map;
+    std::unordered_set<const void *> writable_pages; // not cached
 
-    const Page& get_page(const void *pageaddr);
+    Tracee& tracee() const;
+    const Page *get_page(const void *pageaddr); // nullptr if the page is writable
+    bool writable(const void *pageaddr) const;
   };
-#endif
   
 }
@@ -3,20 +3,24 @@
 
 namespace dbi {
 
-  void ReturnStackBuffer::open(Tracee& tracee, size_t size) {
-    mem.open(tracee, size, PROT_READ | PROT_WRITE);
-      
-    uint8_t *begin_val = mem.end<uint8_t>() - sizeof(uint8_t *) * 3;
-    uint8_t *end_val = mem.begin<uint8_t>();
-    uint8_t **it = reinterpret_cast<uint8_t **>(begin_val);
+  void ReturnStackBuffer::open(ThreadMem& thread_mem, size_t size) {
+    capacity_ = size / sizeof(Entry);
+    assert(capacity_ > 0 && (capacity_ & (capacity_ - 1)) == 0);
 
-    /* set pointer addresses */
-    begin_ = it++;
-    ptr_   = it++;
-    end_   = it++;
-    
-    uint8_t *vals[3] = {begin_val, begin_val, end_val};
-    tracee.write(&vals, sizeof(vals), begin_);
+    /* entries followed by the top-of-stack offset; fresh thread memory is zeroed */
+    begin_ = thread_mem.alloc<Entry>(size + sizeof(uint32_t));
   }
   
+  void ReturnStackBuffer::clear(Tracees& tracees) {
+    for (auto& tracee_pair : tracees) {
+      Tracee& tracee = tracee_pair.tracee;
+      if (tracee.good()) {
+	/* each thread's copy is at its gs base */
+	const uintptr_t gs_base = tracee.get_gpregs().gs_base;
+	tracee.fill(0, reinterpret_cast<char *>(begin()) + gs_base,
+		    reinterpret_cast<char *>(idx() + 1) + gs_base);
+      }
+    }
+  }
+
 }
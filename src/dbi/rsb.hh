@@ -4,31 +4,48 @@ namespace dbi {
   class ReturnStackBuffer;
 }
 
-#include "usermem.hh"
+#include "thread-mem.hh"
 #include "tracee.hh"
+#include "tracees.hh"
 
 namespace dbi {
 
+  /* Circular buffer of (original, translated) return address pairs in tracee memory.
+   * Calls push an entry and returns pop one; when full, a push overwrites the oldest entry.
+   * The top of the buffer is tracked as a byte offset so that it can wrap with a mask.
+   * Lives in thread memory, so each guest thread predicts its own returns.
+   */
   class ReturnStackBuffer {
   public:
+    struct Entry {
+      uint8_t *orig;
+      uint8_t *pool;
+    };
+    static_assert(sizeof(Entry) == 16, "in-core RSB code assumes 16-byte entries");
+
     ReturnStackBuffer() {}
-    ReturnStackBuffer(Tracee& tracee, size_t size) { open(tracee, size); }
+    ReturnStackBuffer(ThreadMem& thread_mem, size_t size) { open(thread_mem, size); }
 
-    bool good() const { return mem.good(); }
+    bool good() const { return begin_ != nullptr; }
     operator bool() const { return good(); }
 
-    void open(Tracee& tracee, size_t size);
-    void close() { mem.close(); }
+    void open(ThreadMem& thread_mem, size_t size);
+    void close() { begin_ = nullptr; }
+
+    /* drop all predictions of all threads, e.g. after the code cache is flushed */
+    void clear(Tracees& tracees);
     
-    uint8_t **begin() const { return begin_; }
-    uint8_t **ptr() const { return ptr_; }
-    uint8_t **end() const { return end_; }
+    Entry *begin() const { return begin_; }
+    Entry *end() const { return begin() + capacity_; }
+    uint32_t *idx() const { return reinterpret_cast<uint32_t *>(end()); }
+    size_t capacity() const { return capacity_; }
+
+    /* byte-offset mask used by the in-core push/pop */
+    uint32_t mask() const { return (capacity() - 1) * sizeof(Entry); }
   
   private:
-    UserMemory mem;
-    uint8_t **begin_;
-    uint8_t **ptr_;
-    uint8_t **end_;
+    Entry *begin_ = nullptr;
+    size_t capacity_;
   };
 
 }
@@ -2,7 +2,7 @@
 
 namespace dbi {
 
-  constexpr bool PATCHER_USE_ROMCACHE = false;
-  constexpr bool TRACEE_MEMCACHE      = false;
+  constexpr bool PATCHER_USE_ROMCACHE = true;
+  constexpr bool TRACEE_MEMCACHE      = true;
 
 }
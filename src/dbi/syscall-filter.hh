@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/mman.h>
+#include "usermem.hh"
+#include "tracees.hh"
+
+namespace dbi {
+
+  /* One byte per syscall number in tracee memory, nonzero for numbers with a registered hook.
+   * The in-core check in front of each translated syscall indexes it with the low 16 bits of
+   * rax and only traps into the tracer on a nonzero byte. Larger numbers alias, so the filter can
+   * let extra syscalls trap but never misses one; the tracer dispatches on the exact number.
+   */
+  class SyscallFilter {
+  public:
+    static constexpr size_t nentries = 0x10000;
+
+    SyscallFilter() {}
+    SyscallFilter(Tracees& tracees) { open(tracees); }
+
+    bool good() const { return mem.good(); }
+    operator bool() const { return good(); }
+
+    void open(Tracees& tracees_) {
+      tracees = &tracees_;
+      mem.open_shared(*tracees, nentries, PROT_READ);
+    }
+
+    uint8_t *begin() const { return mem.begin<uint8_t>(); }
+
+    bool test(unsigned long no) const { return *mem.local(begin() + idx(no)) != 0; }
+
+    void set(unsigned long no) {
+      uint8_t *entry = begin() + idx(no);
+      *mem.local(entry) = 1;
+      for (auto& tracee_pair : *tracees) {
+	tracee_pair.tracee.update_memcache(mem.local(entry), 1, entry);
+      }
+    }
+
+  private:
+    UserMemory mem;
+    Tracees *tracees;
+
+    static size_t idx(unsigned long no) { return no % nentries; }
+  };
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <unordered_map>
+#include <sys/mman.h>
+#include "usermem.hh"
+#include "tracee.hh"
+#include "util.hh"
+
+namespace dbi {
+
+  /* Tracee memory private to each guest thread (the RSB and the scratch memory used by in-core
+   * stubs). The primary region is mapped once; every further thread of a process gets a copy of
+   * it, and its gs base is set to the distance from the primary region to its copy. In-core
+   * code reaches its thread's copy through gs-prefixed RIP-relative operands that name the
+   * primary region, so translations are shared by all threads. The primary thread's gs base is
+   * 0, and guests are assumed not to use gs themselves.
+   */
+  class ThreadMem {
+  public:
+    ThreadMem() {}
+    ThreadMem(Tracee& tracee, size_t size) { open(tracee, size); }
+
+    bool good() const { return mem.good(); }
+    operator bool() const { return good(); }
+
+    void open(Tracee& tracee, size_t size) {
+      mem.open(tracee, size, PROT_READ | PROT_WRITE);
+      used_ = 0;
+    }
+
+    /* carve a range out of the primary region */
+    template <typename T>
+    T *alloc(size_t size, size_t align = alignof(T)) {
+      const size_t offset = util::align_up(used_, align);
+      if (offset + size > mem.size()) {
+	std::abort();
+      }
+      used_ = offset + size;
+      return reinterpret_cast<T *>(mem.begin<char>() + offset);
+    }
+
+    size_t size() const { return mem.size(); }
+
+    /* Gives a new thread its own copy of the region, reusing one left behind by an exited
+     * thread of the same process. Returns the thread's gs base, to be added to addresses in
+     * the primary region to get the thread's copy of them.
+     */
+    ptrdiff_t add_thread(Tracee& thread, pid_t tgid) {
+      char *copy;
+      const auto free_it = free_copies.find(tgid);
+      if (free_it != free_copies.end()) {
+	copy = free_it->second;
+	free_copies.erase(free_it);
+	thread.fill(0, size(), copy);
+      } else {
+	/* the new thread stops in the code cache, which its siblings keep running */
+	assert(thread.syscall_stub() != nullptr);
+	UserMemory copy_mem;
+	copy_mem.open(thread, size(), PROT_READ | PROT_WRITE); // fresh anonymous pages are zeroed
+	copy = copy_mem.begin<char>();
+      }
+      threads[thread.pid()] = Copy {tgid, copy};
+
+      const ptrdiff_t delta = copy - mem.begin<char>();
+      user_regs_struct regs;
+      thread.get_gpregs(regs);
+      regs.gs_base = delta;
+      thread.set_gpregs(regs);
+      return delta;
+    }
+
+    /* the thread has exited; keep its copy for the next thread of the same process */
+    void remove_thread(pid_t tid) {
+      const auto it = threads.find(tid);
+      if (it != threads.end()) {
+	free_copies.emplace(it->second.tgid, it->second.base);
+	threads.erase(it);
+      }
+    }
+
+  private:
+    struct Copy {
+      pid_t tgid;
+      char *base;
+    };
+
+    UserMemory mem;
+    size_t used_;
+    std::unordered_map<pid_t, Copy> threads;
+    std::unordered_multimap<pid_t, char *> free_copies;
+  };
+
+}
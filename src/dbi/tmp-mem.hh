@@ -0,0 +1,55 @@
+#pragma once
+
+#include <type_traits>
+#include "thread-mem.hh"
+#include "tracee.hh"
+
+namespace dbi {
+
+  /* Scratch memory for in-core stubs: a slot holding the scratch stack pointer, followed by
+   * scratch variables and the scratch stack. Lives in thread memory, so each guest thread has
+   * its own; see ThreadMem.
+   */
+  class TmpMem {
+  public:
+    TmpMem() {}
+    TmpMem(Tracee& tracee, ThreadMem& thread_mem, size_t size) { open(tracee, thread_mem, size); }
+
+    bool good() const { return rsp_ptr_ != nullptr; }
+    operator bool() const { return good(); }
+
+    void open(Tracee& tracee, ThreadMem& thread_mem, size_t size) {
+      size_ = size;
+      rsp_ptr_ = thread_mem.alloc<uint64_t *>(size, 16);
+      init(tracee, 0);
+    }
+
+    /* point a thread's scratch stack pointer at the end of its copy */
+    void init(Tracee& tracee, ptrdiff_t delta) {
+      uint64_t *rsp_val = reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(end()) + delta);
+      tracee.write_type(rsp_val, reinterpret_cast<uint64_t **>(
+				   reinterpret_cast<char *>(rsp_ptr_) + delta));
+    }
+
+    void close() { rsp_ptr_ = nullptr; }
+
+    size_t size() const { return size_; }
+    uint64_t *begin() const { return reinterpret_cast<uint64_t *>(rsp_ptr_) + base_idx; }
+    uint64_t *end() const {
+      return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(rsp_ptr_) + size_);
+    }
+    uint64_t **rsp() const { return rsp_ptr_; }
+
+    template <typename Idx>
+    uint64_t *operator[](Idx idx) const {
+      static_assert(std::is_integral<Idx>(), "index must be of integral type");
+      return begin() + idx;
+    }
+
+  private:
+    static constexpr size_t base_idx = 1;
+    uint64_t **rsp_ptr_ = nullptr;
+    size_t size_;
+  };
+
+}
@@ -8,6 +8,7 @@
 #include <cstdio>
 #include <fcntl.h>
 #include <cstdlib>
+#include <climits>
 #include <cassert>
 #include <sys/user.h>
 #include <cctype>
@@ -26,7 +27,9 @@ namespace dbi {
     pid_ = pid;
     this->command = command;
     regs_good_ = false;
+    regs_dirty_ = false;
     fpregs_good_ = false;
+    fpregs_dirty_ = false;
     stopped_ = stopped;
     memcache_.clear();
 
@@ -66,10 +69,13 @@ namespace dbi {
       command = other.command;
       stopped_ = other.stopped_;
       regs_good_ = other.regs_good_;
+      regs_dirty_ = other.regs_dirty_;
       regs_ = other.regs_;
       fpregs_good_ = other.fpregs_good_;
+      fpregs_dirty_ = other.fpregs_dirty_;
       fpregs_ = other.fpregs_;
       memcache_ = other.memcache_;
+      syscall_stub_ = other.syscall_stub_;
 
       /* Mark other as closed */
       other.set_bad();
@@ -96,10 +102,13 @@ namespace dbi {
       command = other.command;
       stopped_ = other.stopped_;
       regs_good_ = other.regs_good_;
+      regs_dirty_ = other.regs_dirty_;
       regs_ = other.regs_;
       fpregs_good_ = other.fpregs_good_;
+      fpregs_dirty_ = other.fpregs_dirty_;
       fpregs_ = other.fpregs_;
       memcache_ = other.memcache_;
+      syscall_stub_ = other.syscall_stub_;
       
       /* Duplicate file descriptor */
       if ((fd_ = ::dup(other.fd_)) < 0) {
@@ -129,7 +138,33 @@ namespace dbi {
   void Tracee::read(void *to_, size_t count, const void *from_) {
     assert(good());
     assert(stopped());
-    
+
+    if (!TRACEE_MEMCACHE || count > CACHE_MAX_ACCESS) {
+      flush_memcache();
+      read_direct(to_, count, from_);
+      return;
+    }
+
+    uint8_t *to = static_cast<uint8_t *>(to_);
+    const uint8_t *from = static_cast<const uint8_t *>(from_);
+    const uint8_t *from_end = from + count;
+    while (from != from_end) {
+      const uint8_t *pageaddr = cache_pagealign(from);
+      const uint8_t *chunk_end = std::min(from_end, pageaddr + CACHE_PAGE_SIZE);
+      Page *page = get_page(pageaddr, from - pageaddr, chunk_end - pageaddr);
+      if (page == nullptr) {
+	flush_memcache();
+	read_direct(to, chunk_end - from, from);
+      } else {
+	std::copy(page->data.begin() + (from - pageaddr),
+		  page->data.begin() + (chunk_end - pageaddr), to);
+      }
+      to += chunk_end - from;
+      from = chunk_end;
+    }
+  }
+
+  void Tracee::read_direct(void *to_, size_t count, const void *from_) {
     const struct iovec local_iov {to_, count};
     const struct iovec remote_iov {const_cast<void *>(from_), count};
     const auto bytes_read = ::process_vm_readv(pid(), &local_iov, 1, &remote_iov, 1, 0);
@@ -168,6 +203,7 @@ namespace dbi {
 
   void Tracee::readv(const struct iovec *to_iov, size_t to_count, const struct iovec *from_iov,
 		     size_t from_count, size_t total_bytes) {
+    flush_memcache();
     const auto bytes_read = ::process_vm_readv(pid(), to_iov, to_count, from_iov, from_count, 0);
     if (bytes_read < 0) {
       std::perror("process_vm_readv");
@@ -182,6 +218,8 @@ namespace dbi {
 
   void Tracee::writev(const struct iovec *to_iov, size_t to_count, const struct iovec *from_iov,
 		      size_t from_count, size_t total_bytes) {
+    flush_memcache();
+    memcache_.clear();
     const auto bytes_written = ::process_vm_writev(pid(), from_iov, from_count, to_iov, to_count,
 						   0);
     if (bytes_written < 0) {
@@ -195,10 +233,37 @@ namespace dbi {
     iovec_check(to_iov, to_count, from_iov, from_count, total_bytes);
   }
   
-  void Tracee::write(const void *from, size_t count, void *to) {
+  void Tracee::write(const void *from_, size_t count, void *to_) {
     assert(good());
     assert(stopped());
 
+    if (!TRACEE_MEMCACHE || count > CACHE_MAX_ACCESS) {
+      flush_memcache();
+      write_direct(from_, count, to_);
+      update_memcache(from_, count, to_);
+      return;
+    }
+
+    const uint8_t *from = static_cast<const uint8_t *>(from_);
+    uint8_t *to = static_cast<uint8_t *>(to_);
+    uint8_t *to_end = to + count;
+    while (to != to_end) {
+      uint8_t *pageaddr = const_cast<uint8_t *>(cache_pagealign(to));
+      uint8_t *chunk_end = std::min(to_end, pageaddr + CACHE_PAGE_SIZE);
+      Page *page = get_page(pageaddr, to - pageaddr, chunk_end - pageaddr);
+      if (page == nullptr) {
+	flush_memcache();
+	write_direct(from, chunk_end - to, to);
+      } else {
+	std::copy(from, from + (chunk_end - to), page->data.begin() + (to - pageaddr));
+	page->mark_dirty(to - pageaddr, chunk_end - pageaddr);
+      }
+      from += chunk_end - to;
+      to = chunk_end;
+    }
+  }
+
+  void Tracee::write_direct(const void *from, size_t count, void *to) {
     const auto bytes_written = ::pwrite(fd(), from, count, reinterpret_cast<off_t>(to));
     if (bytes_written < 0) {
       std::perror("pwrite");
@@ -207,11 +272,12 @@ namespace dbi {
       std::fprintf(stderr, "perror: partial write occurred\n");
       std::abort();
     }
-
   }
 
   void Tracee::writev(const struct iovec *iov, int iovcnt, void *to) {
     assert(stopped());
+    flush_memcache();
+    memcache_.clear();
     const auto bytes_expected = std::accumulate(iov, iov + iovcnt, 0,
 						[] (const auto acc, const auto& iov) {
 						  return acc + iov.iov_len;
@@ -237,6 +303,7 @@ namespace dbi {
     assert(stopped());
     if (!regs_good_) {
       ptrace(PTRACE_GETREGS, 0, &regs_);
+      ++stats_.gpregs_reads;
       regs_good_ = true;
     }
   }
@@ -245,6 +312,7 @@ namespace dbi {
     assert(stopped());
     if (!fpregs_good_) {
       ptrace(PTRACE_GETFPREGS, 0, &fpregs_);
+      ++stats_.fpregs_reads;
       fpregs_good_ = true;
     }
   }
@@ -262,6 +330,8 @@ namespace dbi {
   void Tracee::set_gpregs(const user_regs_struct& regs) {
     regs_ = regs;
     regs_good_ = true;
+    regs_dirty_ = true;
+    ++stats_.gpregs_sets;
   }
 
   void *Tracee::get_sp(void) {
@@ -286,22 +356,34 @@ namespace dbi {
 
   void Tracee::flush_caches() {
     assert(stopped());
-    if (regs_good_) {
+    /* registers are only written back once per stop, and only if they were set */
+    if (regs_dirty_) {
       ptrace(PTRACE_SETREGS, 0, &regs_);
+      ++stats_.gpregs_writes;
+      regs_dirty_ = false;
     }
-    if (fpregs_good_) {
+    if (fpregs_dirty_) {
       ptrace(PTRACE_SETFPREGS, 0, &fpregs_);
+      ++stats_.fpregs_writes;
+      fpregs_dirty_ = false;
     }
     flush_memcache();
   }
 
   void Tracee::invalidate_caches() {
+    assert(!regs_dirty_ && !fpregs_dirty_);
     regs_good_ = false;
     fpregs_good_ = false;
     memcache_.clear();
   }
 
   void Tracee::syscall(user_regs_struct& regs) {
+    if (syscall_stub_) {
+      this->syscall(syscall_stub_, regs);
+      return;
+    }
+
+    /* bootstrap only: nothing else may run the code at the PC meanwhile */
     const auto pc = reinterpret_cast<void *>(regs.rip);
     using Code = std::array<uint8_t, 2>;
     const Code syscall = {0x0f, 0x05};
@@ -355,6 +437,9 @@ namespace dbi {
 
   pid_t Tracee::fork(Status& status, Tracee& forked_tracee, void *syscall_ptr) {
     assert(stopped());
+    if (syscall_ptr == nullptr) {
+      syscall_ptr = syscall_stub_;
+    }
     const bool rewrite = syscall_ptr == nullptr;
     const auto saved_regs = get_gpregs();
     auto fork_regs = saved_regs;
@@ -395,6 +480,7 @@ namespace dbi {
 
     if (msg_pid >= 0) {
       forked_tracee = Tracee(msg_pid, filename(), false);
+      forked_tracee.set_syscall_stub(syscall_stub_);
       forked_tracee.fork_cleanup(pc, saved_regs, rewrite, saved_code);
     }
 
@@ -544,6 +630,8 @@ namespace dbi {
   void Tracee::set_fpregs(const user_fpregs_struct& fpregs) {
     fpregs_ = fpregs;
     fpregs_good_ = true;
+    fpregs_dirty_ = true;
+    ++stats_.fpregs_sets;
   }
 
   void Tracee::assert_stopsig(Status status, int expect) {
@@ -575,20 +663,86 @@ namespace dbi {
     return os;
   }
 
+  Tracee::Page *Tracee::get_page(const void *pageaddr, size_t begin, size_t end) {
+    auto it = memcache_.find(pageaddr);
+    const bool fresh = it == memcache_.end();
+    if (fresh) {
+      it = memcache_.emplace(pageaddr, Page()).first;
+    }
+    Page& page = it->second;
+
+    /* read each run of missing lines at once. /proc/pid/mem can read pages the tracee itself
+     * cannot (e.g. PROT_NONE).
+     */
+    uint64_t missing = Page::lines(begin, end) & ~page.valid;
+    while (missing != 0) {
+      const size_t first = __builtin_ctzl(missing);
+      const uint64_t rest = missing >> first;
+      const size_t n = ~rest == 0 ? Page::word_bits : __builtin_ctzl(~rest);
+      const size_t offset = first * CACHE_LINE_SIZE;
+      const size_t size = n * CACHE_LINE_SIZE;
+      const auto bytes_read = ::pread(fd(), page.data.data() + offset, size,
+				      reinterpret_cast<off_t>(pageaddr) + offset);
+      if (bytes_read != static_cast<ssize_t>(size)) {
+	if (fresh) {
+	  memcache_.erase(it);
+	}
+	return nullptr;
+      }
+      const uint64_t run = (n == Page::word_bits ? ~0UL : ((1UL << n) - 1)) << first;
+      page.valid |= run;
+      missing &= ~run;
+    }
+    return &page;
+  }
+
+  void Tracee::update_memcache(const void *from_, size_t count, const void *to_) {
+    if (memcache_.empty()) { return; }
+    const uint8_t *from = static_cast<const uint8_t *>(from_);
+    const uint8_t *to = static_cast<const uint8_t *>(to_);
+    const uint8_t *to_end = to + count;
+    for (auto it = memcache_.lower_bound(cache_pagealign(to));
+	 it != memcache_.end() && it->first < to_end; ++it) {
+      const uint8_t *pageaddr = static_cast<const uint8_t *>(it->first);
+      const uint8_t *begin = std::max(to, pageaddr);
+      const uint8_t *end = std::min(to_end, pageaddr + CACHE_PAGE_SIZE);
+      std::copy(from + (begin - to), from + (end - to),
+		it->second.data.begin() + (begin - pageaddr));
+    }
+  }
+
   void Tracee::flush_memcache() {
     assert(stopped());
-    /* TODO: OPTIM: optimize using pwritev */
-    std::for_each(memcache_.begin(), memcache_.end(), [this] (auto& p) {
+
+    /* coalesce runs of adjacent dirty ranges into a single pwritev each */
+    std::vector<struct iovec> iovs;
+    const uint8_t *run_begin = nullptr;
+    const uint8_t *run_end = nullptr;
+    const auto write_run = [&] () {
+      if (iovs.empty()) { return; }
+      const auto bytes_written = ::pwritev(fd(), iovs.data(), iovs.size(),
+					   reinterpret_cast<off_t>(run_begin));
+      assert(bytes_written == run_end - run_begin); (void) bytes_written;
+      iovs.clear();
+    };
+    
+    for (auto& p : memcache_) {
       Page& page = p.second;
-      if (page.dirty) {
-	const auto pageaddr = p.first;
-	const auto bytes_written =
-	  ::pwrite(this->fd(), page.data.data(), page.data.size(),
-		   reinterpret_cast<off_t>(pageaddr));
-	assert(bytes_written == static_cast<ssize_t>(page.data.size())); (void) bytes_written;
-	page.dirty = false;
+      const uint8_t *pageaddr = static_cast<const uint8_t *>(p.first);
+      for (size_t b = page.find_dirty(0, true); b < CACHE_PAGE_SIZE;
+	   b = page.find_dirty(b, true)) {
+	const size_t e = page.find_dirty(b, false);
+	if (pageaddr + b != run_end || iovs.size() == static_cast<size_t>(IOV_MAX)) {
+	  write_run();
+	  run_begin = pageaddr + b;
+	}
+	iovs.push_back({page.data.data() + b, e - b});
+	run_end = pageaddr + e;
+	b = e;
       }
-    });
+      page.dirty_bits.fill(0);
+    }
+    write_run();
   }
 
   void Tracee::swap(Tracee& other) {
@@ -597,9 +751,21 @@ namespace dbi {
     std::swap(command, other.command);
     std::swap(stopped_, other.stopped_);
     std::swap(regs_good_, other.regs_good_);
+    std::swap(regs_dirty_, other.regs_dirty_);
     std::swap(regs_, other.regs_);
     std::swap(fpregs_good_, other.fpregs_good_);
+    std::swap(fpregs_dirty_, other.fpregs_dirty_);
     std::swap(fpregs_, other.fpregs_);
+    std::swap(syscall_stub_, other.syscall_stub_);
+  }
+
+  Tracee::Stats Tracee::stats_;
+
+  std::ostream& operator<<(std::ostream& os, const Tracee::Stats& stats) {
+    os << "gpregs: " << stats.gpregs_reads << " reads, " << stats.gpregs_writes << " writes for "
+       << stats.gpregs_sets << " sets; fpregs: " << stats.fpregs_reads << " reads, "
+       << stats.fpregs_writes << " writes for " << stats.fpregs_sets << " sets";
+    return os;
   }
 
   void Tracee::kill() {
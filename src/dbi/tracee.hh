@@ -13,6 +13,7 @@ namespace dbi {
 #include <signal.h>
 #include <string>
 #include <map>
+#include <algorithm>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
@@ -155,6 +156,13 @@ namespace dbi {
     }
 
     pid_t fork(Status& status, Tracee& forked_tracee, void *syscall_ptr = nullptr);
+
+    /* A private `syscall; nop` in this tracee's address space. Once set, syscalls and forks
+     * without a syscall_ptr run there instead of being written over the code at the PC, which
+     * may be shared with threads that are still running. Forked tracees inherit it.
+     */
+    void set_syscall_stub(void *stub) { syscall_stub_ = stub; }
+    void *syscall_stub() const { return syscall_stub_; }
     
     void kill();
 
@@ -181,7 +189,7 @@ namespace dbi {
 
     void wait(Status& status) {
       assert(!stopped());
-      if (::waitpid(pid(), &status.status(), 0) < 0) {
+      if (::waitpid(pid(), &status.status(), __WALL) < 0) {
 	std::perror("waitpid");
 	std::abort();
       }
@@ -194,6 +202,12 @@ namespace dbi {
       return status;
     }
 
+    /* record a stop that was reaped elsewhere, e.g. by waitpid(-1) in the patcher */
+    void set_stopped() {
+      assert(!stopped());
+      stopped_ = true;
+    }
+
     void setoptions(int options) {
       ptrace(PTRACE_SETOPTIONS, 0, options);
     }
@@ -202,26 +216,88 @@ namespace dbi {
 
     void flush_caches();
 
+    /* register cache statistics, across all tracees. sets - writes is the number of
+     * PTRACE_SET*REGS calls saved by deferring write-back to resume.
+     */
+    struct Stats {
+      uint64_t gpregs_reads = 0;
+      uint64_t gpregs_sets = 0;
+      uint64_t gpregs_writes = 0;
+      uint64_t fpregs_reads = 0;
+      uint64_t fpregs_sets = 0;
+      uint64_t fpregs_writes = 0;
+    };
+    static const Stats& stats() { return stats_; }
+
+    /* keep cached pages coherent with a write the tracer made through a shared mapping */
+    void update_memcache(const void *from, size_t count, const void *to);
+
   private:
+    static Stats stats_;
     pid_t pid_;
     int fd_;
     const char *command;
     bool stopped_ = false;
     bool regs_good_ = false;
+    bool regs_dirty_ = false; // set since the last stop; written back on resume
     user_regs_struct regs_;
     bool fpregs_good_ = false;
+    bool fpregs_dirty_ = false;
     user_fpregs_struct fpregs_;
+    void *syscall_stub_ = nullptr;
 
     void cache_regs();
     void cache_fpregs();
     void invalidate_caches();
 
-    /* Memory Cache */
+    /* Memory Cache
+     * Write-back cache of tracee pages, valid while the tracee is stopped. Pages are filled in
+     * lines of CACHE_LINE_SIZE bytes as they are accessed. Only the bytes the tracer wrote are
+     * written back, so that bytes other tracees stored to a shared page meanwhile are not
+     * clobbered; adjacent dirty bytes are coalesced into one pwritev at resume. Accesses larger
+     * than CACHE_MAX_ACCESS bypass the cache.
+     */
     static constexpr size_t CACHE_PAGE_SIZE = PAGESIZE;
+    static constexpr size_t CACHE_MAX_ACCESS = CACHE_PAGE_SIZE;
+    static constexpr size_t CACHE_LINE_SIZE = 64;
     struct Page {
       using Data = std::array<uint8_t, CACHE_PAGE_SIZE>;
+      static constexpr size_t word_bits = 64;
+      static_assert(CACHE_PAGE_SIZE / CACHE_LINE_SIZE == word_bits, "one valid bit per line");
       Data data;
-      bool dirty;
+      uint64_t valid = 0; // lines read from the tracee
+      std::array<uint64_t, CACHE_PAGE_SIZE / word_bits> dirty_bits {}; // one bit per byte
+
+      /* mask of the lines that hold [begin, end) */
+      static uint64_t lines(size_t begin, size_t end) {
+	const size_t first = begin / CACHE_LINE_SIZE;
+	const size_t last = (end - 1) / CACHE_LINE_SIZE;
+	return (last - first + 1 == word_bits ? ~0UL : ((1UL << (last - first + 1)) - 1)) << first;
+      }
+
+      bool dirty() const {
+	return std::any_of(dirty_bits.begin(), dirty_bits.end(), [] (uint64_t w) { return w; });
+      }
+      void mark_dirty(size_t begin, size_t end) {
+	while (begin < end) {
+	  const size_t bit = begin % word_bits;
+	  const size_t n = std::min(word_bits - bit, end - begin);
+	  dirty_bits[begin / word_bits] |= (n == word_bits ? ~0UL : ((1UL << n) - 1)) << bit;
+	  begin += n;
+	}
+      }
+      /* first byte at or after pos whose dirty bit is val; CACHE_PAGE_SIZE if there is none */
+      size_t find_dirty(size_t pos, bool val) const {
+	while (pos < CACHE_PAGE_SIZE) {
+	  const size_t i = pos / word_bits;
+	  const uint64_t w = (val ? dirty_bits[i] : ~dirty_bits[i]) & (~0UL << (pos % word_bits));
+	  if (w != 0) {
+	    return i * word_bits + __builtin_ctzl(w);
+	  }
+	  pos = (i + 1) * word_bits;
+	}
+	return CACHE_PAGE_SIZE;
+      }
     };
     using PageMap = std::map<const void *, Page>;
     PageMap memcache_;
@@ -239,6 +315,10 @@ namespace dbi {
     }
 
     void flush_memcache();
+    /* returns nullptr if the page cannot be cached; fills the lines holding [begin, end) */
+    Page *get_page(const void *pageaddr, size_t begin, size_t end);
+    void read_direct(void *to, size_t count, const void *from);
+    void write_direct(const void *from, size_t count, void *to);
   
     size_t string(const char *addr, std::vector<char>& buf);
 
@@ -276,6 +356,8 @@ namespace dbi {
 			   uintptr_t a3 = 0, uintptr_t a4 = 0, uintptr_t a5 = 0);
   };
 
+  std::ostream& operator<<(std::ostream& os, const Tracee::Stats& stats);
+
 }
 
 namespace std {
@@ -8,13 +8,17 @@ namespace dbi {
   
   class TraceeInfo {
   public:
-    TraceeInfo(bool suspended): suspended_(suspended) {}
+    /* tgid is the process of a guest thread; 0 for the main thread of a process */
+    TraceeInfo(bool suspended, pid_t tgid = 0): suspended_(suspended), tgid_(tgid) {}
 
     bool suspended() const { return suspended_; }
     void suspended(bool newval) { suspended_ = newval; }
+
+    pid_t tgid() const { return tgid_; }
     
   private:
     bool suspended_;
+    pid_t tgid_;
   };
   
   struct TraceePair {
@@ -25,6 +29,9 @@ namespace dbi {
       tracee(tracee),
       info(info)
     {}
+
+    /* threads of the same process share an address space */
+    pid_t tgid() const { return info.tgid() ? info.tgid() : tracee.pid(); }
   };
 
   using Tracees = std::list<TraceePair>;
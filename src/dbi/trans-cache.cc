@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <elf.h>
+#include <unistd.h>
+#include "trans-cache.hh"
+
+namespace dbi {
+
+  void TransCache::scan(const Tracee& tracee, std::vector<uint8_t *>& entries) {
+    std::ifstream ifs("/proc/" + std::to_string(tracee.pid()) + "/maps");
+    std::map<uint8_t *, Mapping> new_mappings;
+    std::unordered_map<std::string, uint8_t *> bases; // first mapping of each file at offset 0
+    std::string line;
+    while (std::getline(ifs, line)) {
+      uintptr_t begin, end, offset;
+      char perms[5];
+      int path_idx = -1;
+      if (std::sscanf(line.c_str(), "%lx-%lx %4s %lx %*s %*s %n",
+		      &begin, &end, perms, &offset, &path_idx) < 4 || path_idx < 0) {
+	continue;
+      }
+      const std::string path = line.substr(path_idx);
+      if (path.empty() || path[0] != '/') {
+	continue; // anonymous, [vdso], etc.
+      }
+      if (offset == 0) {
+	bases.emplace(path, reinterpret_cast<uint8_t *>(begin));
+      }
+      if (perms[2] != 'x') {
+	continue;
+      }
+      const auto base_it = bases.find(path);
+      if (base_it == bases.end()) {
+	continue;
+      }
+
+      auto build_id_it = build_ids.find(path);
+      if (build_id_it == build_ids.end()) {
+	build_id_it = build_ids.emplace(path, read_build_id(path)).first;
+      }
+      if (build_id_it->second.empty()) {
+	continue; // no build-id; cannot tell whether a cache file matches
+      }
+      new_mappings.emplace(reinterpret_cast<uint8_t *>(begin),
+			   Mapping {reinterpret_cast<uint8_t *>(end), base_it->second,
+				    &build_id_it->second});
+    }
+
+    for (const auto& p : new_mappings) {
+      uint8_t *begin = p.first;
+      const Mapping& mapping = p.second;
+      const auto old_it = mappings.find(begin);
+      if (old_it != mappings.end() && old_it->second.end == mapping.end &&
+	  old_it->second.base == mapping.base) {
+	continue; // already seen at the last scan
+      }
+
+      load(*mapping.build_id);
+      const Offsets& module_offsets = offsets[*mapping.build_id];
+      const auto first = module_offsets.lower_bound(begin - mapping.base);
+      const auto last = module_offsets.lower_bound(mapping.end - mapping.base);
+      for (auto it = first; it != last; ++it) {
+	entries.push_back(mapping.base + *it);
+      }
+    }
+
+    mappings.swap(new_mappings);
+  }
+
+  void TransCache::record(uint8_t *addr) {
+    auto it = mappings.upper_bound(addr);
+    if (it == mappings.begin()) {
+      return;
+    }
+    --it;
+    const Mapping& mapping = it->second;
+    if (addr >= mapping.end) {
+      return;
+    }
+    if (offsets[*mapping.build_id].insert(addr - mapping.base).second) {
+      ++stats_.recorded;
+    }
+  }
+
+  void TransCache::load(const std::string& build_id) {
+    if (!loaded.insert(build_id).second) {
+      return;
+    }
+    ++stats_.modules;
+
+    std::ifstream ifs(path(build_id));
+    Offsets& module_offsets = offsets[build_id];
+    uintptr_t offset;
+    while (ifs >> std::hex >> offset) {
+      if (module_offsets.insert(offset).second) {
+	++stats_.loaded;
+      }
+    }
+  }
+
+  void TransCache::save() const {
+    for (const auto& p : offsets) {
+      if (!p.second.empty()) {
+	merge_file(path(p.first), p.second);
+      }
+    }
+  }
+
+  bool TransCache::merge_file(const std::string& path, const Offsets& offsets) {
+    /* merge with entries saved by other runs since this one read the file */
+    Offsets merged = offsets;
+    {
+      std::ifstream ifs(path);
+      uintptr_t offset;
+      while (ifs >> std::hex >> offset) {
+	merged.insert(offset);
+      }
+    }
+
+    /* replace the file atomically, so that readers never see a partial one */
+    const std::string tmp_path = path + ".tmp" + std::to_string(::getpid());
+    {
+      std::ofstream ofs(tmp_path, std::ofstream::trunc);
+      ofs << std::hex;
+      for (const uintptr_t offset : merged) {
+	ofs << offset << "\n";
+      }
+      if (!ofs) {
+	std::cerr << "cannot write translation cache file " << tmp_path << "\n";
+	std::remove(tmp_path.c_str());
+	return false;
+      }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) < 0) {
+      std::perror("rename");
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  std::string TransCache::read_build_id(const std::string& path) {
+    std::ifstream ifs(path);
+    Elf64_Ehdr ehdr;
+    if (!ifs.read(reinterpret_cast<char *>(&ehdr), sizeof(ehdr)) ||
+	std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+      return "";
+    }
+
+    for (unsigned i = 0; i < ehdr.e_phnum; ++i) {
+      Elf64_Phdr phdr;
+      ifs.seekg(ehdr.e_phoff + i * ehdr.e_phentsize);
+      if (!ifs.read(reinterpret_cast<char *>(&phdr), sizeof(phdr))) {
+	return "";
+      }
+      if (phdr.p_type != PT_NOTE) {
+	continue;
+      }
+
+      std::vector<char> notes(phdr.p_filesz);
+      ifs.seekg(phdr.p_offset);
+      if (!ifs.read(notes.data(), notes.size())) {
+	return "";
+      }
+      const auto align4 = [] (size_t n) { return (n + 3) & ~3UL; };
+      for (size_t it = 0; it + sizeof(Elf64_Nhdr) <= notes.size(); ) {
+	Elf64_Nhdr nhdr;
+	std::memcpy(&nhdr, &notes[it], sizeof(nhdr));
+	const size_t name = it + sizeof(nhdr);
+	const size_t desc = name + align4(nhdr.n_namesz);
+	it = desc + align4(nhdr.n_descsz);
+	if (it > notes.size()) {
+	  break;
+	}
+	if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+	    std::memcmp(&notes[name], ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0) {
+	  std::ostringstream ss;
+	  ss << std::hex << std::setfill('0');
+	  for (size_t i = 0; i < nhdr.n_descsz; ++i) {
+	    ss << std::setw(2) << static_cast<unsigned>(static_cast<uint8_t>(notes[desc + i]));
+	  }
+	  return ss.str();
+	}
+      }
+    }
+
+    return "";
+  }
+
+  std::ostream& operator<<(std::ostream& os, const TransCache::Stats& stats) {
+    return os << "modules " << stats.modules << ", cached entries " << stats.loaded
+	      << ", new entries " << stats.recorded;
+  }
+
+}
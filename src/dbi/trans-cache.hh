@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "tracee.hh"
+
+namespace dbi {
+
+  /* Translated block entry points, persisted across runs in one file per module, named by the
+   * module's GNU build-id. Entries are stored as offsets from the module's load base, so they
+   * stay valid for position-independent modules under ASLR. On a warm run, the patcher
+   * translates the cached entry points of each module as soon as it is mapped, instead of
+   * stopping on the first execution of each of them.
+   */
+  class TransCache {
+  public:
+    TransCache() {}
+    TransCache(const std::string& dir) { open(dir); }
+
+    bool good() const { return !dir.empty(); }
+    operator bool() const { return good(); }
+
+    void open(const std::string& dir_) { dir = dir_; }
+
+    /* Rescans the tracee's executable mappings. Appends the cached entry points of modules that
+     * were not mapped at the last scan.
+     */
+    void scan(const Tracee& tracee, std::vector<uint8_t *>& entries);
+
+    /* a block was translated at the original address */
+    void record(uint8_t *addr);
+
+    /* merges the recorded entry points into the cache files */
+    void save() const;
+
+    using Offsets = std::set<uintptr_t>;
+
+    /* GNU build-id of an ELF file as a hex string, or empty if it has none */
+    static std::string read_build_id(const std::string& path);
+
+    /* Adds entry points to a cache file, creating it if needed. Returns false on error. */
+    static bool merge_file(const std::string& path, const Offsets& offsets);
+
+    struct Stats {
+      size_t modules = 0;
+      size_t loaded = 0;   // entry points read from cache files
+      size_t recorded = 0; // entry points translated in this run
+    };
+    const Stats& stats() const { return stats_; }
+
+  private:
+    struct Mapping {
+      uint8_t *end;
+      uint8_t *base; // load base of the module
+      const std::string *build_id;
+    };
+    std::string dir;
+    std::map<uint8_t *, Mapping> mappings; // executable mappings by start address
+    std::unordered_map<std::string, Offsets> offsets; // by build-id
+    std::unordered_map<std::string, std::string> build_ids; // by module path
+    std::unordered_set<std::string> loaded; // build-ids whose cache file has been read
+    Stats stats_;
+
+    std::string path(const std::string& build_id) const { return dir + "/" + build_id; }
+    void load(const std::string& build_id);
+  };
+
+  std::ostream& operator<<(std::ostream& os, const TransCache::Stats& stats);
+
+}
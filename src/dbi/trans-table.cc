@@ -0,0 +1,89 @@
+#include <cassert>
+#include <algorithm>
+#include "trans-table.hh"
+
+namespace dbi {
+
+  void TranslationTable::open(Tracees& tracees_, unsigned bits, bool count_hits) {
+    assert(bits > 0 && bits < 28);
+    tracees = &tracees_;
+    bits_ = bits;
+    shadow.assign(1UL << bits, Entry {nullptr, nullptr});
+    mem.open_shared(*tracees, shadow.size() * sizeof(Entry), PROT_READ);
+    if (count_hits) {
+      counters_mem.open_shared(*tracees, PAGESIZE, PROT_READ | PROT_WRITE);
+    }
+  }
+
+  TranslationTable::Stats TranslationTable::stats() const {
+    Stats stats = stats_;
+    if (!counters_mem) {
+      return stats;
+    }
+    const Counters& counters = *counters_mem.local(counters_mem.begin<Counters>());
+    stats.jmp_hits = counters.jmp_hits;
+    stats.call_hits = counters.call_hits;
+    stats.ret_hits = counters.ret_hits;
+    stats.edge_hits = counters.edge_hits;
+    return stats;
+  }
+
+  bool TranslationTable::insert(uint8_t *orig, uint8_t *pool) {
+    /* keep load factor <= 1/2 so that in-core probes always terminate quickly */
+    if ((count_ + 1) * 2 > capacity()) {
+      return false;
+    }
+
+    size_t idx = hash(orig);
+    while (shadow[idx].orig != nullptr && shadow[idx].orig != orig) {
+      idx = next(idx);
+    }
+
+    Entry& entry = shadow[idx];
+    if (entry.orig == nullptr) {
+      ++count_;
+    }
+    entry.orig = orig;
+    entry.pool = pool;
+
+    /* Running tracees may probe this slot concurrently: publish the translated address before
+     * the original address that makes the entry match.
+     */
+    Entry *local = mem.local(begin() + idx);
+    local->pool = pool;
+    __atomic_store_n(&local->orig, orig, __ATOMIC_RELEASE);
+    for (auto& tracee_pair : *tracees) {
+      tracee_pair.tracee.update_memcache(&entry, sizeof(entry), begin() + idx);
+    }
+
+    return true;
+  }
+
+  void TranslationTable::clear() {
+    std::fill(shadow.begin(), shadow.end(), Entry {nullptr, nullptr});
+    count_ = 0;
+
+    /* only called with all tracees stopped */
+    std::fill(mem.local(begin()), mem.local(end()), Entry {nullptr, nullptr});
+    for (auto& tracee_pair : *tracees) {
+      tracee_pair.tracee.update_memcache(mem.local(begin()), mem.size(), begin());
+    }
+  }
+
+  uint8_t *TranslationTable::find(uint8_t *orig) const {
+    for (size_t idx = hash(orig); shadow[idx].orig != nullptr; idx = next(idx)) {
+      if (shadow[idx].orig == orig) {
+	return shadow[idx].pool;
+      }
+    }
+    return nullptr;
+  }
+
+  std::ostream& operator<<(std::ostream& os, const TranslationTable::Stats& stats) {
+    return os << "jmp hits " << stats.jmp_hits << " misses " << stats.jmp_misses
+	      << ", call hits " << stats.call_hits << " misses " << stats.call_misses
+	      << ", ret hits " << stats.ret_hits << " misses " << stats.ret_misses
+	      << ", edge hits " << stats.edge_hits << " misses " << stats.edge_misses;
+  }
+
+}
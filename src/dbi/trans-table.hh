@@ -0,0 +1,121 @@
+#pragma once
+
+namespace dbi {
+  class TranslationTable;
+}
+
+#include <vector>
+#include <array>
+#include <ostream>
+#include <cstdint>
+#include "usermem.hh"
+#include "tracees.hh"
+
+namespace dbi {
+
+  /* Open-addressing hash table in tracee memory mapping original addresses to translated
+   * addresses. Probed in-core by indirect branch terminators; filled by the patcher whenever
+   * a block is inserted. The table is shared with the tracer, which inserts through its own
+   * view while other tracees may be running, and also keeps a shadow copy for lookups.
+   */
+  class TranslationTable {
+  public:
+    struct Entry {
+      uint8_t *orig;
+      uint8_t *pool;
+    };
+    static_assert(sizeof(Entry) == 16, "in-core probe assumes 16-byte entries");
+
+    /* In-core hit counters; shared between all tracees. Return hits only count RSB
+     * mispredictions that were resolved by the table; edge hits count direct branch edges
+     * resolved by the EdgeResolver before the tracer linked them. Only kept when statistics
+     * are printed: the increments are plain, so they contend for one cache line and lose
+     * counts when threads race, which is fine for statistics but not for the hot path.
+     */
+    struct Counters {
+      uint64_t jmp_hits;
+      uint64_t call_hits;
+      uint64_t ret_hits;
+      uint64_t edge_hits;
+    };
+
+    struct Stats {
+      uint64_t jmp_hits = 0;
+      uint64_t jmp_misses = 0;
+      uint64_t call_hits = 0;
+      uint64_t call_misses = 0;
+      uint64_t ret_hits = 0;
+      uint64_t ret_misses = 0;
+      uint64_t edge_hits = 0;
+      uint64_t edge_misses = 0;
+    };
+
+    static constexpr std::array<uint8_t, 7> hits_nop = {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00};
+
+    /* Fibonacci hash of the low 32 bits of the original address. */
+    static constexpr uint32_t hash_mult = 0x9e3779b1;
+
+    TranslationTable(): tracees(nullptr) {}
+    TranslationTable(Tracees& tracees, unsigned bits, bool count_hits = false) {
+      open(tracees, bits, count_hits);
+    }
+
+    bool good() const { return tracees != nullptr; }
+    operator bool() const { return good(); }
+
+    void open(Tracees& tracees, unsigned bits, bool count_hits = false);
+
+    Entry *begin() const { return mem.begin<Entry>(); }
+    Entry *end() const { return mem.end<Entry>(); }
+    size_t capacity() const { return shadow.size(); }
+    size_t count() const { return count_; }
+
+    /* shift amount and byte-offset mask used by the in-core probe */
+    uint8_t shift() const { return 32 - bits_; }
+    uint32_t mask() const { return (capacity() - 1) * sizeof(Entry); }
+
+    /* returns false if the table is too full to accept the entry */
+    bool insert(uint8_t *orig, uint8_t *pool);
+    uint8_t *find(uint8_t *orig) const;
+
+    /* remove all entries, e.g. after the code cache is flushed */
+    void clear();
+
+    /* in-core hit counters to increment; nullptr if hits are not counted, in which case probes
+     * put hits_nop in place of their `inc qword [rel hits]`, which has the same length
+     */
+    uint64_t *jmp_hits() const { return counter(&Counters::jmp_hits); }
+    uint64_t *call_hits() const { return counter(&Counters::call_hits); }
+    uint64_t *ret_hits() const { return counter(&Counters::ret_hits); }
+    uint64_t *edge_hits() const { return counter(&Counters::edge_hits); }
+
+    void jmp_miss() { ++stats_.jmp_misses; }
+    void call_miss() { ++stats_.call_misses; }
+    void ret_miss() { ++stats_.ret_misses; }
+    void edge_miss() { ++stats_.edge_misses; }
+
+    /* in-core hit counts are read directly from the tracer's view of the counters page */
+    Stats stats() const;
+
+  private:
+    Tracees *tracees;
+    UserMemory mem;
+    UserMemory counters_mem;
+    std::vector<Entry> shadow;
+    unsigned bits_;
+    size_t count_ = 0;
+    Stats stats_; // misses only
+
+    size_t hash(uint8_t *orig) const {
+      return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(orig) * hash_mult) >> shift();
+    }
+    size_t next(size_t idx) const { return (idx + 1) & (capacity() - 1); }
+
+    uint64_t *counter(uint64_t Counters::*memb) const {
+      return counters_mem ? &(counters_mem.begin<Counters>()->*memb) : nullptr;
+    }
+  };
+
+  std::ostream& operator<<(std::ostream& os, const TranslationTable::Stats& stats);
+
+}
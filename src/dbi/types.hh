@@ -1,16 +1,46 @@
 #pragma once
 
 #include <functional>
+#include <cstdint>
 
 namespace dbi {
 
+  class Tracee;
+  class Block;
+
   using BkptCallback = std::function<void(Tracee& tracee, uint8_t *)>;
+
+  /* Breakpoint handler without a closure (function pointer + context). Registered wrapped in a
+   * BkptCallback, it is unwrapped again and dispatched with a single indirect call.
+   */
+  struct BkptHandler {
+    using Fn = void (*)(void *ctx, Tracee& tracee, uint8_t *addr);
+    Fn fn;
+    void *ctx;
+
+    void operator()(Tracee& tracee, uint8_t *addr) const { fn(ctx, tracee, addr); }
+
+    template <typename T, void (T::*Member)(Tracee&)>
+    static BkptHandler member(T *obj) {
+      return BkptHandler {[] (void *ctx, Tracee& tracee, uint8_t *) {
+	(static_cast<T *>(ctx)->*Member)(tracee);
+      }, obj};
+    }
+
+    template <typename T, void (T::*Member)(Tracee&, uint8_t *)>
+    static BkptHandler member(T *obj) {
+      return BkptHandler {[] (void *ctx, Tracee& tracee, uint8_t *addr) {
+	(static_cast<T *>(ctx)->*Member)(tracee, addr);
+      }, obj};
+    }
+  };
+
   using RegisterBkpt = std::function<void(uint8_t *, const BkptCallback&)>;
   using LookupBlock = std::function<uint8_t *(uint8_t *)>;
   using TryLookupBlock = std::function<uint8_t *(uint8_t *)>;
   using ProbeBlock = std::function<uint8_t *(uint8_t *)>; // returns nullptr if block not present
   using UnregisterBkpt = std::function<void(uint8_t *)>;
   using InsertBlock = std::function<void (uint8_t *, Block *)>;
-  using Writer = std::function<uint8_t *(Blob&)>;
+  using StopAll = std::function<void ()>; // brings every running tracee to a stop
   
 }
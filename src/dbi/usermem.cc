@@ -3,19 +3,23 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <fcntl.h>
 #include "usermem.hh"
 #include "util.hh"
 
 namespace dbi {
 
-  void UserMemory::open(Tracee& tracee, size_t size, int prot) {
+  void UserMemory::open(Tracee& tracee, size_t size, int prot, int flags) {
     size_ = size;
     assert(!*this);
     user_map = tracee.syscall<char *>(Syscall::MMAP,
 				      0 /* void *addr */,
 				      size /* size_t length */,
 				      prot /* int prot */,
-				      MAP_PRIVATE | MAP_ANONYMOUS /* int flags */,
+				      flags /* int flags */,
 				      -1 /* int fd */,
 				      0 /* off_t offset */
 				      );
@@ -24,4 +28,103 @@ namespace dbi {
     }
   }
 
+  void UserMemory::open(Tracees& tracees, size_t size, int prot, int flags) {
+    const auto is_good = [] (const TraceePair& tracee_pair) { return tracee_pair.tracee.good(); };
+    auto it = std::find_if(tracees.begin(), tracees.end(), is_good);
+    assert(it != tracees.end());
+    open(it->tracee, size, prot, flags);
+
+    std::unordered_set<pid_t> mapped {it->tgid()};
+    for (++it; it != tracees.end(); ++it) {
+      if (!is_good(*it) || !mapped.insert(it->tgid()).second) { continue; }
+      void *map = it->tracee.syscall<void *>(Syscall::MMAP,
+					      user_map /* void *addr */,
+					      size /* size_t length */,
+					      prot /* int prot */,
+					      flags | MAP_FIXED_NOREPLACE /* int flags */,
+					      -1 /* int fd */,
+					      0 /* off_t offset */
+					      );
+      if (map != user_map) {
+	std::abort();
+      }
+    }
+  }
+
+  void UserMemory::open_memfd(size_t size) {
+    assert(!*this);
+    size_ = size;
+    memfd = ::memfd_create("dbi", MFD_CLOEXEC);
+    if (memfd < 0) {
+      std::perror("memfd_create");
+      std::abort();
+    }
+    if (::ftruncate(memfd, size) < 0) {
+      std::perror("ftruncate");
+      std::abort();
+    }
+    local_map = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (local_map == MAP_FAILED) {
+      std::perror("mmap");
+      std::abort();
+    }
+  }
+
+  void UserMemory::open_shared(Tracees& tracees, size_t size, int prot, void *addr) {
+    open_memfd(size);
+    user_map = addr;
+    const int fixed_flag = addr ? MAP_FIXED : MAP_FIXED_NOREPLACE;
+    std::unordered_set<pid_t> mapped;
+    for (auto& tracee_pair : tracees) {
+      if (tracee_pair.tracee.good() && mapped.insert(tracee_pair.tgid()).second) {
+	map_shared(tracee_pair.tracee, prot, user_map, fixed_flag);
+      }
+    }
+    assert(*this);
+  }
+
+  void UserMemory::open_shared(Tracee& tracee, size_t size, int prot, void *addr) {
+    open_memfd(size);
+    map_shared(tracee, prot, addr, MAP_FIXED);
+  }
+
+  void UserMemory::close() {
+    if (shared()) {
+      ::munmap(local_map, size_);
+      ::close(memfd);
+      local_map = nullptr;
+    }
+    user_map = MAP_FAILED;
+  }
+
+  void UserMemory::map_shared(Tracee& tracee, int prot, void *addr, int fixed_flag) {
+    /* open the tracer's memfd through procfs; the path goes below the tracee's red zone */
+    const std::string path =
+      "/proc/" + std::to_string(::getpid()) + "/fd/" + std::to_string(memfd);
+    char *path_ptr = static_cast<char *>(tracee.get_sp()) - 128 - (path.size() + 1);
+    tracee.write(path.c_str(), path.size() + 1, path_ptr);
+
+    /* The tracer writes through local() only. A view that is not writable is opened read-only,
+     * so that the tracee cannot mprotect it writable either.
+     */
+    const int flags = (prot & PROT_WRITE) ? O_RDWR : O_RDONLY;
+    const int fd = tracee.syscall<int>(Syscall::OPEN, path_ptr, flags | O_CLOEXEC, 0);
+    if (fd < 0) {
+      std::abort();
+    }
+    void *map = tracee.syscall<void *>(Syscall::MMAP,
+				       addr /* void *addr */,
+				       size_ /* size_t length */,
+				       prot /* int prot */,
+				       MAP_SHARED | (addr ? fixed_flag : 0) /* int flags */,
+				       fd /* int fd */,
+				       0 /* off_t offset */
+				       );
+    tracee.syscall<int>(Syscall::CLOSE, fd);
+    if (map == MAP_FAILED || (addr != nullptr && map != addr)) {
+      std::abort();
+    }
+    user_map = map;
+  }
+
 }
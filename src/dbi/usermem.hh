@@ -4,12 +4,13 @@
 #include <sys/mman.h>
 #include <cassert>
 #include "tracee.hh"
+#include "tracees.hh"
 
 namespace dbi {
 
   class UserMemory {
   public:
-    UserMemory(): user_map(MAP_FAILED) {}
+    UserMemory(): user_map(MAP_FAILED), local_map(nullptr) {}
 
     template <typename... Args>
     UserMemory(Args&&... args) { open(args...); }
@@ -17,8 +18,29 @@ namespace dbi {
     bool good() const { return user_map != MAP_FAILED; }
     operator bool() const { return good(); }
 
-    void open(Tracee& tracee, size_t size, int prot);
-    void close() { user_map = MAP_FAILED; } // TODO: Only should close under some circumstances
+    void open(Tracee& tracee, size_t size, int prot, int flags = MAP_PRIVATE | MAP_ANONYMOUS);
+    // maps at the same address in all (live) tracees, once per process
+    void open(Tracees& tracees, size_t size, int prot, int flags = MAP_PRIVATE | MAP_ANONYMOUS);
+    /* Maps a memfd at the same address in all (live) processes and in the tracer, so that the
+     * tracer can write through local() with plain stores instead of per-tracee pwrites.
+     * A non-null addr replaces what is mapped there, e.g. part of a PROT_NONE reservation.
+     */
+    void open_shared(Tracees& tracees, size_t size, int prot, void *addr = nullptr);
+    /* Same, but for a single tracee; a non-null addr replaces whatever is mapped there
+     * (e.g. a shared mapping inherited across fork).
+     */
+    void open_shared(Tracee& tracee, size_t size, int prot, void *addr = nullptr);
+    void close(); // TODO: Only should close under some circumstances
+
+    bool shared() const { return local_map != nullptr; }
+
+    /* tracer-side address of a tracee address in a shared mapping */
+    template <typename T>
+    T *local(T *user_ptr) const {
+      assert(shared());
+      return reinterpret_cast<T *>(static_cast<char *>(local_map) +
+				   (reinterpret_cast<const char *>(user_ptr) - begin<char>()));
+    }
   
     size_t size() const { return size_; }
 
@@ -34,6 +56,11 @@ namespace dbi {
   private:
     size_t size_;
     void *user_map;
+    void *local_map;
+    int memfd;
+
+    void open_memfd(size_t size);
+    void map_shared(Tracee& tracee, int prot, void *addr, int fixed_flag);
   };
 
   template <typename T>
@@ -81,9 +81,6 @@ for m in $(echo "$mode" | tr ',' ' '); do
 	"last_decision")
 	    key+=6
 	    ;;
-	"last_iclass")
-	    key+=7
-	    ;;
 	*)
 	    echo "$0: bad mode" >&2
 	    exit 1
@@ -56,9 +56,26 @@ int main(int argc, char *argv[]) {
       " -l <file> log file\n"					\
       " --prediction-mode=<mode>\n"				\
       "           branch prediction mode to use\n"		\
-      "           legal values: 'none', 'iclass', 'iform'\n"	\
+      "           legal values: 'none', 'iclass', 'iform', 'dir',\n"	\
+      "           'online' (default)\n"				\
       " --syscalls\n"						\
-      "           log syscalls" 
+      "           log syscalls\n"					\
+      " --superblock\n"						\
+      "           follow direct jumps and calls when translating\n" \
+      " --code-cache=<MiB>\n"					\
+      "           flush translations when the code cache exceeds <MiB>\n" \
+      " --trans-cache=<dir>\n"					\
+      "           reuse translated entry points across runs, cached in <dir>\n" \
+      " --region=<blocks>[,<KiB>]\n"				\
+      "           on each translation stop, also translate the blocks reachable\n" \
+      "           through direct branches, up to <blocks> blocks and <KiB> KiB\n" \
+      " --jcc-profile=<file>\n"					\
+      "           load and save the online jcc predictor's counts in <file>\n" \
+      " --tier=<count>\n"						\
+      "           retranslate blocks run <count> times into traces along their\n" \
+      "           hottest successors\n"					\
+      " --stats\n"						\
+      "           print translation statistics at exit\n"		\
       ""
       ;
     fprintf(f, usage, argv[0]);
@@ -70,10 +87,24 @@ int main(int argc, char *argv[]) {
   enum Option {
     PREDICTION_MODE = 256,
     LOG_SYSCALLS,
+    SUPERBLOCK,
+    CODE_CACHE,
+    TRANS_CACHE,
+    REGION,
+    JCC_PROFILE,
+    TIER,
+    STATS,
   };
   const struct option longopts[] =
     {{"prediction-mode", 1, nullptr, PREDICTION_MODE},
      {"syscalls", 1, nullptr, LOG_SYSCALLS},
+     {"superblock", 0, nullptr, SUPERBLOCK},
+     {"code-cache", 1, nullptr, CODE_CACHE},
+     {"trans-cache", 1, nullptr, TRANS_CACHE},
+     {"region", 1, nullptr, REGION},
+     {"jcc-profile", 1, nullptr, JCC_PROFILE},
+     {"tier", 1, nullptr, TIER},
+     {"stats", 0, nullptr, STATS},
      {nullptr, 0, nullptr, 0},
     };
   int optchar;
@@ -130,6 +161,46 @@ int main(int argc, char *argv[]) {
     case LOG_SYSCALLS:
       log_syscalls = true;
       break;
+
+    case SUPERBLOCK:
+      dbi::g_conf.superblock = true;
+      break;
+
+    case CODE_CACHE:
+      if (!dbi::g_conf.set_code_cache_budget(optarg)) {
+	fprintf(stderr, "%s: --code-cache: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case TRANS_CACHE:
+      dbi::g_conf.trans_cache_dir = optarg;
+      break;
+
+    case REGION:
+      if (!dbi::g_conf.set_region(optarg)) {
+	fprintf(stderr, "%s: --region: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case JCC_PROFILE:
+      dbi::g_conf.jcc_profile = optarg;
+      break;
+
+    case TIER:
+      if (!dbi::g_conf.set_tier_threshold(optarg)) {
+	fprintf(stderr, "%s: --tier: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case STATS:
+      dbi::g_conf.stats = true;
+      break;
       
     default:
       usage(stderr);
@@ -35,11 +35,28 @@ int main(int argc, char *argv[]) {
       " -v        increase verbosity level\n"				\
       " --prediction-mode=<mode>\n"					\
       "           branch prediction mode to use\n"			\
-      "           legal values: 'none', 'iclass', 'iform'\n"		\
+      "           legal values: 'none', 'iclass', 'iform', 'dir',\n"	\
+      "           'online' (default)\n"				\
       " --ss-syscall=<syscall>,<count>\n"				\
       "           single-step after <count> invokations of syscall\n"	\
       " --no-preload\n"							\
       "           disable setting of LD_PRELOAD to custom libc\n"	\
+      " --superblock\n"						\
+      "           follow direct jumps and calls when translating\n"	\
+      " --code-cache=<MiB>\n"					\
+      "           flush translations when the code cache exceeds <MiB>\n" \
+      " --trans-cache=<dir>\n"					\
+      "           reuse translated entry points across runs, cached in <dir>\n" \
+      " --region=<blocks>[,<KiB>]\n"				\
+      "           on each translation stop, also translate the blocks reachable\n" \
+      "           through direct branches, up to <blocks> blocks and <KiB> KiB\n" \
+      " --jcc-profile=<file>\n"					\
+      "           load and save the online jcc predictor's counts in <file>\n" \
+      " --tier=<count>\n"						\
+      "           retranslate blocks run <count> times into traces along their\n" \
+      "           hottest successors\n"					\
+      " --stats\n"						\
+      "           print translation statistics at exit\n"		\
       ""
       ;
     fprintf(f, usage, argv[0]);
@@ -53,11 +70,25 @@ int main(int argc, char *argv[]) {
     PREDICTION_MODE = 256,
     SS_SYSCALL,
     NO_PRELOAD,
+    SUPERBLOCK,
+    CODE_CACHE,
+    TRANS_CACHE,
+    REGION,
+    JCC_PROFILE,
+    TIER,
+    STATS,
   };
   const struct option longopts[] =
     {{"prediction-mode", 1, nullptr, PREDICTION_MODE},
      {"ss-syscall", true, nullptr, SS_SYSCALL},
      {"no-preload", true, nullptr, NO_PRELOAD},
+     {"superblock", false, nullptr, SUPERBLOCK},
+     {"code-cache", true, nullptr, CODE_CACHE},
+     {"trans-cache", true, nullptr, TRANS_CACHE},
+     {"region", true, nullptr, REGION},
+     {"jcc-profile", true, nullptr, JCC_PROFILE},
+     {"tier", true, nullptr, TIER},
+     {"stats", false, nullptr, STATS},
      {nullptr, 0, nullptr, 0},
     };
   int optchar;
@@ -138,6 +169,46 @@ int main(int argc, char *argv[]) {
     case NO_PRELOAD:
       memcheck::g_conf.preload = false;
       break;
+
+    case SUPERBLOCK:
+      dbi::g_conf.superblock = true;
+      break;
+
+    case CODE_CACHE:
+      if (!dbi::g_conf.set_code_cache_budget(optarg)) {
+	fprintf(stderr, "%s: --code-cache: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case TRANS_CACHE:
+      dbi::g_conf.trans_cache_dir = optarg;
+      break;
+
+    case REGION:
+      if (!dbi::g_conf.set_region(optarg)) {
+	fprintf(stderr, "%s: --region: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case JCC_PROFILE:
+      dbi::g_conf.jcc_profile = optarg;
+      break;
+
+    case TIER:
+      if (!dbi::g_conf.set_tier_threshold(optarg)) {
+	fprintf(stderr, "%s: --tier: bad argument\n", argv[0]);
+	usage(stderr);
+	return 1;
+      }
+      break;
+
+    case STATS:
+      dbi::g_conf.stats = true;
+      break;
       
     default:
       usage(stderr);
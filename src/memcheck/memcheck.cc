@@ -304,7 +304,7 @@ namespace memcheck {
   }
 
   Memcheck::Loc Memcheck::orig_loc(uint8_t *addr) {
-    const auto orig_addr = patcher.orig_block_addr(addr);
+    const auto orig_addr = patcher.orig_inst_addr(addr);
     std::vector<Map> maps;
     maps_gen.get_maps(std::back_inserter(maps));
     for (const auto& map : maps) {
@@ -325,6 +325,7 @@ namespace memcheck {
       internal_error() << "failed to fork process\n";
       g_conf.abort(tracee());
     }
+    vars.fork(tracee(), forked_tracee);
     patcher.add_tracee(std::move(forked_tracee));
 
     /* update fill map */
@@ -342,6 +343,7 @@ namespace memcheck {
     dbi::Tracee& tracee2 = this->tracee2();
     const auto pid2 = tracee2.pid(); (void) pid2;
     thd_map.erase(tracee2.pid());
+    vars.kill(tracee2.pid());
     tracee2.kill();
     
     dbi::Status status;
@@ -606,7 +608,7 @@ namespace memcheck {
       }
     }
 
-    tmp_writable_pages.erase(vars.mem.base<void *>());
+    tmp_writable_pages.erase(vars.base());
   }
 
   void Memcheck::lock_pages() {
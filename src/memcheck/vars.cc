@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "vars.hh"
 
 namespace memcheck {
@@ -7,7 +8,9 @@ namespace memcheck {
     assert(!*this);
 
     thd_map_ = &thd_map;
-    mem.open(tracee, dbi::PAGESIZE, PROT_READ | PROT_WRITE);
+    dbi::UserMemory& mem = page(tracee.pid());
+    mem.open_shared(tracee, dbi::PAGESIZE, PROT_READ | PROT_WRITE);
+    base_ = mem.base<void>();
     allocator.open(mem);
     fill_ptr_ = reinterpret_cast<uint8_t *>(allocator.alloc());
     jcc_cksum_ptr_ = reinterpret_cast<uint32_t *>(allocator.alloc());
@@ -15,6 +18,23 @@ namespace memcheck {
     prev_sp_ptr_ = reinterpret_cast<uint64_t **>(allocator.alloc());
   }
 
+  void MemcheckVariables::fork(dbi::Tracee& parent, dbi::Tracee& child) {
+    /* the child inherited the parent's shared page; replace it with a private copy */
+    const dbi::UserMemory& parent_mem = pages.at(parent.pid());
+    dbi::UserMemory& child_mem = page(child.pid());
+    assert(!child_mem);
+    child_mem.open_shared(child, dbi::PAGESIZE, PROT_READ | PROT_WRITE, base_);
+    std::copy_n(parent_mem.local(parent_mem.begin<char>()), dbi::PAGESIZE,
+		child_mem.local(child_mem.begin<char>()));
+  }
+
+  void MemcheckVariables::kill(pid_t pid) {
+    const auto it = pages.find(pid);
+    assert(it != pages.end());
+    it->second.close();
+    pages.erase(it);
+  }
+
   void MemcheckVariables::init_for_subround(dbi::Tracee& tracee) {
     write_type(tracee, thd_map_->at(tracee.pid()).fill, fill_ptr_);
     write_type(tracee, 0U, jcc_cksum_ptr_);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <unordered_map>
 #include "dbi/usermem.hh"
 #include "dbi/tracee.hh"
 #include "dbi/util.hh"
@@ -16,11 +17,17 @@ namespace memcheck {
     template <typename... Args>
     MemcheckVariables(Args&&... args) { open(args...); }
 
-    bool good() const { return mem; }
+    bool good() const { return !pages.empty(); }
     operator bool() const { return good(); }
 
     void open(dbi::Tracee& tracee, const dbi::Patcher& patcher, const ThreadMap& thd_map);
 
+    /* give a forked tracee its own copy of the variables page, at the same address */
+    void fork(dbi::Tracee& parent, dbi::Tracee& child);
+    void kill(pid_t pid);
+
+    void *base() const { return base_; }
+
     uint8_t * const * fill_ptr_ptr() const { return &fill_ptr_; }
     uint8_t fill_val(dbi::Tracee& tracee) { return read_type(tracee, fill_ptr_); }
   
@@ -37,7 +44,11 @@ namespace memcheck {
     void init_for_subround(dbi::Tracee& tracee);
   
   private:
-    dbi::UserMemory mem;
+    /* One memfd-backed page per tracee, also mapped in the tracer, so that variables are read
+     * and written with plain memory accesses.
+     */
+    std::unordered_map<pid_t, dbi::UserMemory> pages; // NOTE: UserMemory is not movable
+    void *base_;
     dbi::UserAllocator<uint64_t> allocator;
 
     const ThreadMap *thd_map_;
@@ -46,11 +57,17 @@ namespace memcheck {
     uint64_t **tmp_rsp_ptr_; // tmp rsp
     uint64_t **prev_sp_ptr_;
 
+    dbi::UserMemory& page(pid_t pid) {
+      return pages.emplace(std::piecewise_construct, std::forward_as_tuple(pid),
+			   std::forward_as_tuple()).first->second;
+    }
+    
     template <typename T> void write_type(dbi::Tracee& tracee, T val, T *addr) {
-      tracee.write_type(val, addr);
+      *pages.at(tracee.pid()).local(addr) = val;
+      tracee.update_memcache(&val, sizeof(val), addr);
     }
     template <typename T> T read_type(dbi::Tracee& tracee, const T *addr) {
-      return tracee.read_type(addr);
+      return *pages.at(tracee.pid()).local(addr);
     }
 
     friend class Memcheck;
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+/* Function symbols for dbi-aot to seed from: one that is never called, which it should still
+ * cache, and one that runs into undecodable bytes, which it must not.
+ */
+
+__attribute__((noinline, used)) int never_called(int x) {
+  return x * 7 + 1;
+}
+
+__asm__(".text\n"
+	".globl bad_tail\n"
+	".type bad_tail, @function\n"
+	"bad_tail:\n"
+	"\tnop\n"
+	"\t.byte 0x06\n" /* push es: invalid in 64-bit mode */
+	".size bad_tail, .-bad_tail\n");
+
+__attribute__((noinline)) static unsigned sum(unsigned n) {
+  unsigned res = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    res += i % 3 ? i : 2 * i;
+  }
+  return res;
+}
+
+int main(void) {
+  printf("sum: %u\n", sum(1000));
+  return 0;
+}
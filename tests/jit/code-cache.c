@@ -0,0 +1,69 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* More code than fits in a small code cache, run over several times so that it is retranslated
+ * after each flush, while another thread stays blocked in a syscall.
+ */
+
+#define F(i) static __attribute__((noinline)) unsigned long f##i(unsigned long x) {	\
+    for (unsigned j = 0; j < 4; ++j) {							\
+      if (x & 1) {									\
+	x = 3 * x + i;									\
+      } else {										\
+	x = x / 2 + j;									\
+      }											\
+      if (x % 5 == 0) {									\
+	x ^= i;										\
+      }											\
+    }											\
+    return x;										\
+  }
+#define F8(i) F(i##0) F(i##1) F(i##2) F(i##3) F(i##4) F(i##5) F(i##6) F(i##7)
+#define F64(i) F8(i##0) F8(i##1) F8(i##2) F8(i##3) F8(i##4) F8(i##5) F8(i##6) F8(i##7)
+#define F512(i) F64(i##0) F64(i##1) F64(i##2) F64(i##3) F64(i##4) F64(i##5) F64(i##6) F64(i##7)
+F512(1) F512(2) F512(3) F512(4) F512(5) F512(6) F512(7)
+
+#define P(i) f##i,
+#define P8(i) P(i##0) P(i##1) P(i##2) P(i##3) P(i##4) P(i##5) P(i##6) P(i##7)
+#define P64(i) P8(i##0) P8(i##1) P8(i##2) P8(i##3) P8(i##4) P8(i##5) P8(i##6) P8(i##7)
+#define P512(i) P64(i##0) P64(i##1) P64(i##2) P64(i##3) P64(i##4) P64(i##5) P64(i##6) P64(i##7)
+static unsigned long (*const fns[])(unsigned long) = {
+  P512(1) P512(2) P512(3) P512(4) P512(5) P512(6) P512(7)
+};
+enum {NFNS = sizeof(fns) / sizeof(fns[0])};
+
+static int fds[2];
+
+/* blocked in read() until the main thread is done */
+static void *reader(void *arg) {
+  char c = 0;
+  const ssize_t n = read(fds[0], &c, 1);
+  return (void *) (unsigned long) (n == 1 && c == 'x');
+}
+
+int main(void) {
+  if (pipe(fds) < 0) {
+    return 1;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, reader, NULL) != 0) {
+    return 1;
+  }
+
+  unsigned long x = 1;
+  for (unsigned pass = 0; pass < 4; ++pass) {
+    for (unsigned i = 0; i < NFNS; ++i) {
+      x = fns[i](x + pass);
+    }
+    printf("pass %u: %lu\n", pass, x);
+  }
+
+  void *res;
+  if (write(fds[1], "x", 1) != 1 || pthread_join(thread, &res) != 0) {
+    return 1;
+  }
+  printf("reader: %lu\n", (unsigned long) res);
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Forked children, one of which forks again, each running code the parent translated before the
+ * fork as well as code of their own. Output is ordered by waiting for each child in turn.
+ */
+
+static unsigned long collatz_steps(unsigned long n) {
+  unsigned long steps = 0;
+  while (n != 1) {
+    n = n % 2 ? 3 * n + 1 : n / 2;
+    ++steps;
+  }
+  return steps;
+}
+
+static unsigned long sum_steps(unsigned long begin, unsigned long end) {
+  unsigned long sum = 0;
+  for (unsigned long i = begin; i < end; ++i) {
+    sum += collatz_steps(i);
+  }
+  return sum;
+}
+
+static int wait_child(pid_t pid) {
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+static int grandchild(void) {
+  printf("grandchild: %lu\n", sum_steps(1, 5000));
+  return 7;
+}
+
+static int child(unsigned id) {
+  printf("child %u: %lu\n", id, sum_steps(1 + id * 1000, 10000 + id * 1000));
+  if (id == 1) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+      exit(grandchild());
+    }
+    printf("child %u: grandchild exited with %d\n", id, wait_child(pid));
+  }
+  return id + 1;
+}
+
+int main(void) {
+  printf("parent: %lu\n", sum_steps(1, 10000));
+
+  for (unsigned id = 0; id < 3; ++id) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) {
+      return 1;
+    }
+    if (pid == 0) {
+      exit(child(id));
+    }
+    printf("child %u exited with %d\n", id, wait_child(pid));
+  }
+
+  printf("parent: %lu\n", sum_steps(10000, 20000));
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <setjmp.h>
+
+/* Indirect branches with many targets per site, and returns that the RSB cannot predict:
+ * recursion deeper than the RSB, and longjmp out of it.
+ */
+
+#define F(i) static __attribute__((noinline)) unsigned long f##i(unsigned long x) {	\
+    return x * (2 * i + 1) + i;								\
+  }
+#define F8(i) F(i##0) F(i##1) F(i##2) F(i##3) F(i##4) F(i##5) F(i##6) F(i##7)
+F8(1) F8(2) F8(3) F8(4) F8(5) F8(6) F8(7) F8(8)
+
+#define P8(i) f##i##0, f##i##1, f##i##2, f##i##3, f##i##4, f##i##5, f##i##6, f##i##7,
+static unsigned long (*const fns[])(unsigned long) = {
+  P8(1) P8(2) P8(3) P8(4) P8(5) P8(6) P8(7) P8(8)
+};
+enum {NFNS = sizeof(fns) / sizeof(fns[0])};
+
+/* one indirect call site with every target */
+static unsigned long megamorphic_call(unsigned n) {
+  unsigned long x = 1, r = 12345;
+  for (unsigned i = 0; i < n; ++i) {
+    r = r * 1103515245 + 12345;
+    x = fns[(r >> 16) % NFNS](x);
+  }
+  return x;
+}
+
+/* one indirect jmp (computed goto) with 16 targets */
+static unsigned long megamorphic_jmp(unsigned n) {
+  static void *const labels[] = {
+    &&l0, &&l1, &&l2, &&l3, &&l4, &&l5, &&l6, &&l7,
+    &&l8, &&l9, &&l10, &&l11, &&l12, &&l13, &&l14, &&l15,
+  };
+  unsigned long x = 0, r = 54321;
+  unsigned i = 0;
+ next:
+  if (i++ == n) {
+    return x;
+  }
+  r = r * 1103515245 + 12345;
+  goto *labels[(r >> 16) % 16];
+ l0: x += 1; goto next;
+ l1: x ^= 3; goto next;
+ l2: x *= 5; goto next;
+ l3: x -= 7; goto next;
+ l4: x += x >> 3; goto next;
+ l5: x ^= x << 5; goto next;
+ l6: x += 11; goto next;
+ l7: x *= 13; goto next;
+ l8: x -= 17; goto next;
+ l9: x ^= 19; goto next;
+ l10: x += 23; goto next;
+ l11: x *= 29; goto next;
+ l12: x -= x >> 7; goto next;
+ l13: x ^= 31; goto next;
+ l14: x += 37; goto next;
+ l15: x *= 41; goto next;
+}
+
+/* not a tail call, so every level returns through the RSB */
+static __attribute__((noinline)) unsigned long depth(unsigned n) {
+  if (n == 0) {
+    return 0;
+  }
+  return depth(n - 1) + fns[n % NFNS](n) % 7;
+}
+
+static jmp_buf env;
+static volatile int jump = 1;
+
+static __attribute__((noinline)) unsigned long unwind(unsigned n) {
+  if (n == 0) {
+    if (jump) {
+      longjmp(env, 1);
+    }
+    return 0;
+  }
+  return unwind(n - 1) + fns[n % NFNS](n); // the additions are never reached
+}
+
+int main(void) {
+  printf("call: %lu\n", megamorphic_call(100000));
+  printf("jmp: %lu\n", megamorphic_jmp(100000));
+
+  unsigned long sum = 0;
+  for (unsigned i = 0; i < 20; ++i) {
+    sum += depth(10000);
+  }
+  printf("depth: %lu\n", sum);
+
+  unsigned unwound = 0;
+  for (unsigned i = 0; i < 100; ++i) {
+    if (setjmp(env) == 0) {
+      unwind(i * 10);
+    }
+    ++unwound;
+    /* returns after the longjmp do not match the RSB entries it skipped */
+    sum += depth(i);
+  }
+  printf("unwound: %u, depth: %lu\n", unwound, sum);
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Hot loops with data-dependent branches, indirect calls and callbacks into libc: enough
+ * repeated blocks for tiering and the jcc predictor, and enough entry points for the
+ * translation cache.
+ */
+
+static unsigned long step_even(unsigned long x) { return x / 2; }
+static unsigned long step_odd(unsigned long x) { return 3 * x + 1; }
+
+static unsigned long (*const steps[])(unsigned long) = {step_even, step_odd};
+
+static unsigned collatz(unsigned long x) {
+  unsigned n = 0;
+  while (x != 1) {
+    x = steps[x & 1](x);
+    ++n;
+  }
+  return n;
+}
+
+static int cmp(const void *a, const void *b) {
+  const unsigned x = *(const unsigned *) a;
+  const unsigned y = *(const unsigned *) b;
+  return (x > y) - (x < y);
+}
+
+int main(void) {
+  enum {N = 20000};
+  static unsigned lens[N];
+  unsigned long sum = 0;
+  for (unsigned i = 0; i < N; ++i) {
+    lens[i] = collatz(i + 1);
+    sum += lens[i];
+  }
+  printf("collatz sum: %lu\n", sum);
+
+  qsort(lens, N, sizeof(lens[0]), cmp);
+  printf("median: %u, max: %u\n", lens[N / 2], lens[N - 1]);
+
+  unsigned long primes = 0;
+  for (unsigned i = 2; i < N; ++i) {
+    unsigned d = 2;
+    while (d * d <= i && i % d != 0) {
+      ++d;
+    }
+    primes += d * d > i;
+  }
+  printf("primes: %lu\n", primes);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+/* Region translation follows call and jump edges that never execute. Here they lead into code
+ * that does not decode: a syscall followed by invalid bytes, so that translation fails after
+ * breakpoints have been registered for the syscall. The failed blocks must be undone without
+ * disturbing the rest of the region.
+ */
+
+void bad_region(void);
+
+__asm__(".text\n"
+	".globl bad_region\n"
+	".type bad_region, @function\n"
+	"bad_region:\n"
+	"\tmov $39, %eax\n"
+	"\tsyscall\n"
+	"\tnop\n"
+	"\t.byte 0x06\n" /* push es: invalid in 64-bit mode */
+	".size bad_region, .-bad_region\n");
+
+__attribute__((noinline)) static unsigned long mix(unsigned long x) {
+  return x * 2654435761UL ^ x >> 7;
+}
+
+__attribute__((noinline)) static unsigned long walk(unsigned long x, int never) {
+  for (int i = 0; i < 64; ++i) {
+    if (never) {
+      bad_region();
+    }
+    x = mix(x) % 1000003;
+  }
+  return x;
+}
+
+int main(int argc, char **argv) {
+  (void) argv;
+  const int never = argc > 100;
+  unsigned long x = 1;
+  for (int i = 0; i < 1000; ++i) {
+    x = walk(x + i, never);
+    if (never) {
+      bad_region();
+    }
+  }
+  printf("walk: %lu\n", x);
+  return 0;
+}
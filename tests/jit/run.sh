@@ -0,0 +1,157 @@
+#!/bin/bash
+
+set -o pipefail
+
+usage() {
+    cat <<EOF
+usage: $0 [-h] [-j <jit>] [-d <testdesc>] [-a <jit-arg>]... command [args...]
+Environment variables:
+  JIT     -- path to jit (also set with option '-j')
+  DBI_AOT -- path to dbi-aot, for tests that seed a translation cache
+EOF
+}
+
+JIT_ARGS=()
+while getopts "hj:d:a:" OPTCHAR; do
+    case $OPTCHAR in
+	"h")
+	    usage
+	    exit 0
+	    ;;
+	"j")
+	    JIT="$OPTARG"
+	    ;;
+	"d")
+	    TESTDESC="$OPTARG"
+	    ;;
+	"a")
+	    JIT_ARGS+=("$OPTARG")
+	    ;;
+	*)
+	    usage >&2
+	    exit 1
+	    ;;
+    esac
+done
+
+shift $((OPTIND-1))
+
+if [[ $# -lt 1 ]]; then
+    usage >&2
+    exit 1
+fi
+
+if [[ -z ${JIT+x} ]]; then
+    echo "$0: 'JIT' isn't set" >&2
+    exit 1
+elif ! [[ -x "$JIT" ]]; then
+    echo "$0: cannot execute jit at '$JIT'"
+    exit 1
+fi
+
+COMMANDS=("$@")
+if ! [[ -x "${COMMANDS[0]}" ]]; then
+    COMMANDS[0]="$(which "${COMMANDS[0]}")"
+    if [[ -z "${COMMANDS[0]}" ]]; then
+	echo "$0: failed to find executable '$1'" >&2
+	exit 1
+    fi
+fi
+
+# scratch directory for the test (translation caches, profiles)
+WORKDIR=`mktemp -d`
+trap "rm -rf $WORKDIR" EXIT
+STDOUT=$WORKDIR/stdout
+STDERR=$WORKDIR/stderr
+
+# runs the command under jit; extra jit arguments go before '--'
+run_jit() {
+    "$JIT" "${JIT_ARGS[@]}" "$@" -- "${COMMANDS[@]}"
+}
+
+# output of the command run natively, to compare with
+native_stdout() {
+    "${COMMANDS[@]}" 2> /dev/null
+}
+
+BAD_STDOUT=4
+BAD_EXIT=5
+BAD_STDERR=6
+BAD_SETUP=7
+BAD_CHECK=8
+
+# A test description may set:
+#   exitno         -- expected exit number
+#   stdout         -- expected stdout
+#   native         -- if set, expect the stdout of the command run natively
+#   stderr_match   -- array of extended regexes that must each match a line of stderr
+#   stderr_nomatch -- array of extended regexes that must not match
+#   jit_args       -- array of extra jit arguments
+# and define functions:
+#   setup          -- run before the test, e.g. to warm a cache in $WORKDIR
+#   check          -- run after the test, for checks on files in $WORKDIR
+unset exitno
+unset stdout
+unset native
+stderr_match=()
+stderr_nomatch=()
+jit_args=()
+source "$TESTDESC"
+
+if declare -F setup > /dev/null; then
+    if ! setup > /dev/null 2>&1; then
+	echo "$0: setup failed"
+	exit $BAD_SETUP
+    fi
+fi
+
+run_jit "${jit_args[@]}" > $STDOUT 2> $STDERR
+EXITNO=$?
+
+if ! [[ -z $exitno ]]; then
+    if ! [[ $EXITNO -eq $exitno ]]; then
+	echo "$0: mismatch in exit number: actual=$EXITNO, expected=$exitno"
+	echo "STDERR:"
+	cat $STDERR
+	exit $BAD_EXIT
+    fi
+fi
+
+if ! [[ -z ${native+x} ]]; then
+    native_stdout > $WORKDIR/native
+    stdout="$(cat $WORKDIR/native; printf x)"
+    stdout="${stdout%x}"
+fi
+
+if ! [[ -z ${stdout+x} ]]; then
+    if ! printf "%s" "$stdout" | diff $STDOUT - > $WORKDIR/diff; then
+	echo "$0: mismatch in stdout:"
+	cat $WORKDIR/diff
+	exit $BAD_STDOUT
+    fi
+fi
+
+for pattern in "${stderr_match[@]}"; do
+    if ! grep -Eq -- "$pattern" $STDERR; then
+	echo "$0: stderr does not match '$pattern':"
+	cat $STDERR
+	exit $BAD_STDERR
+    fi
+done
+
+for pattern in "${stderr_nomatch[@]}"; do
+    if grep -Eq -- "$pattern" $STDERR; then
+	echo "$0: stderr matches '$pattern':"
+	cat $STDERR
+	exit $BAD_STDERR
+    fi
+done
+
+if declare -F check > /dev/null; then
+    if ! check; then
+	echo "$0: check failed"
+	exit $BAD_CHECK
+    fi
+fi
+
+exit 0
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Syscalls with and without a tracer hook: unhooked ones run in-core through the filter and must
+ * keep their arguments and return values; the mapping syscalls are hooked (code invalidation),
+ * and code mapped, run, unmapped and mapped again must run as rewritten.
+ */
+
+typedef int (*func_t)(void);
+
+static int run_code(void *hint, int imm) {
+  /* mov eax, imm; ret */
+  const unsigned char code[] = {0xb8, imm & 0xff, (imm >> 8) & 0xff, 0, 0, 0xc3};
+  unsigned char *page = mmap(hint, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			     -1, 0);
+  if (page == MAP_FAILED) {
+    return -1;
+  }
+  memcpy(page, code, sizeof(code));
+  if (mprotect(page, 4096, PROT_READ | PROT_EXEC) < 0) {
+    return -1;
+  }
+  const int res = ((func_t) page)();
+  munmap(page, 4096);
+  return res;
+}
+
+int main(void) {
+  const pid_t pid = syscall(SYS_getpid);
+  printf("getpid consistent: %d\n", pid == getpid());
+
+  unsigned long sum = 0;
+  for (int i = 0; i < 10000; ++i) {
+    sum += syscall(SYS_getppid) == getppid();
+  }
+  printf("getppid consistent: %lu\n", sum);
+
+  static const char msg[] = "written\n";
+  fflush(stdout);
+  printf("write: %zd\n", write(STDOUT_FILENO, msg, sizeof(msg) - 1));
+
+  void *hint = (void *) 0x7e0000000000UL;
+  for (int imm = 1; imm <= 3; ++imm) {
+    printf("code %d: %d\n", imm, run_code(hint, imm * 100));
+  }
+
+  unsigned char *page = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			     -1, 0);
+  page[0] = 42;
+  page = mremap(page, 8192, 65536, MREMAP_MAYMOVE);
+  printf("mremap: %d\n", page != MAP_FAILED && page[0] == 42);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Threads running the same code concurrently, each with calls and returns (the RSB and scratch
+ * memory are per thread), syscalls, and branches translated while the others run.
+ */
+
+#define NTHREADS 8
+#define ITERS 20000
+
+static unsigned long collatz_steps(unsigned long n) {
+  unsigned long steps = 0;
+  while (n != 1) {
+    n = n % 2 ? 3 * n + 1 : n / 2;
+    ++steps;
+  }
+  return steps;
+}
+
+static void *worker(void *arg) {
+  const unsigned long id = (unsigned long) arg;
+  unsigned long sum = 0;
+  for (unsigned long i = 1; i <= ITERS; ++i) {
+    sum += collatz_steps(i + id);
+    if (i % 1000 == 0) {
+      syscall(SYS_gettid);
+    }
+  }
+  return (void *) sum;
+}
+
+int main(void) {
+  pthread_t threads[NTHREADS];
+  for (unsigned long i = 0; i < NTHREADS; ++i) {
+    if (pthread_create(&threads[i], NULL, worker, (void *) i) != 0) {
+      return 1;
+    }
+  }
+  for (unsigned long i = 0; i < NTHREADS; ++i) {
+    void *sum;
+    pthread_join(threads[i], &sum);
+    printf("thread %lu: %lu\n", i, (unsigned long) sum);
+  }
+  return 0;
+}